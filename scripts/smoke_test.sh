@@ -5,14 +5,12 @@ ROOT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)"
 BIN="$ROOT_DIR/build/MiniFileExplorer"
 TEST_DIR="$ROOT_DIR/.tmp_minifileexplorer_smoke_$$"
 
+# Removes the whole test directory, including fixtures left by a section
+# that failed or never cleaned up after itself.
 cleanup() {
   if [[ -d "$TEST_DIR" ]]; then
-    rm -f "$TEST_DIR"/note.txt "$TEST_DIR"/new_note.txt "$TEST_DIR"/big.bin "$TEST_DIR"/small.bin || true
-    rm -f "$TEST_DIR"/backup/note.txt || true
-    rmdir "$TEST_DIR"/backup 2>/dev/null || true
-    rm -f "$TEST_DIR"/data_file || true
-    rmdir "$TEST_DIR"/data 2>/dev/null || true
-    rmdir "$TEST_DIR" 2>/dev/null || true
+    chmod -R u+rwx "$TEST_DIR" 2>/dev/null || true
+    rm -rf "$TEST_DIR"
   fi
 }
 trap cleanup EXIT
@@ -59,6 +57,338 @@ if (( LINE_SMALL > LINE_BIG )); then
   exit 1
 fi
 
+echo "[smoke] stat multi-target"
+OUT_STAT="$(printf "stat big.bin *.bin missing.bin\nexit\n" | "$BIN" "$TEST_DIR")"
+if [[ "$(echo "$OUT_STAT" | grep -c "^Inode: ")" != "3" ]]; then
+  echo "[smoke][fail] stat did not report all targets"
+  exit 1
+fi
+echo "$OUT_STAT" | grep -F "Target not found: missing.bin" >/dev/null
+
+echo "[smoke] bulk touch / mkdir -p"
+OUT_BULK="$(printf "touch bulk{0..9}.tmp bulk3.tmp\nmkdir -p tree/a{1..3}/b\ntouch many{0..9999999}\nexit\n" | "$BIN" "$TEST_DIR")"
+echo "$OUT_BULK" | grep -F "File already exists: bulk3.tmp" >/dev/null
+echo "$OUT_BULK" | grep -F "Too many targets: many{0..9999999} expands to more than 4194304 names" >/dev/null
+if ls "$TEST_DIR" | grep -q '^many'; then
+  echo "[smoke][fail] oversized expansion was truncated instead of rejected"
+  exit 1
+fi
+if [[ "$(ls "$TEST_DIR" | grep -c '^bulk[0-9]\.tmp$')" != "10" || ! -d "$TEST_DIR/tree/a3/b" ]]; then
+  echo "[smoke][fail] bulk creation incomplete"
+  exit 1
+fi
+rm -f "$TEST_DIR"/bulk*.tmp
+rm -r "$TEST_DIR/tree"
+# Targets below other targets of the same command are created after them.
+OUT_BULK="$(printf "mkdir nest/x nest nest/x/y\ntouch nest/x/f\nvfs mem 10\nmkdir m m/n\ntouch m/n/f\nexit\n" | "$BIN" "$TEST_DIR")"
+if echo "$OUT_BULK" | grep -F "Failed to create" >/dev/null || [[ ! -d "$TEST_DIR/nest/x/y" ]]; then
+  echo "[smoke][fail] nested targets of one mkdir were not created"
+  exit 1
+fi
+rm -r "$TEST_DIR/nest"
+
+echo "[smoke] symlink policies"
+mkdir -p "$TEST_DIR/loop/inner"
+printf "0123456789" > "$TEST_DIR/loop/inner/ten.bin"
+ln -s .. "$TEST_DIR/loop/inner/up"
+OUT_LINK="$(printf "cd loop\nls\ndu -L inner\nsearch -L ten\nexit\n" | "$BIN" "$TEST_DIR")"
+echo "$OUT_LINK" | grep -F "inner/" >/dev/null
+if [[ "$(echo "$OUT_LINK" | grep -c "ten.bin (File)")" != "1" ]]; then
+  echo "[smoke][fail] search -L visited a directory twice"
+  exit 1
+fi
+rm -r "$TEST_DIR/loop"
+
+echo "[smoke] grep contents"
+printf "alpha\nneedle here\n" > "$TEST_DIR/haystack.txt"
+OUT_GREP="$(printf "grep needle\ngrep -l NEEDLE\ngrep -i -l NEEDLE\nexit\n" | "$BIN" "$TEST_DIR")"
+echo "$OUT_GREP" | grep -F "haystack.txt:2: needle here" >/dev/null
+echo "$OUT_GREP" | grep -F "No matches found for 'NEEDLE'" >/dev/null
+echo "$OUT_GREP" | grep -F "Found 'NEEDLE' in 1 files" >/dev/null
+rm -f "$TEST_DIR/haystack.txt"
+
+echo "[smoke] cat / head / tail"
+seq 1 50000 > "$TEST_DIR/lines.txt"
+OUT_PREVIEW="$(printf "head -n 2 lines.txt\ntail -n 2 lines.txt\nhead -n 99999999999999999999999 lines.txt\nexit\n" | "$BIN" "$TEST_DIR" | sed -e 's/^Enter command (type .help. for all commands): //')"
+echo "$OUT_PREVIEW" | grep -F "Invalid option: head" >/dev/null
+echo "$OUT_PREVIEW" | grep -F "MiniFileExplorer closed successfully" >/dev/null
+echo "$OUT_PREVIEW" | grep -x "2" >/dev/null
+echo "$OUT_PREVIEW" | grep -x "49999" >/dev/null
+if echo "$OUT_PREVIEW" | grep -x "3" >/dev/null; then
+  echo "[smoke][fail] head printed too many lines"
+  exit 1
+fi
+OUT_CAT="$(printf "cat lines.txt\nexit\n" | "$BIN" "$TEST_DIR" | grep -c "^[0-9]*$")"
+if [[ "$OUT_CAT" != "49999" ]]; then
+  echo "[smoke][fail] cat output incomplete ($OUT_CAT)"
+  exit 1
+fi
+rm -f "$TEST_DIR/lines.txt"
+
+echo "[smoke] tail -f"
+printf "first\n" > "$TEST_DIR/follow.log"
+FOLLOW_OUT="$TEST_DIR/follow.out"
+( (echo "tail -f follow.log"; sleep 2; echo "exit") | "$BIN" "$TEST_DIR" > "$FOLLOW_OUT" ) &
+FOLLOW_JOB=$!
+sleep 0.5
+printf "appended\n" >> "$TEST_DIR/follow.log"
+sleep 0.3
+pkill -INT -f "$BIN $TEST_DIR" || true
+wait "$FOLLOW_JOB"
+grep -x "appended" "$FOLLOW_OUT" >/dev/null
+grep -F "MiniFileExplorer closed successfully" "$FOLLOW_OUT" >/dev/null
+rm -f "$TEST_DIR/follow.log" "$FOLLOW_OUT"
+
+echo "[smoke] pack / unpack"
+mkdir -p "$TEST_DIR/arch/sub"
+seq 1 20000 > "$TEST_DIR/arch/sub/nums.txt"
+printf "x" > "$TEST_DIR/arch/one.txt"
+ln "$TEST_DIR/arch/one.txt" "$TEST_DIR/arch/sub/one_link.txt"
+OUT_PACK="$(printf "pack arch arch.tar.lz4\nunpack arch.tar.lz4 restored\nexit\n" | "$BIN" "$TEST_DIR")"
+echo "$OUT_PACK" | grep -F "Packed 5 entries into arch.tar.lz4" >/dev/null
+echo "$OUT_PACK" | grep -F "Unpacked 5 entries into restored" >/dev/null
+head -c 200 "$TEST_DIR/arch.tar.lz4" > "$TEST_DIR/broken.tar.lz4"
+OUT_PACK="$(printf "unpack broken.tar.lz4 junk\nexit\n" | "$BIN" "$TEST_DIR")"
+echo "$OUT_PACK" | grep -F "Failed to unpack archive: broken.tar.lz4" >/dev/null
+if echo "$OUT_PACK" | grep -F "entries into junk" >/dev/null; then
+  echo "[smoke][fail] unpack reported success after failing"
+  exit 1
+fi
+diff -r "$TEST_DIR/arch" "$TEST_DIR/restored/arch" >/dev/null
+# Hard links are packed once and restored as links to the same inode.
+[[ "$(stat -c %i "$TEST_DIR/restored/arch/one.txt")" == "$(stat -c %i "$TEST_DIR/restored/arch/sub/one_link.txt")" ]]
+rm -r "$TEST_DIR/arch" "$TEST_DIR/restored" "$TEST_DIR/arch.tar.lz4" "$TEST_DIR/broken.tar.lz4" "$TEST_DIR/junk"
+
+echo "[smoke] hash manifest"
+printf "abc" > "$TEST_DIR/abc.txt"
+OUT_HASH="$(printf "hash abc.txt\nhash -a xxh3 -o abc.xxh abc.txt\nhash --check abc.xxh\nexit\n" | "$BIN" "$TEST_DIR")"
+echo "$OUT_HASH" | grep -F "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad  abc.txt" >/dev/null
+echo "$OUT_HASH" | grep -F "Checked 1 files: 1 OK, 0 failed" >/dev/null
+rm -f "$TEST_DIR/abc.txt" "$TEST_DIR/abc.xxh"
+
+echo "[smoke] bulk rename"
+mkdir -p "$TEST_DIR/ren"
+printf "1" > "$TEST_DIR/ren/ab"
+printf "2" > "$TEST_DIR/ren/ba"
+printf "x" > "$TEST_DIR/ren/one.JPG"
+OUT_REN="$(printf "cd ren\nrename -n s/JPG/jpg/ *.JPG\nrename -y s/^(.)(.)\$/\$2\$1/ ab ba\nexit\n" | "$BIN" "$TEST_DIR")"
+echo "$OUT_REN" | grep -F "1 renames planned (dry run)" >/dev/null
+if [[ "$(cat "$TEST_DIR/ren/ab")" != "2" || ! -f "$TEST_DIR/ren/one.JPG" ]]; then
+  echo "[smoke][fail] rename swap or dry run wrong"
+  exit 1
+fi
+rm -r "$TEST_DIR/ren"
+# a254 -> a255 waits for a255 -> a256, which fails with ENAMETOOLONG
+mkdir -p "$TEST_DIR/ren"
+A254="$(printf 'a%.0s' $(seq 254))"
+touch "$TEST_DIR/ren/$A254" "$TEST_DIR/ren/${A254}a"
+OUT_REN="$(printf "cd ren\nrename -y s/^(a+)\$/\$1a/ *\nexit\n" | timeout 10 "$BIN" "$TEST_DIR")"
+echo "$OUT_REN" | grep -F "waits for a failed rename" >/dev/null
+echo "$OUT_REN" | grep -F "Renamed 0 entries (2 failed)" >/dev/null
+if [[ ! -f "$TEST_DIR/ren/$A254" || ! -f "$TEST_DIR/ren/${A254}a" || "$(ls -A "$TEST_DIR/ren" | wc -l)" -ne 2 ]]; then
+  echo "[smoke][fail] failed rename step lost or moved files"
+  exit 1
+fi
+rm -r "$TEST_DIR/ren"
+
+echo "[smoke] trash and undo"
+mkdir -p "$TEST_DIR/tr/home" "$TEST_DIR/tr/sub"
+printf "keep" > "$TEST_DIR/tr/doc.txt"
+printf "move" > "$TEST_DIR/tr/m.txt"
+OUT_TRASH="$(printf "cd tr\ntrash on\nrm doc.txt\ny\nmv m.txt sub/\nundo 2\nexit\n" | HOME="$TEST_DIR/tr/home" "$BIN" "$TEST_DIR")"
+echo "$OUT_TRASH" | grep -F "Restored: " >/dev/null
+if [[ "$(cat "$TEST_DIR/tr/doc.txt")" != "keep" || ! -f "$TEST_DIR/tr/m.txt" ]]; then
+  echo "[smoke][fail] undo did not restore trashed or moved file"
+  exit 1
+fi
+# "trash purge" also removes empty files; undo then drops the purged record
+# and goes on with the older move.
+printf "p" > "$TEST_DIR/tr/p"
+: > "$TEST_DIR/tr/empty"
+OUT_TRASH="$( (printf "cd tr\ntrash on\nmv p q\nrm empty\ny\ntrash purge\n"; sleep 1; printf "undo\nexit\n") | HOME="$TEST_DIR/tr/home" "$BIN" "$TEST_DIR")"
+echo "$OUT_TRASH" | grep -F "Cannot undo: $TEST_DIR/tr/empty was purged from trash" >/dev/null
+echo "$OUT_TRASH" | grep -F "Moved back: $TEST_DIR/tr/q -> $TEST_DIR/tr/p" >/dev/null
+if [[ -e "$TEST_DIR/tr/empty" || ! -f "$TEST_DIR/tr/p" ]]; then
+  echo "[smoke][fail] undo stopped at a purged trash entry"
+  exit 1
+fi
+rm -r "$TEST_DIR/tr"
+
+echo "[smoke] sync"
+mkdir -p "$TEST_DIR/sy/src/sub" "$TEST_DIR/sy/dst/stale"
+printf "one" > "$TEST_DIR/sy/src/sub/one.txt"
+printf "old" > "$TEST_DIR/sy/dst/stale/gone.txt"
+OUT_SYNC="$(printf "cd sy\nsync --delete src dst\nsync src dst\nexit\n" | "$BIN" "$TEST_DIR")"
+echo "$OUT_SYNC" | grep -F "Synced src -> dst: 1 copied (3 bytes written), 2 deleted, 0 unchanged" >/dev/null
+echo "$OUT_SYNC" | grep -F "Synced src -> dst: 0 copied (0 bytes written), 0 deleted, 1 unchanged" >/dev/null
+if [[ "$(cat "$TEST_DIR/sy/dst/sub/one.txt")" != "one" || -e "$TEST_DIR/sy/dst/stale" ]]; then
+  echo "[smoke][fail] sync did not mirror the tree"
+  exit 1
+fi
+# A source inside the destination (also through a symbolic link) would be
+# an extra entry for --delete; both directions are refused.
+mkdir -p "$TEST_DIR/sy/d/sub"
+printf "keep" > "$TEST_DIR/sy/d/sub/f"
+ln -s d "$TEST_DIR/sy/alias"
+OUT_SYNC="$(printf "cd sy\nsync d/sub d --delete\nsync d/sub alias --delete\nsync d d/sub/inner\nexit\n" | "$BIN" "$TEST_DIR")"
+if [[ "$(echo "$OUT_SYNC" | grep -c "Invalid target path")" != "3" || "$(cat "$TEST_DIR/sy/d/sub/f")" != "keep" ]]; then
+  echo "[smoke][fail] sync accepted nested trees"
+  exit 1
+fi
+rm -r "$TEST_DIR/sy"
+
+echo "[smoke] delta overwrite"
+head -c 17000000 /dev/zero > "$TEST_DIR/dsrc.bin"
+cp "$TEST_DIR/dsrc.bin" "$TEST_DIR/ddst.bin"
+printf "X" | dd of="$TEST_DIR/dsrc.bin" bs=1 seek=9000000 conv=notrunc status=none
+OUT_DELTA="$(printf "cp dsrc.bin ddst.bin\ny\nexit\n" | "$BIN" "$TEST_DIR")"
+echo "$OUT_DELTA" | grep -F "Updated in place: 4096 of 17000000 bytes written" >/dev/null
+cmp -s "$TEST_DIR/dsrc.bin" "$TEST_DIR/ddst.bin"
+rm -f "$TEST_DIR/dsrc.bin" "$TEST_DIR/ddst.bin"
+
+echo "[smoke] analyze and largest"
+mkdir -p "$TEST_DIR/an/deep/er"
+printf "12345" > "$TEST_DIR/an/deep/er/five.log"
+printf "1" > "$TEST_DIR/an/one.txt"
+OUT_AN="$(printf "analyze -n 2 an\nexit\n" | "$BIN" "$TEST_DIR")"
+echo "$OUT_AN" | grep -F "Analysis of an: 2 files, 2 directories, 0 other, 6 B" >/dev/null
+echo "$OUT_AN" | grep -E "^ +3  an/deep/er/five.log$" >/dev/null
+OUT_BIG="$(printf "largest -n 1 an\nexit\n" | "$BIN" "$TEST_DIR")"
+echo "$OUT_BIG" | grep -E "^ +5 B  an/deep/er/five.log$" >/dev/null
+rm -r "$TEST_DIR/an"
+
+echo "[smoke] prune"
+mkdir -p "$TEST_DIR/pr/old" "$TEST_DIR/pr/mix"
+printf "aaaa" > "$TEST_DIR/pr/old/a.log"
+printf "bb" > "$TEST_DIR/pr/mix/b.log"
+printf "c" > "$TEST_DIR/pr/mix/c.log"
+touch -d "30 days ago" "$TEST_DIR/pr/old/a.log" "$TEST_DIR/pr/mix/b.log"
+OUT_PRUNE="$(printf "prune --older-than 14d --keep 00 --dry-run pr\nprune --older-than 14d pr\nexit\n" | "$BIN" "$TEST_DIR")"
+echo "$OUT_PRUNE" | grep -F "Would prune 2 files and 1 directories, freeing 6 B (dry run)" >/dev/null
+echo "$OUT_PRUNE" | grep -F "Pruned 2 files and 1 directories, freed 6 B" >/dev/null
+if [[ -e "$TEST_DIR/pr/old" || ! -f "$TEST_DIR/pr/mix/c.log" ]]; then
+  echo "[smoke][fail] prune removed the wrong entries"
+  exit 1
+fi
+rm -r "$TEST_DIR/pr"
+
+echo "[smoke] memory vfs"
+OUT_VFS="$(printf "vfs mem 1000 --fanout 10\nanalyze -n 1 .\nmkdir -p only/in/memory\ntouch only/x\nrmdir only/in/memory\nvfs latency 50 10\nls\nvfs\ncat x\nvfs latency 20 +0\nexit\n" | "$BIN" "$TEST_DIR")"
+echo "$OUT_VFS" | grep -F "VFS: latency 20us +/- 0us over memory" >/dev/null
+echo "$OUT_VFS" | grep -F "VFS: memory (1000 files in 110 directories)" >/dev/null
+echo "$OUT_VFS" | grep -F "Analysis of .: 1000 files, 110 directories, 0 other" >/dev/null
+echo "$OUT_VFS" | grep -F "VFS: latency 50us +/- 10us over memory" >/dev/null
+echo "$OUT_VFS" | grep -F "Not supported on the memory VFS: cat" >/dev/null
+if [[ -e "$TEST_DIR/only" ]]; then
+  echo "[smoke][fail] memory vfs touched the real file system"
+  exit 1
+fi
+
+echo "[smoke] resumable walks"
+mkdir -p "$TEST_DIR/walk/a" "$TEST_DIR/walk/b"
+head -c 3000 /dev/zero > "$TEST_DIR/walk/a/f"
+OUT_RESUME="$(printf "du --resume walk\ndu -L --resume walk\nexit\n" | XDG_STATE_HOME="$TEST_DIR/state" "$BIN" "$TEST_DIR")"
+echo "$OUT_RESUME" | grep -F "No checkpoint to resume for du walk; starting from the beginning" >/dev/null
+echo "$OUT_RESUME" | grep -F "Total size of walk: 3 KB" >/dev/null
+echo "$OUT_RESUME" | grep -F "Invalid option: --resume needs a physical walk on the posix VFS" >/dev/null
+if [[ -n "$(ls -A "$TEST_DIR/state/MiniFileExplorer" 2>/dev/null)" ]]; then
+  echo "[smoke][fail] checkpoint left behind after a completed walk"
+  exit 1
+fi
+
+echo "[smoke] walk stats"
+OUT_STATS="$(printf "du --stats walk\nsearch --stats f\nexit\n" | "$BIN" "$TEST_DIR")"
+echo "$OUT_STATS" | grep -F "Total size of walk: 3 KB" >/dev/null
+echo "$OUT_STATS" | grep -E "^Walk: [0-9]+ workers" >/dev/null
+echo "$OUT_STATS" | grep -E "^  .* \(.*, (ssd|rotational|network|other), cap [0-9]+\): 3 directories, 3 entries" >/dev/null
+echo "$OUT_STATS" | grep -E "^    concurrency [0-9]+ \(adapted between [0-9]+ and [0-9]+\), [0-9]+ entries/s" >/dev/null
+
+echo "[smoke] stat order"
+OUT_ORDER="$(printf "statorder\nls -s\nstatorder inode\nls -s\nstatorder sideways\nstatorder readdir\nexit\n" | "$BIN" --stat-order auto "$TEST_DIR/walk")"
+echo "$OUT_ORDER" | grep -F "Stat order: auto (inode order on rotational devices)" >/dev/null
+echo "$OUT_ORDER" | grep -F "Stat order: inode" >/dev/null
+echo "$OUT_ORDER" | grep -F "Invalid option: sideways" >/dev/null
+echo "$OUT_ORDER" | grep -F "Stat order: readdir" >/dev/null
+if [[ "$(echo "$OUT_ORDER" | grep -c "a/")" -ne 2 ]]; then
+  echo "[smoke][fail] ls -s differs between stat orders"
+  exit 1
+fi
+
+echo "[smoke] bounded search"
+mkdir -p "$TEST_DIR/bfs/a/b/c" "$TEST_DIR/bfs/z"
+touch "$TEST_DIR/bfs/a/b/c/cfg_deep" "$TEST_DIR/bfs/z/cfg_near" "$TEST_DIR/bfs/a/b/cfg_mid"
+OUT_BOUNDED="$(printf "search --bfs --max-results 1 cfg\nsearch --max-depth 3 cfg\nsearch --max-results x cfg\nsearch --bfs --resume cfg\nexit\n" | "$BIN" "$TEST_DIR/bfs")"
+echo "$OUT_BOUNDED" | grep -F "Search results for 'cfg' (1 items):" >/dev/null
+echo "$OUT_BOUNDED" | grep -F "$TEST_DIR/bfs/z/cfg_near (File)" >/dev/null
+echo "$OUT_BOUNDED" | grep -F "Stopped after 1 results" >/dev/null
+echo "$OUT_BOUNDED" | grep -F "Search results for 'cfg' (2 items):" >/dev/null
+echo "$OUT_BOUNDED" | grep -F "Invalid option: --max-results" >/dev/null
+echo "$OUT_BOUNDED" | grep -F "Invalid option: --resume cannot be combined with --max-results, --max-depth or --bfs" >/dev/null
+if echo "$OUT_BOUNDED" | grep -F "cfg_deep" >/dev/null; then
+  echo "[smoke][fail] bounded search went too deep"
+  exit 1
+fi
+
+echo "[smoke] approximate du"
+OUT_APPROX="$(printf "du --approx walk\ndu --error 150%% walk\nvfs mem 20000 --fanout 8\ndu --approx --error 10%% .\nexit\n" | "$BIN" "$TEST_DIR")"
+echo "$OUT_APPROX" | grep -F "Total size of walk: 2.9 KB in 1 files (exact: all 3 directories were listed)" >/dev/null
+echo "$OUT_APPROX" | grep -F "Invalid option: --error" >/dev/null
+echo "$OUT_APPROX" | grep -E "Estimated size of \.: .* \+/- [0-9.]+% \(95% interval" >/dev/null
+mkdir -p "$TEST_DIR/sparse"
+for i in $(seq 1 300); do mkdir "$TEST_DIR/sparse/d$i"; done
+truncate -s 10G "$TEST_DIR/sparse/d7/big"
+OUT_SPARSE="$(printf "du --approx sparse\nexit\n" | "$BIN" "$TEST_DIR")"
+echo "$OUT_SPARSE" | grep -F "Total size of sparse: 10.0 GB in 1 files (exact: all 301 directories were listed)" >/dev/null
+rm -r "$TEST_DIR/sparse"
+
+echo "[smoke] throttle"
+head -c 300000 /dev/urandom > "$TEST_DIR/throttled.bin"
+OUT_THROTTLE="$(printf "throttle --max-iops 100000 --max-bandwidth 64M\ncp throttled.bin throttled.copy\ndu walk\nthrottle --max-bandwidth x\nthrottle off\nexit\n" | XDG_STATE_HOME="$TEST_DIR/state" "$BIN" --max-iops 5000 "$TEST_DIR")"
+echo "$OUT_THROTTLE" | grep -F "I/O throttle: 100000 IOPS, 64.0 MB/s" >/dev/null
+echo "$OUT_THROTTLE" | grep -F "Total size of walk: 3 KB" >/dev/null
+echo "$OUT_THROTTLE" | grep -F "Invalid option: --max-bandwidth" >/dev/null
+echo "$OUT_THROTTLE" | grep -F "I/O throttle: off" >/dev/null
+cmp "$TEST_DIR/throttled.bin" "$TEST_DIR/throttled.copy"
+# Two instances limited to 1 MB/s share one budget: copying 600 KB each
+# takes about a second together, against half a second alone.
+head -c 600000 /dev/zero > "$TEST_DIR/throttled.bin"
+START_NS="$(date +%s%N)"
+printf "cp throttled.bin throttled.a\nexit\n" | XDG_STATE_HOME="$TEST_DIR/state" "$BIN" --max-bandwidth 1M "$TEST_DIR" >/dev/null &
+printf "cp throttled.bin throttled.b\nexit\n" | XDG_STATE_HOME="$TEST_DIR/state" "$BIN" --max-bandwidth 1M "$TEST_DIR" >/dev/null
+wait
+ELAPSED_MS="$(( ($(date +%s%N) - START_NS) / 1000000 ))"
+if (( ELAPSED_MS < 900 )); then
+  echo "[smoke][fail] two throttled instances finished in ${ELAPSED_MS} ms"
+  exit 1
+fi
+cmp "$TEST_DIR/throttled.bin" "$TEST_DIR/throttled.a"
+cmp "$TEST_DIR/throttled.bin" "$TEST_DIR/throttled.b"
+
+echo "[smoke] trace"
+OUT_TRACE="$(printf "du walk\nexit\n" | "$BIN" --trace "$TEST_DIR/trace.json" "$TEST_DIR")"
+echo "$OUT_TRACE" | grep -F "Trace written to $TEST_DIR/trace.json" >/dev/null
+grep -F '"traceEvents"' "$TEST_DIR/trace.json" >/dev/null
+grep -F '"name":"list_dir"' "$TEST_DIR/trace.json" >/dev/null
+grep -F '"name":"du"' "$TEST_DIR/trace.json" >/dev/null
+# A relative --trace path names a file in the launch directory, even after
+# the initial directory argument and later cd commands.
+(cd "$TEST_DIR" && printf "cd a\nexit\n" | "$BIN" --trace rel_trace.json walk >/dev/null)
+grep -F '"traceEvents"' "$TEST_DIR/rel_trace.json" >/dev/null
+
+echo "[smoke] audit journal"
+mkdir -p "$TEST_DIR/audit"
+OUT_JOURNAL="$(printf "mkdir a\ntouch f g\ntouch f\nmv g a/\ncp f a/h\nrm f\ny\njournal show --op touch --failed\njournal show --path a/g\nexit\n" | "$BIN" --journal "$TEST_DIR/audit.journal" "$TEST_DIR/audit")"
+echo "$OUT_JOURNAL" | grep -F "touch $TEST_DIR/audit/f  failed: File exists" >/dev/null
+echo "$OUT_JOURNAL" | grep -F "Shown 1 of 8 records" >/dev/null
+echo "$OUT_JOURNAL" | grep -F "mv $TEST_DIR/audit/g -> $TEST_DIR/audit/a/g" >/dev/null
+OUT_JOURNAL="$(printf "journal show %s --op rm\nexit\n" "$TEST_DIR/audit.journal" | "$BIN" "$TEST_DIR")"
+echo "$OUT_JOURNAL" | grep -F "rm $TEST_DIR/audit/f" >/dev/null
+OUT_JOURNAL="$(printf "mkdir -p p/q/r\nmkdir -p p/q\njournal show --op mkdir --path audit/p\nexit\n" | "$BIN" --journal "$TEST_DIR/audit.journal" "$TEST_DIR/audit")"
+echo "$OUT_JOURNAL" | grep -F "mkdir $TEST_DIR/audit/p" >/dev/null
+echo "$OUT_JOURNAL" | grep -F "mkdir $TEST_DIR/audit/p/q" >/dev/null
+echo "$OUT_JOURNAL" | grep -F "mkdir $TEST_DIR/audit/p/q/r" >/dev/null
+echo "$OUT_JOURNAL" | grep -F "Shown 3 of " >/dev/null
+
 echo "[smoke] core commands"
 OUT_MAIN="$(
   printf "help\nstat\nmkdir data\nmkdir data\ntouch note.txt\ntouch note.txt\nls\nstat note.txt\nsearch note\nmkdir backup\ncp note.txt backup/\ncp note.txt backup/\nn\ncp note.txt backup/\ny\nmv note.txt new_note.txt\ndu backup\nrm new_note.txt\nn\nrm new_note.txt\ny\nrmdir no_such\nexit\n" | "$BIN" "$TEST_DIR"
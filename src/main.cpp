@@ -1,19 +1,61 @@
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <cstdlib>
 #include <cctype>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
 #include <ctime>
+#include <condition_variable>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <random>
+#include <regex>
+#include <set>
+#include <shared_mutex>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <glob.h>
 #include <pwd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 static std::string GetCwd() {
   char* cwd = ::getcwd(nullptr, 0);
   if (!cwd) {
@@ -36,6 +78,29 @@ static std::string GetHomeDir() {
   return {};
 }
 
+// $XDG_STATE_HOME (default ~/.local/state)/MiniFileExplorer: walk
+// checkpoints and the audit journal.
+static std::string StateDir() {
+  const char* state_home = std::getenv("XDG_STATE_HOME");
+  if (state_home != nullptr && state_home[0] == '/') {
+    return std::string(state_home) + "/MiniFileExplorer";
+  }
+  return GetHomeDir() + "/.local/state/MiniFileExplorer";
+}
+
+// Creates dir and its missing parents on the real file system.
+static bool MakeStateDir(const std::string& dir) {
+  for (size_t slash = dir.find('/', 1); ; slash = dir.find('/', slash + 1)) {
+    const std::string prefix = dir.substr(0, slash);
+    if (::mkdir(prefix.c_str(), 0700) != 0 && errno != EEXIST) {
+      return false;
+    }
+    if (slash == std::string::npos) {
+      return true;
+    }
+  }
+}
+
 static std::string ToLowerAscii(std::string value) {
   for (char& ch : value) {
     ch = static_cast<char>(std::tolower(static_cast<unsigned char>(ch)));
@@ -43,13 +108,9 @@ static std::string ToLowerAscii(std::string value) {
   return value;
 }
 
-static std::time_t FileTimeToTimeT(std::filesystem::file_time_type file_time) {
-  using namespace std::chrono;
-  const auto system_time =
-      time_point_cast<system_clock::duration>(file_time -
-                                             std::filesystem::file_time_type::clock::now() +
-                                             system_clock::now());
-  return system_clock::to_time_t(system_time);
+static bool EndsWith(const std::string& value, const std::string& suffix) {
+  return value.size() >= suffix.size() &&
+         value.compare(value.size() - suffix.size(), suffix.size(), suffix) == 0;
 }
 
 static std::string FormatLocalTime(std::time_t time_value) {
@@ -71,15 +132,41 @@ static void PrintHelp() {
   std::cout << "  ls: List all files and directories\n";
   std::cout << "  ls -s: List and sort by size (desc)\n";
   std::cout << "  ls -t: List and sort by modify time (desc)\n";
-  std::cout << "  touch [file]: Create an empty file\n";
-  std::cout << "  mkdir [dir]: Create an empty directory\n";
+  std::cout << "  ls/stat/search/du -L|-P: Follow symbolic links / never follow (default)\n";
+  std::cout << "  touch [file...]: Create empty files (supports f{0..99} braces)\n";
+  std::cout << "  mkdir [-p] [dir...]: Create directories (-p: create parents)\n";
   std::cout << "  rm [file]: Delete a file (with confirmation)\n";
   std::cout << "  rmdir [dir]: Delete an empty directory\n";
-  std::cout << "  stat [name]: Show detailed information\n";
-  std::cout << "  search [keyword]: Search files and directories recursively\n";
+  std::cout << "  trash on|off|status|purge: Make rm/rmdir move entries to a trash directory\n";
+  std::cout << "  trash budget [size]: Keep at most size bytes of trash per filesystem\n";
+  std::cout << "  undo [N]: Undo the last N rm/rmdir (trash mode) and mv operations\n";
+  std::cout << "  stat [name...]: Show detailed information (supports wildcards)\n";
+  std::cout << "  search [--resume] [--stats] [keyword]: Search files and directories recursively\n";
+  std::cout << "  search [--max-results N] [--max-depth D] [--bfs] [keyword]: Stop after N matches, D levels down; --bfs finds the shallowest first\n";
+  std::cout << "  grep [-i] [-l] [pattern] [dir]: Search file contents recursively\n";
+  std::cout << "  cat [file...]: Print file contents\n";
+  std::cout << "  head [-n N] [file]: Print the first N lines (default 10)\n";
+  std::cout << "  tail [-n N] [-f] [file]: Print the last N lines (-f: follow, Ctrl-C stops)\n";
   std::cout << "  cp [src] [dst]: Copy a file\n";
   std::cout << "  mv [src] [dst]: Move/rename a file or directory\n";
-  std::cout << "  du [dir]: Calculate total directory size\n";
+  std::cout << "  sync [--delete] [--checksum] [src] [dst]: Copy new and changed files from src to dst\n";
+  std::cout << "  rename [-n] [-y] s/old/new/[gi] [name...]: Rename many entries at once\n";
+  std::cout << "  du [--resume] [--stats] [dir]: Calculate total directory size\n";
+  std::cout << "  du --approx [--error 5%] [dir]: Estimate the size by random descents with a 95% interval\n";
+  std::cout << "  du/search --resume: Continue a walk stopped by Ctrl-C from its checkpoint\n";
+  std::cout << "  du/search --stats: Show how the walk was spread over devices\n";
+  std::cout << "  analyze [-n N] [dir]: Summarize a tree by extension, size, age and depth\n";
+  std::cout << "  largest [-n N] [dir]: List the N biggest files in a tree (default 10)\n";
+  std::cout << "  prune --older-than [age] [--keep N] [--dry-run] [dir]: Delete old files (age: 14d, 12h, ...)\n";
+  std::cout << "  hash [-a sha256|xxh3|crc32c] [-o manifest] [file|dir...]: Print digests\n";
+  std::cout << "  hash --check [manifest]: Verify a digest manifest\n";
+  std::cout << "  pack [dir] [out.tar|out.tar.lz4]: Archive a directory\n";
+  std::cout << "  unpack [archive] [dir]: Extract a .tar or .tar.lz4 archive\n";
+  std::cout << "  vfs [status|posix|mem [N] [--fanout F]|latency [us] [jitter_us]]: Select the file system backend\n";
+  std::cout << "  journal on [file] [--fsync-every N] [--fsync-ms MS]|off|status: Audit rm/rmdir/mv/cp/touch/mkdir\n";
+  std::cout << "  journal show [--op OP] [--since AGE] [--path TEXT] [--failed] [file]: Decode the audit journal\n";
+  std::cout << "  throttle [--max-iops N] [--max-bandwidth size] [--idle] | off: Limit walk and copy I/O\n";
+  std::cout << "  statorder [auto|inode|readdir]: Order of the stat calls when listing a directory\n";
   std::cout << "  help: Show all commands\n";
   std::cout << "  exit: Exit the program\n";
 }
@@ -153,493 +240,8271 @@ static std::optional<std::vector<std::string>> TokenizeCommandLine(
   return tokens;
 }
 
-struct LsItem {
-  std::string name;
-  std::string type;
-  std::string size;
-  std::string modify_time;
-  std::uintmax_t size_bytes = 0;
-  std::time_t modify_time_t = 0;
-  bool is_dir = false;
-  bool is_empty_dir = false;
-};
-
-static std::uintmax_t CalculateDirectorySizeBytes(
-    const std::filesystem::path& dir_path);
-
-static void HandleLsCommand(const std::vector<std::string>& tokens) {
-  enum class Mode {
-    kNormal,
-    kSortSize,
-    kSortTime,
-  };
-  Mode mode = Mode::kNormal;
-  if (tokens.size() == 2) {
-    if (tokens[1] == "-s") {
-      mode = Mode::kSortSize;
-    } else if (tokens[1] == "-t") {
-      mode = Mode::kSortTime;
-    } else {
-      std::cout << "Invalid option: ls\n";
-      return;
-    }
-  } else if (tokens.size() != 1) {
-    std::cout << "Invalid option: ls\n";
-    return;
-  }
+static bool HasGlobMeta(const std::string& value) {
+  return value.find_first_of("*?[") != std::string::npos;
+}
 
-  namespace fs = std::filesystem;
-  std::error_code ec;
-  const fs::path dir = fs::current_path(ec);
-  if (ec) {
-    std::cout << "Failed to access current directory\n";
-    return;
+// Expands shell-style wildcards; patterns without matches are kept verbatim so
+// that callers can report them as missing targets.
+static std::vector<std::string> ExpandGlob(const std::string& pattern) {
+  if (!HasGlobMeta(pattern)) {
+    return {pattern};
   }
-
-  std::vector<LsItem> items;
-  for (fs::directory_iterator it(dir, fs::directory_options::skip_permission_denied, ec);
-       !ec && it != fs::directory_iterator(); it.increment(ec)) {
-    const fs::directory_entry& entry = *it;
-    const fs::path path = entry.path();
-    const std::string filename = path.filename().string();
-
-    std::error_code entry_ec;
-    const bool is_dir = entry.is_directory(entry_ec);
-    const bool is_file = entry.is_regular_file(entry_ec);
-
-    LsItem item;
-    item.is_dir = is_dir;
-    item.name = filename + (is_dir ? "/" : "");
-    item.type = is_dir ? "Dir" : "File";
-
-    if (mode == Mode::kSortSize && is_dir) {
-      std::error_code empty_ec;
-      item.is_empty_dir = fs::is_empty(path, empty_ec) && !empty_ec;
-      item.size_bytes = CalculateDirectorySizeBytes(path);
-      item.size = std::to_string(item.size_bytes);
-    } else if (is_file) {
-      std::error_code size_ec;
-      const auto size_value = fs::file_size(path, size_ec);
-      item.size_bytes = size_ec ? 0 : size_value;
-      item.size = size_ec ? "-" : std::to_string(size_value);
-    } else if (is_dir) {
-      item.size = "-";
-      item.size_bytes = 0;
-    } else {
-      item.size = "-";
-      item.size_bytes = 0;
+  glob_t g{};
+  std::vector<std::string> result;
+  if (::glob(pattern.c_str(), GLOB_NOCHECK, nullptr, &g) == 0) {
+    for (size_t i = 0; i < g.gl_pathc; ++i) {
+      result.emplace_back(g.gl_pathv[i]);
     }
+  } else {
+    result.push_back(pattern);
+  }
+  ::globfree(&g);
+  return result;
+}
 
-    std::error_code time_ec;
-    const auto ftime = fs::last_write_time(path, time_ec);
-    item.modify_time_t = time_ec ? 0 : FileTimeToTimeT(ftime);
-    item.modify_time = time_ec ? "-" : FormatLocalTime(item.modify_time_t);
+// Expands bash-style braces: lists ("{a,b}") and ranges ("{0..99}",
+// "{a..e}", zero padded when an endpoint has a leading zero). One argument
+// may expand to at most kMaxExpandedTargets names.
+static constexpr size_t kMaxExpandedTargets = size_t{1} << 22;
 
-    items.push_back(std::move(item));
+// Returns false if body is not a range; sets *too_many for a range longer
+// than kMaxExpandedTargets.
+static bool ExpandBraceRange(const std::string& body,
+                             std::vector<std::string>* items, bool* too_many) {
+  const size_t dots = body.find("..");
+  if (dots == std::string::npos || dots == 0 || dots + 2 >= body.size()) {
+    return false;
   }
-
-  if (mode == Mode::kSortTime) {
-    std::sort(items.begin(), items.end(), [](const LsItem& a, const LsItem& b) {
-      if (a.modify_time_t != b.modify_time_t) {
-        return a.modify_time_t > b.modify_time_t;
-      }
-      return a.name < b.name;
-    });
-  } else if (mode == Mode::kSortSize) {
-    std::sort(items.begin(), items.end(), [](const LsItem& a, const LsItem& b) {
-      if (a.is_empty_dir != b.is_empty_dir) {
-        return !a.is_empty_dir;
+  const std::string lo = body.substr(0, dots);
+  const std::string hi = body.substr(dots + 2);
+  if (lo.size() == 1 && hi.size() == 1 && std::isalpha(static_cast<unsigned char>(lo[0])) &&
+      std::isalpha(static_cast<unsigned char>(hi[0]))) {
+    const int step = lo[0] <= hi[0] ? 1 : -1;
+    for (int ch = lo[0];; ch += step) {
+      items->push_back(std::string(1, static_cast<char>(ch)));
+      if (ch == hi[0]) {
+        break;
       }
-      if (a.size_bytes != b.size_bytes) {
-        return a.size_bytes > b.size_bytes;
+    }
+    return true;
+  }
+  auto is_number = [](const std::string& v) {
+    size_t i = (v[0] == '-') ? 1 : 0;
+    if (i >= v.size()) {
+      return false;
+    }
+    for (; i < v.size(); ++i) {
+      if (!std::isdigit(static_cast<unsigned char>(v[i]))) {
+        return false;
       }
-      return a.name < b.name;
-    });
+    }
+    return true;
+  };
+  if (!is_number(lo) || !is_number(hi) || lo.size() > 18 || hi.size() > 18) {
+    return false;
   }
-
-  size_t name_w = std::string("Name").size();
-  size_t type_w = std::string("Type").size();
-  size_t size_w = std::string("Size(B)").size();
-  for (const auto& item : items) {
-    name_w = std::max(name_w, item.name.size());
-    type_w = std::max(type_w, item.type.size());
-    size_w = std::max(size_w, item.size.size());
+  auto padded = [](const std::string& v) {
+    const size_t i = (v[0] == '-') ? 1 : 0;
+    return v.size() > i + 1 && v[i] == '0';
+  };
+  const size_t width = (padded(lo) || padded(hi)) ? std::max(lo.size(), hi.size()) : 0;
+  const long long a = std::stoll(lo);
+  const long long b = std::stoll(hi);
+  const long long step = a <= b ? 1 : -1;
+  if (static_cast<unsigned long long>((b - a) * step) >= kMaxExpandedTargets) {
+    *too_many = true;
+    return true;
   }
-
-  std::cout << std::left << std::setw(static_cast<int>(name_w)) << "Name"
-            << " " << std::left << std::setw(static_cast<int>(type_w)) << "Type"
-            << " " << std::right << std::setw(static_cast<int>(size_w)) << "Size(B)"
-            << " " << "Modify Time" << "\n";
-
-  for (const auto& item : items) {
-    std::cout << std::left << std::setw(static_cast<int>(name_w)) << item.name
-              << " " << std::left << std::setw(static_cast<int>(type_w)) << item.type
-              << " " << std::right << std::setw(static_cast<int>(size_w)) << item.size
-              << " " << item.modify_time << "\n";
+  for (long long v = a;; v += step) {
+    std::string text = std::to_string(v < 0 ? -v : v);
+    const size_t digits = width > (v < 0 ? 1 : 0) ? width - (v < 0 ? 1 : 0) : 0;
+    if (text.size() < digits) {
+      text.insert(0, digits - text.size(), '0');
+    }
+    items->push_back(v < 0 ? "-" + text : text);
+    if (v == b) {
+      break;
+    }
   }
+  return true;
 }
 
-static void HandleTouchCommand(const std::vector<std::string>& tokens) {
-  if (tokens.size() < 2) {
-    std::cout << "Missing filename: Please enter 'touch [name]'\n";
-    return;
-  }
-  const std::string& name = tokens[1];
+// Returns false if the expansion would exceed kMaxExpandedTargets names.
+static bool ExpandBracesInto(const std::string& word,
+                             std::vector<std::string>* out) {
+  for (size_t open = word.find('{'); open != std::string::npos;
+       open = word.find('{', open + 1)) {
+    int depth = 0;
+    size_t close = std::string::npos;
+    std::vector<size_t> commas;
+    for (size_t i = open; i < word.size(); ++i) {
+      if (word[i] == '{') {
+        ++depth;
+      } else if (word[i] == '}') {
+        if (--depth == 0) {
+          close = i;
+          break;
+        }
+      } else if (word[i] == ',' && depth == 1) {
+        commas.push_back(i);
+      }
+    }
+    if (close == std::string::npos) {
+      break;
+    }
 
-  namespace fs = std::filesystem;
-  std::error_code ec;
-  if (fs::exists(fs::path(name), ec) && !ec) {
-    std::cout << "File already exists: " << name << "\n";
-    return;
-  }
+    std::vector<std::string> items;
+    const std::string body = word.substr(open + 1, close - open - 1);
+    bool too_many = false;
+    if (!commas.empty()) {
+      size_t begin = open + 1;
+      for (size_t comma : commas) {
+        items.push_back(word.substr(begin, comma - begin));
+        begin = comma + 1;
+      }
+      items.push_back(word.substr(begin, close - begin));
+    } else if (!ExpandBraceRange(body, &items, &too_many)) {
+      continue;
+    }
+    if (too_many) {
+      return false;
+    }
 
-  std::ofstream out(name, std::ios::out | std::ios::binary);
-  if (!out) {
-    std::cout << "Failed to create file: " << name << "\n";
-    return;
+    const std::string prefix = word.substr(0, open);
+    const std::string suffix = word.substr(close + 1);
+    for (const auto& item : items) {
+      if (out->size() >= kMaxExpandedTargets ||
+          !ExpandBracesInto(prefix + item + suffix, out)) {
+        return false;
+      }
+    }
+    return true;
   }
+  out->push_back(word);
+  return true;
 }
 
-static void HandleMkdirCommand(const std::vector<std::string>& tokens) {
-  if (tokens.size() < 2) {
-    std::cout << "Missing directory name: Please enter 'mkdir [name]'\n";
-    return;
+// Turns command arguments into the final target list: braces first, then
+// wildcards, in the same order as a POSIX shell. An argument that expands to
+// too many names is reported and the whole list comes back empty, so the
+// command does nothing rather than act on a truncated list.
+static std::vector<std::string> ExpandTargets(
+    const std::vector<std::string>& args) {
+  std::vector<std::string> targets;
+  for (const auto& arg : args) {
+    std::vector<std::string> words;
+    if (!ExpandBracesInto(arg, &words)) {
+      std::cout << "Too many targets: " << arg << " expands to more than "
+                << kMaxExpandedTargets << " names\n";
+      return {};
+    }
+    for (const auto& word : words) {
+      if (!HasGlobMeta(word)) {
+        targets.push_back(word);
+        continue;
+      }
+      std::vector<std::string> expanded = ExpandGlob(word);
+      targets.insert(targets.end(), std::make_move_iterator(expanded.begin()),
+                     std::make_move_iterator(expanded.end()));
+    }
   }
-  const std::string& name = tokens[1];
+  return targets;
+}
 
-  namespace fs = std::filesystem;
-  std::error_code ec;
-  if (fs::exists(fs::path(name), ec) && !ec) {
-    std::cout << "Directory already exists: " << name << "\n";
-    return;
-  }
+static unsigned DefaultWorkerCount() {
+  const unsigned hw = std::thread::hardware_concurrency();
+  return hw == 0 ? 1 : hw;
+}
 
-  if (!fs::create_directory(fs::path(name), ec) || ec) {
-    std::cout << "Failed to create directory: " << name << "\n";
+// Splits [0, count) into contiguous chunks and runs fn(begin, end) on worker
+// threads; small inputs stay on the calling thread.
+template <typename Fn>
+static void ParallelFor(size_t count, size_t min_chunk, Fn&& fn) {
+  const size_t workers = std::min<size_t>(
+      DefaultWorkerCount(), std::max<size_t>(1, count / std::max<size_t>(1, min_chunk)));
+  if (workers <= 1) {
+    fn(size_t{0}, count);
     return;
   }
+  std::vector<std::thread> threads;
+  threads.reserve(workers);
+  const size_t chunk = (count + workers - 1) / workers;
+  for (size_t begin = 0; begin < count; begin += chunk) {
+    const size_t end = std::min(count, begin + chunk);
+    threads.emplace_back([&fn, begin, end]() { fn(begin, end); });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
 }
 
-static void HandleRmCommand(const std::vector<std::string>& tokens) {
-  if (tokens.size() < 2) {
-    std::cout << "Missing filename: Please enter 'rm [name]'\n";
-    return;
-  }
-  const std::string& name = tokens[1];
+// Starts a long-lived background thread (journal writer, trash purger) with
+// every signal blocked. Signal masks are per thread, so without this a
+// SIGINT that the REPL thread blocks -- "tail -f" waits for it on a
+// signalfd -- would be delivered to the background thread instead and end
+// the process.
+template <typename Fn>
+static std::thread StartBackgroundThread(Fn&& fn) {
+  sigset_t all;
+  sigset_t old_mask;
+  sigfillset(&all);
+  ::pthread_sigmask(SIG_SETMASK, &all, &old_mask);
+  std::thread thread(std::forward<Fn>(fn));
+  ::pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+  return thread;
+}
 
-  namespace fs = std::filesystem;
-  std::error_code ec;
-  const fs::path path(name);
-  if (!fs::exists(path, ec) || ec) {
-    std::cout << "File not found: " << name << "\n";
-    return;
+enum class LinkPolicy {
+  kPhysical,  // -P: never follow symbolic links (default)
+  kLogical,   // -L: follow symbolic links, guarded against cycles
+};
+
+// Parses a -L/-P flag; returns false for anything else.
+static bool ParseLinkPolicyFlag(const std::string& token, LinkPolicy* policy) {
+  if (token == "-L") {
+    *policy = LinkPolicy::kLogical;
+    return true;
   }
-  if (!fs::is_regular_file(path, ec) || ec) {
-    std::cout << "Not a file: " << name << "\n";
-    return;
+  if (token == "-P") {
+    *policy = LinkPolicy::kPhysical;
+    return true;
   }
+  return false;
+}
 
-  std::cout << "Are you sure to delete " << name << "? (y/n)" << std::flush;
-  std::string confirm;
-  if (!std::getline(std::cin, confirm)) {
-    return;
+// Parses a decimal count, optionally prefixed with '+' ("0", "100", "+5").
+static bool ParseNonNegativeCount(const std::string& text, size_t* out) {
+  const size_t start = (!text.empty() && text[0] == '+') ? 1 : 0;
+  if (start >= text.size() || !std::isdigit(static_cast<unsigned char>(text[start]))) {
+    return false;
   }
-
-  if (confirm != "y") {
-    return;
+  char* end = nullptr;
+  errno = 0;
+  const unsigned long long n = std::strtoull(text.c_str() + start, &end, 10);
+  if (*end != '\0' || errno == ERANGE || n > SIZE_MAX) {
+    return false;
   }
+  *out = static_cast<size_t>(n);
+  return true;
+}
 
-  if (!fs::remove(path, ec) || ec) {
-    std::cout << "Failed to delete file: " << name << "\n";
+// Parses a positive decimal count ("-n 100").
+static bool ParseCountValue(const std::string& text, size_t* out) {
+  size_t n = 0;
+  if (!ParseNonNegativeCount(text, &n) || n == 0) {
+    return false;
   }
+  *out = n;
+  return true;
 }
 
-static void HandleRmdirCommand(const std::vector<std::string>& tokens) {
-  if (tokens.size() < 2) {
-    std::cout << "Missing directory name: Please enter 'rmdir [name]'\n";
-    return;
+// Open-addressing hash set of (device, inode) pairs. Used to detect directory
+// cycles and hard/soft-linked files without a node allocation per entry.
+class DevInoSet {
+ public:
+  // Returns true if the pair was not present before.
+  bool Insert(dev_t dev, ino_t ino) {
+    if ((size_ + 1) * 4 > slots_.size() * 3) {
+      Grow();
+    }
+    const Slot key{static_cast<std::uint64_t>(dev), static_cast<std::uint64_t>(ino), true};
+    size_t i = Hash(key) & (slots_.size() - 1);
+    while (slots_[i].used) {
+      if (slots_[i].dev == key.dev && slots_[i].ino == key.ino) {
+        return false;
+      }
+      i = (i + 1) & (slots_.size() - 1);
+    }
+    slots_[i] = key;
+    ++size_;
+    return true;
   }
-  const std::string& name = tokens[1];
 
-  namespace fs = std::filesystem;
-  std::error_code ec;
-  const fs::path path(name);
-  if (!fs::exists(path, ec) || ec) {
-    std::cout << "Directory not found: " << name << "\n";
-    return;
+  size_t size() const { return size_; }
+
+ private:
+  struct Slot {
+    std::uint64_t dev = 0;
+    std::uint64_t ino = 0;
+    bool used = false;
+  };
+
+  static size_t Hash(const Slot& s) {
+    std::uint64_t h = s.ino * 0x9E3779B97F4A7C15ULL ^ (s.dev + 0x632BE59BD9B4E019ULL);
+    h ^= h >> 29;
+    return static_cast<size_t>(h * 0xBF58476D1CE4E5B9ULL >> 17);
   }
-  if (!fs::is_directory(path, ec) || ec) {
-    std::cout << "Not a directory: " << name << "\n";
-    return;
+
+  void Grow() {
+    std::vector<Slot> old = std::move(slots_);
+    slots_.assign(old.empty() ? 64 : old.size() * 2, Slot{});
+    size_ = 0;
+    for (const Slot& slot : old) {
+      if (slot.used) {
+        Insert(static_cast<dev_t>(slot.dev), static_cast<ino_t>(slot.ino));
+      }
+    }
   }
-  if (!fs::is_empty(path, ec) || ec) {
-    std::cout << "Directory not empty: " << name << "\n";
-    return;
+
+  std::vector<Slot> slots_;
+  size_t size_ = 0;
+};
+
+static std::string JoinPath(const std::string& dir, const std::string& name) {
+  if (dir.empty()) {
+    return name;
   }
-  if (!fs::remove(path, ec) || ec) {
-    std::cout << "Failed to delete directory: " << name << "\n";
+  if (dir.back() == '/') {
+    return dir + name;
   }
+  return dir + "/" + name;
 }
 
-static std::time_t GetCreateTime(const struct stat& st) {
-#if defined(__APPLE__)
-  return st.st_birthtimespec.tv_sec;
-#else
-  return st.st_ctime;
-#endif
-}
-
-static void HandleStatCommand(const std::vector<std::string>& tokens) {
-  if (tokens.size() < 2) {
-    std::cout << "Missing target: Please enter'stat [name]'\n";
-    return;
-  }
-  const std::string& name = tokens[1];
+struct WalkEntry {
+  std::string path;
+  std::string name;
+  struct stat st {};      // lstat() data, or the link target's under -L
+  bool stat_ok = false;
+  bool is_link = false;   // the entry itself is a symbolic link
+  bool descend = true;    // visitors clear this to prune a subdirectory
 
-  struct stat st;
-  if (::stat(name.c_str(), &st) != 0) {
-    std::cout << "Target not found: " << name << "\n";
-    return;
-  }
+  bool IsDir() const { return stat_ok && S_ISDIR(st.st_mode); }
+  bool IsFile() const { return stat_ok && S_ISREG(st.st_mode); }
+};
 
-  const bool is_dir = S_ISDIR(st.st_mode);
-  const std::string type = is_dir ? "Dir" : "File";
+// Chrome trace-event recording for "--trace out.json". Spans are appended to
+// a ring owned by the recording thread, so recording takes no lock. A ring
+// grows as its thread records, up to kCapacity spans, so idle workers cost
+// next to nothing; a full ring overwrites its oldest spans. Rings are handed back when
+// their thread exits and reused by the next one, and all of them are written
+// as one JSON file (chrome://tracing, ui.perfetto.dev) when the program
+// exits. While tracing is off a span costs one branch on a flag that is set
+// once at startup.
+struct TraceEvent {
+  const char* category;
+  const char* name;
+  std::int64_t start_ns;
+  std::int64_t duration_ns;
+  std::uint64_t arg;
+};
 
-  namespace fs = std::filesystem;
-  std::error_code ec;
-  std::string abs_path = fs::absolute(fs::path(name), ec).string();
-  if (ec) {
-    abs_path = name;
-  }
+class TraceRing {
+ public:
+  static constexpr size_t kCapacity = 1 << 16;  // 2.5 MiB of spans
 
-  std::cout << "Type: " << type << "\n";
-  std::cout << "Path: " << abs_path << "\n";
-  std::cout << "Size: " << (is_dir ? "-" : std::to_string(st.st_size)) << "\n";
-  std::cout << "Create Time: " << FormatLocalTime(GetCreateTime(st)) << "\n";
-  std::cout << "Modify Time: " << FormatLocalTime(st.st_mtime) << "\n";
-  std::cout << "Access Time: " << FormatLocalTime(st.st_atime) << "\n";
-}
+  explicit TraceRing(unsigned tid) : tid_(tid) {}
 
-static void HandleSearchCommand(const std::vector<std::string>& tokens) {
-  if (tokens.size() < 2) {
-    std::cout << "Missing keyword: Please enter 'search [keyword]'\n";
-    return;
+  unsigned tid() const { return tid_; }
+  std::uint64_t dropped() const {
+    const std::uint64_t head = head_.load(std::memory_order_acquire);
+    return head - std::min<std::uint64_t>(head, kCapacity);
   }
 
-  const std::string keyword = tokens[1];
-  const std::string keyword_lower = ToLowerAscii(keyword);
+  // Only the owning thread pushes, and the rings are read after every
+  // recording thread is done, so growing the vector here is safe.
+  void Push(const TraceEvent& event) {
+    const std::uint64_t head = head_.load(std::memory_order_relaxed);
+    if (events_.size() < kCapacity) {
+      events_.push_back(event);
+    } else {
+      events_[head % kCapacity] = event;
+    }
+    head_.store(head + 1, std::memory_order_release);
+  }
 
-  namespace fs = std::filesystem;
-  std::error_code ec;
-  const fs::path base = fs::current_path(ec);
-  if (ec) {
-    std::cout << "Failed to access current directory\n";
-    return;
+  // Oldest to newest; only called once the recording threads are done.
+  template <typename Fn>
+  void ForEach(Fn fn) const {
+    const std::uint64_t head = head_.load(std::memory_order_acquire);
+    for (std::uint64_t i = head - std::min<std::uint64_t>(head, kCapacity); i < head; ++i) {
+      fn(events_[i % kCapacity]);
+    }
   }
 
-  struct SearchResult {
-    std::string path;
-    std::string type;
-  };
-  std::vector<SearchResult> results;
+ private:
+  unsigned tid_;
+  std::vector<TraceEvent> events_;
+  std::atomic<std::uint64_t> head_{0};
+};
 
-  for (fs::recursive_directory_iterator it(
-           base, fs::directory_options::skip_permission_denied, ec);
-       !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
-    const fs::directory_entry& entry = *it;
-    const fs::path path = entry.path();
-    const std::string filename = path.filename().string();
-    if (ToLowerAscii(filename).find(keyword_lower) == std::string::npos) {
-      continue;
-    }
+struct Tracer {
+  bool enabled = false;
+  std::string path;
+  std::chrono::steady_clock::time_point origin;
+  std::mutex mu;  // guards rings and free_rings
+  std::vector<std::unique_ptr<TraceRing>> rings;
+  std::vector<TraceRing*> free_rings;
+  std::set<std::string> names;  // interned dynamic span names
+};
 
-    std::error_code entry_ec;
-    const bool is_dir = entry.is_directory(entry_ec);
-    const bool is_file = entry.is_regular_file(entry_ec);
+static Tracer g_tracer;
 
-    std::error_code abs_ec;
-    std::string abs_path = fs::absolute(path, abs_ec).string();
-    if (abs_ec) {
-      abs_path = path.string();
+static TraceRing* ThisThreadTraceRing() {
+  struct Handle {
+    TraceRing* ring = nullptr;
+    ~Handle() {
+      if (ring != nullptr) {
+        std::lock_guard<std::mutex> lock(g_tracer.mu);
+        g_tracer.free_rings.push_back(ring);
+      }
     }
-    if (is_dir) {
-      abs_path += "/";
+  };
+  thread_local Handle handle;
+  if (handle.ring == nullptr) {
+    std::lock_guard<std::mutex> lock(g_tracer.mu);
+    if (!g_tracer.free_rings.empty()) {
+      handle.ring = g_tracer.free_rings.back();
+      g_tracer.free_rings.pop_back();
+    } else {
+      g_tracer.rings.push_back(
+          std::make_unique<TraceRing>(static_cast<unsigned>(g_tracer.rings.size())));
+      handle.ring = g_tracer.rings.back().get();
     }
-
-    const std::string type = is_dir ? "Dir" : (is_file ? "File" : "File");
-    results.push_back(SearchResult{std::move(abs_path), type});
   }
+  return handle.ring;
+}
 
-  if (results.empty()) {
-    std::cout << "No results found for '" << keyword << "'\n";
-    return;
-  }
+static std::int64_t TraceNow() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() -
+                                                              g_tracer.origin)
+      .count();
+}
 
-  std::cout << "Search results for '" << keyword << "' (" << results.size()
-            << " items):\n";
-  for (const auto& r : results) {
-    std::cout << r.path << " (" << r.type << ")\n";
-  }
+// A stable name for spans named at run time (commands).
+static const char* TraceIntern(const std::string& name) {
+  std::lock_guard<std::mutex> lock(g_tracer.mu);
+  return g_tracer.names.insert(name).first->c_str();
 }
 
-static void HandleCpCommand(const std::vector<std::string>& tokens) {
-  if (tokens.size() < 3) {
-    std::cout << "Invalid target path\n";
-    return;
+// Records the enclosing scope as one span. category and name must outlive
+// the program (literals or TraceIntern); arg -- bytes, entries -- is shown
+// with the span.
+class TraceSpan {
+ public:
+  TraceSpan(const char* category, const char* name, std::uint64_t arg = 0)
+      : category_(category), name_(name), arg_(arg) {
+    if (g_tracer.enabled) {
+      start_ns_ = TraceNow();
+    }
   }
 
-  namespace fs = std::filesystem;
-  const fs::path src = fs::path(tokens[1]);
-  const fs::path dst_arg = fs::path(tokens[2]);
+  ~TraceSpan() {
+    if (start_ns_ >= 0) {
+      ThisThreadTraceRing()->Push(
+          TraceEvent{category_, name_, start_ns_, TraceNow() - start_ns_, arg_});
+    }
+  }
+
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+  void set_arg(std::uint64_t arg) { arg_ = arg; }
+
+ private:
+  const char* category_;
+  const char* name_;
+  std::uint64_t arg_;
+  std::int64_t start_ns_ = -1;
+};
 
+// Called while parsing argv, before the initial chdir: a relative path names
+// a file in the launch directory, not wherever the session ends up.
+static void StartTrace(const std::string& path) {
   std::error_code ec;
-  if (!fs::exists(src, ec) || ec || !fs::is_regular_file(src, ec) || ec) {
-    std::cout << "Source not found\n";
+  const std::filesystem::path absolute = std::filesystem::absolute(path, ec);
+  g_tracer.path = ec ? path : absolute.lexically_normal().string();
+  g_tracer.origin = std::chrono::steady_clock::now();
+  g_tracer.enabled = true;
+  ThisThreadTraceRing();  // the main thread gets tid 0
+}
+
+static std::string JsonEscape(const char* text) {
+  std::string out;
+  for (const char* p = text; *p != '\0'; ++p) {
+    const auto ch = static_cast<unsigned char>(*p);
+    if (ch == '"' || ch == '\\') {
+      out += '\\';
+      out += static_cast<char>(ch);
+    } else if (ch < 0x20) {
+      char buf[8];
+      std::snprintf(buf, sizeof(buf), "\\u%04x", ch);
+      out += buf;
+    } else {
+      out += static_cast<char>(ch);
+    }
+  }
+  return out;
+}
+
+// Writes every recorded span; called on exit, after all workers have joined.
+static void FinishTrace() {
+  if (!g_tracer.enabled) {
+    return;
+  }
+  std::ofstream out(g_tracer.path, std::ios::out | std::ios::binary | std::ios::trunc);
+  out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+  bool first = true;
+  size_t count = 0;
+  std::uint64_t dropped = 0;
+  std::lock_guard<std::mutex> lock(g_tracer.mu);
+  for (const auto& ring : g_tracer.rings) {
+    out << (first ? "" : ",\n") << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":"
+        << ring->tid() << ",\"args\":{\"name\":\""
+        << (ring->tid() == 0 ? std::string("main") : "worker " + std::to_string(ring->tid()))
+        << "\"}}";
+    first = false;
+    dropped += ring->dropped();
+    ring->ForEach([&](const TraceEvent& e) {
+      char times[64];
+      std::snprintf(times, sizeof(times), "\"ts\":%.3f,\"dur\":%.3f",
+                    static_cast<double>(e.start_ns) / 1000.0,
+                    static_cast<double>(e.duration_ns) / 1000.0);
+      out << ",\n{\"ph\":\"X\",\"cat\":\"" << e.category << "\",\"name\":\"" << JsonEscape(e.name)
+          << "\",\"pid\":1,\"tid\":" << ring->tid() << "," << times << ",\"args\":{\"n\":" << e.arg
+          << "}}";
+      ++count;
+    });
+  }
+  out << "\n]}\n";
+  out.close();
+  if (!out) {
+    std::cout << "Failed to write trace: " << g_tracer.path << "\n";
     return;
   }
+  std::cout << "Trace written to " << g_tracer.path << " (" << count << " spans";
+  if (dropped > 0) {
+    std::cout << ", " << dropped << " oldest overwritten";
+  }
+  std::cout << ")\n";
+}
+
+struct FileInfo {
+  mode_t mode = 0;
+  std::uint64_t size = 0;
+  std::uint64_t blocks = 0;
+  std::uint64_t inode = 0;
+  std::uint64_t links = 0;
+  std::uint64_t mount_id = 0;
+  std::time_t create_time = 0;
+  std::time_t modify_time = 0;
+  std::time_t access_time = 0;
+  bool has_create_time = false;
+  bool has_mount_id = false;
+};
+
+static bool QueryFileInfo(int dir_fd, const char* path, int flags, FileInfo* info);
+
+// Namespace and metadata operations behind every command that lists, stats,
+// creates, deletes or renames entries, so the same handlers can run against
+// the real filesystem, an in-memory tree or a slowed-down decorator (see the
+// vfs command). Methods mirror the *at() system calls: dir is a handle from
+// OpenDir or AT_FDCWD, and failures return false (or -1) with errno set.
+// File contents are not part of the interface; commands that read or write
+// data use file descriptors directly and require Posix().
+class Vfs {
+ public:
+  virtual ~Vfs() = default;
+
+  virtual std::string Describe() const = 0;
+  // True when paths name real files that can be opened.
+  virtual bool Posix() const = 0;
+
+  // Lists one directory like ReadDirectory.
+  virtual bool ListDir(const std::string& path, LinkPolicy links,
+                       std::vector<WalkEntry>* entries) = 0;
+  virtual bool IsEmptyDir(const std::string& path) = 0;
+  virtual bool StatAt(int dir, const std::string& path, bool follow, struct stat* st) = 0;
+  virtual bool QueryInfo(const std::string& path, bool follow, FileInfo* info) = 0;
+  virtual std::string ReadLinkAt(int dir, const std::string& path) = 0;
+
+  virtual int OpenDir(const std::string& path) = 0;
+  virtual void CloseDir(int dir) = 0;
+  // Both fail with EEXIST if name exists.
+  virtual bool CreateFileAt(int dir, const std::string& name, mode_t mode) = 0;
+  virtual bool MakeDirAt(int dir, const std::string& name, mode_t mode) = 0;
+  virtual bool RemoveAt(int dir, const std::string& name, bool directory) = 0;
+  virtual bool RenameAt(int from_dir, const std::string& from, int to_dir,
+                        const std::string& to, bool no_replace) = 0;
+
+  virtual bool ChangeDir(const std::string& path) = 0;
+  virtual std::string CurrentDir() = 0;
+};
+
+// Reads /sys/dev/block/MAJ:MIN/queue/rotational, or the parent disk's for a
+// partition. False if the device has no block queue (or is not rotational).
+static bool IsRotationalDevice(dev_t dev) {
+#if defined(__linux__)
+  const std::string base = "/sys/dev/block/" + std::to_string(major(dev)) + ":" +
+                           std::to_string(minor(dev));
+  for (const char* queue : {"/queue/rotational", "/../queue/rotational"}) {
+    std::ifstream in(base + queue);
+    int value = 0;
+    if (in >> value) {
+      return value == 1;
+    }
+  }
+#else
+  (void)dev;
+#endif
+  return false;
+}
+
+// Order in which PosixVfs::ListDir stats the entries of a directory. On a
+// rotational disk, stat'ing in readdir order jumps around the inode table;
+// sorted by d_ino the inodes are read in disk order, mostly sequentially
+// (GNU ls and du do the same on ext4). kAuto sorts on devices whose sysfs
+// queue reports rotational.
+enum class StatOrder {
+  kAuto,
+  kReaddir,
+  kInode,
+};
+
+static std::atomic<StatOrder> g_stat_order{StatOrder::kAuto};
+
+// IsRotationalDevice, remembered per device: listings ask once per directory.
+static bool OnRotationalDevice(dev_t dev) {
+  static std::mutex mu;
+  static std::unordered_map<dev_t, bool> known;
+  std::lock_guard<std::mutex> lock(mu);
+  const auto it = known.find(dev);
+  if (it != known.end()) {
+    return it->second;
+  }
+  return known[dev] = IsRotationalDevice(dev);
+}
+
+class PosixVfs : public Vfs {
+ public:
+  std::string Describe() const override { return "posix"; }
+  bool Posix() const override { return true; }
+
+  // The directory is read completely first, then each entry is lstat'ed
+  // relative to the directory fd, in inode order if g_stat_order asks for
+  // it; under kLogical symbolic links are resolved (dangling links keep
+  // their lstat data). Entries stay in readdir order either way.
+  bool ListDir(const std::string& path, LinkPolicy links,
+               std::vector<WalkEntry>* entries) override {
+    DIR* dir = nullptr;
+    {
+      const TraceSpan span("walk", "open_dir");
+      dir = ::opendir(path.c_str());
+    }
+    if (dir == nullptr) {
+      return false;
+    }
+    const int fd = ::dirfd(dir);
+    const size_t first = entries->size();
+    std::vector<std::pair<ino_t, size_t>> order;  // (d_ino, index)
+    {
+      TraceSpan span("walk", "read_dir");
+      while (const dirent* de = ::readdir(dir)) {
+        const char* name = de->d_name;
+        if (IsDotOrDotDot(name)) {
+          continue;
+        }
+        WalkEntry entry;
+        entry.name = name;
+        entry.path = JoinPath(path, entry.name);
+        order.emplace_back(de->d_ino, entries->size());
+        entries->push_back(std::move(entry));
+      }
+      span.set_arg(entries->size() - first);
+    }
+    const StatOrder stat_order = g_stat_order.load(std::memory_order_relaxed);
+    bool by_inode = stat_order == StatOrder::kInode;
+    if (stat_order == StatOrder::kAuto && order.size() > 1) {
+      struct stat dir_st;
+      by_inode = ::fstat(fd, &dir_st) == 0 && OnRotationalDevice(dir_st.st_dev);
+    }
+    if (by_inode) {
+      std::sort(order.begin(), order.end());
+    }
+    const TraceSpan span("walk", by_inode ? "stat_entries_by_inode" : "stat_entries",
+                         order.size());
+    for (const auto& item : order) {
+      WalkEntry& entry = (*entries)[item.second];
+      const char* name = entry.name.c_str();
+      entry.stat_ok = ::fstatat(fd, name, &entry.st, AT_SYMLINK_NOFOLLOW) == 0;
+      entry.is_link = entry.stat_ok && S_ISLNK(entry.st.st_mode);
+      if (entry.is_link && links == LinkPolicy::kLogical) {
+        struct stat target;
+        if (::fstatat(fd, name, &target, 0) == 0) {
+          entry.st = target;
+        }
+      }
+    }
+    ::closedir(dir);
+    return true;
+  }
+
+  bool IsEmptyDir(const std::string& path) override {
+    DIR* dir = ::opendir(path.c_str());
+    if (dir == nullptr) {
+      return false;
+    }
+    bool empty = true;
+    while (const dirent* de = ::readdir(dir)) {
+      if (!IsDotOrDotDot(de->d_name)) {
+        empty = false;
+        break;
+      }
+    }
+    ::closedir(dir);
+    return empty;
+  }
+
+  bool StatAt(int dir, const std::string& path, bool follow, struct stat* st) override {
+    return ::fstatat(dir, path.c_str(), st, follow ? 0 : AT_SYMLINK_NOFOLLOW) == 0;
+  }
+
+  bool QueryInfo(const std::string& path, bool follow, FileInfo* info) override {
+    return QueryFileInfo(AT_FDCWD, path.c_str(), follow ? 0 : AT_SYMLINK_NOFOLLOW, info);
+  }
+
+  std::string ReadLinkAt(int dir, const std::string& path) override {
+    std::string buf(256, '\0');
+    while (true) {
+      const ssize_t n = ::readlinkat(dir, path.c_str(), &buf[0], buf.size());
+      if (n < 0) {
+        return {};
+      }
+      if (static_cast<size_t>(n) < buf.size()) {
+        buf.resize(static_cast<size_t>(n));
+        return buf;
+      }
+      buf.resize(buf.size() * 2);
+    }
+  }
+
+  int OpenDir(const std::string& path) override {
+    return ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  }
+
+  void CloseDir(int dir) override {
+    if (dir >= 0) {
+      ::close(dir);
+    }
+  }
+
+  bool CreateFileAt(int dir, const std::string& name, mode_t mode) override {
+    const int fd = ::openat(dir, name.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+    if (fd < 0) {
+      return false;
+    }
+    ::close(fd);
+    return true;
+  }
+
+  bool MakeDirAt(int dir, const std::string& name, mode_t mode) override {
+    return ::mkdirat(dir, name.c_str(), mode) == 0;
+  }
+
+  bool RemoveAt(int dir, const std::string& name, bool directory) override {
+    return ::unlinkat(dir, name.c_str(), directory ? AT_REMOVEDIR : 0) == 0;
+  }
+
+  bool RenameAt(int from_dir, const std::string& from, int to_dir, const std::string& to,
+                bool no_replace) override {
+    if (!no_replace) {
+      return ::renameat(from_dir, from.c_str(), to_dir, to.c_str()) == 0;
+    }
+#if defined(__linux__) && defined(RENAME_NOREPLACE)
+    if (::renameat2(from_dir, from.c_str(), to_dir, to.c_str(), RENAME_NOREPLACE) == 0) {
+      return true;
+    }
+    if (errno != EINVAL && errno != ENOSYS) {
+      return false;
+    }
+#endif
+    // Filesystems without RENAME_NOREPLACE: check, then rename.
+    struct stat st;
+    if (::fstatat(to_dir, to.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0) {
+      errno = EEXIST;
+      return false;
+    }
+    return ::renameat(from_dir, from.c_str(), to_dir, to.c_str()) == 0;
+  }
+
+  bool ChangeDir(const std::string& path) override { return ::chdir(path.c_str()) == 0; }
+  std::string CurrentDir() override { return GetCwd(); }
+
+ private:
+  static bool IsDotOrDotDot(const char* name) {
+    return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+  }
+};
+
+// The backend every metadata operation goes through; replaced by "vfs".
+static std::unique_ptr<Vfs> g_vfs = std::make_unique<PosixVfs>();
+
+static std::string ReadLinkTarget(int dir_fd, const std::string& path) {
+  return g_vfs->ReadLinkAt(dir_fd, path);
+}
+
+// Under -P a link is reported as such; under -L only dangling links are.
+static bool ShowAsLink(const WalkEntry& entry, LinkPolicy links) {
+  return entry.is_link && (links == LinkPolicy::kPhysical || !entry.stat_ok ||
+                           S_ISLNK(entry.st.st_mode));
+}
+
+// The file system a subtree lives on, as far as the walker's scheduling is
+// concerned. Rotational disks get at most kRotationalLimit concurrent
+// listings, since more only adds seeks; SSDs, network and memory file
+// systems may use every worker. Below that cap the walker adapts the
+// actual concurrency (ConcurrencyLimit).
+struct DeviceInfo {
+  enum class Kind {
+    kSolidState,
+    kRotational,
+    kNetwork,
+    kOther,  // pseudo file systems, unknown devices, non-posix backends
+  };
+
+  dev_t dev = 0;
+  std::string mount_point;  // empty if not found in mountinfo
+  std::string fs_type;
+  Kind kind = Kind::kOther;
+  unsigned limit = 1;  // cap on concurrent listings
+};
+
+static constexpr unsigned kRotationalLimit = 2;
+
+// Threads for a parallel walk. Listing a directory on a network or FUSE
+// mount mostly waits, so the pool is larger than the core count; how many
+// of the threads a device actually keeps busy is decided per device by
+// ConcurrencyLimit.
+static unsigned WalkWorkerCount() { return std::max(DefaultWorkerCount(), 32u); }
+
+// Adaptive limit on one device's concurrent listings, after the gradient
+// policies used for RPC concurrency limits. Each finished listing is a
+// sample of latency per entry, so large and small directories compare.
+// Every window of max(8, limit) samples, the window's latency is compared
+// with a slow moving average of past windows. While it stays within
+// kTolerance of the average, the device is taken to have spare capacity and
+// the limit grows by sqrt(limit). Throughput is not measured: latency per
+// entry rising beyond kTolerance of the average is taken to mean that extra
+// concurrency only queues, and the limit shrinks in proportion, by at most
+// half per window. The limit only grows while the walk keeps at least
+// half of it busy: a limit the walk cannot fill says nothing about the
+// device. The average takes a window at no more than twice its value, so a
+// preempted listing does not make the controller permissive afterwards. The
+// limit thus settles near the core count on a local file system and at
+// dozens on a high-latency remote mount.
+class ConcurrencyLimit {
+ public:
+  ConcurrencyLimit(unsigned initial, unsigned cap)
+      : cap_(std::max(1u, cap)), limit_(std::min<double>(std::max(1u, initial), cap_)),
+        low_(limit_), high_(limit_) {}
+
+  unsigned current() const { return static_cast<unsigned>(limit_ + 0.5); }
+  unsigned low() const { return static_cast<unsigned>(low_ + 0.5); }
+  unsigned high() const { return static_cast<unsigned>(high_ + 0.5); }
+
+  // One listing of entries took seconds with in_flight listings running
+  // (itself included).
+  void Sample(double seconds, size_t entries, unsigned in_flight) {
+    window_seconds_ += seconds;
+    window_entries_ += 1 + entries;
+    window_in_flight_ = std::max(window_in_flight_, in_flight);
+    if (++window_samples_ < std::max<size_t>(kMinWindow, current())) {
+      return;
+    }
+    const double latency = window_seconds_ / static_cast<double>(window_entries_);
+    const bool saturated = 2 * window_in_flight_ >= current();
+    window_seconds_ = 0;
+    window_entries_ = 0;
+    window_samples_ = 0;
+    window_in_flight_ = 0;
+    if (average_ == 0) {
+      average_ = latency;
+      return;
+    }
+    const double gradient =
+        latency > 0 ? std::max(0.5, std::min(1.0, kTolerance * average_ / latency)) : 1.0;
+    const double target = limit_ * gradient + (saturated ? std::sqrt(limit_) : 0);
+    limit_ = std::max(1.0, std::min(static_cast<double>(cap_),
+                                    limit_ * (1 - kSmoothing) + target * kSmoothing));
+    average_ = average_ * (1 - kAverageWeight) + std::min(latency, 2 * average_) * kAverageWeight;
+    low_ = std::min(low_, limit_);
+    high_ = std::max(high_, limit_);
+  }
+
+ private:
+  static constexpr size_t kMinWindow = 8;
+  static constexpr double kTolerance = 1.5;
+  static constexpr double kSmoothing = 0.2;
+  static constexpr double kAverageWeight = 0.05;
+
+  unsigned cap_;
+  double limit_;
+  double low_;
+  double high_;
+  double average_ = 0;  // seconds per entry
+  double window_seconds_ = 0;
+  size_t window_entries_ = 0;
+  size_t window_samples_ = 0;
+  unsigned window_in_flight_ = 0;
+};
+
+static const char* DeviceKindName(DeviceInfo::Kind kind) {
+  switch (kind) {
+    case DeviceInfo::Kind::kSolidState:
+      return "ssd";
+    case DeviceInfo::Kind::kRotational:
+      return "rotational";
+    case DeviceInfo::Kind::kNetwork:
+      return "network";
+    case DeviceInfo::Kind::kOther:
+      break;
+  }
+  return "other";
+}
+
+// Undoes the octal escapes (\040 for a space) of mountinfo fields.
+static std::string UnescapeMountField(const std::string& field) {
+  std::string out;
+  for (size_t i = 0; i < field.size(); ++i) {
+    if (field[i] == '\\' && i + 3 < field.size() &&
+        std::isdigit(static_cast<unsigned char>(field[i + 1]))) {
+      out += static_cast<char>(std::strtol(field.substr(i + 1, 3).c_str(), nullptr, 8));
+      i += 3;
+    } else {
+      out += field[i];
+    }
+  }
+  return out;
+}
+
+static DeviceInfo DescribeDevice(dev_t dev, unsigned workers) {
+  DeviceInfo info;
+  info.dev = dev;
+  info.limit = std::max(1u, workers);
+  if (!g_vfs->Posix()) {
+    info.fs_type = "vfs";
+    return info;
+  }
+#if defined(__linux__)
+  // 36 35 98:0 /mnt1 /mnt/parent rw,noatime master:1 - ext3 /dev/root rw
+  std::ifstream in("/proc/self/mountinfo");
+  const std::string wanted = std::to_string(major(dev)) + ":" + std::to_string(minor(dev));
+  std::string line;
+  while (std::getline(in, line)) {
+    std::istringstream fields(line);
+    std::string id;
+    std::string parent;
+    std::string device;
+    std::string root;
+    std::string mount_point;
+    fields >> id >> parent >> device >> root >> mount_point;
+    if (device != wanted) {
+      continue;
+    }
+    const size_t dash = line.find(" - ");
+    if (dash == std::string::npos) {
+      continue;
+    }
+    std::istringstream tail(line.substr(dash + 3));
+    tail >> info.fs_type;
+    info.mount_point = UnescapeMountField(mount_point);
+    break;
+  }
+  static const char* const kNetworkTypes[] = {"nfs", "nfs4", "cifs", "smb3", "smbfs", "ceph",
+                                              "glusterfs", "9p", "afs", "lustre", "beegfs"};
+  for (const char* type : kNetworkTypes) {
+    if (info.fs_type == type) {
+      info.kind = DeviceInfo::Kind::kNetwork;
+    }
+  }
+  if (info.fs_type.rfind("fuse.", 0) == 0 && info.fs_type != "fuse.lxcfs") {
+    info.kind = DeviceInfo::Kind::kNetwork;  // sshfs, s3fs, rclone, ...
+  }
+  if (info.kind == DeviceInfo::Kind::kOther && major(dev) != 0) {
+    info.kind = IsRotationalDevice(dev) ? DeviceInfo::Kind::kRotational
+                                        : DeviceInfo::Kind::kSolidState;
+  }
+#endif
+  if (info.kind == DeviceInfo::Kind::kRotational) {
+    info.limit = std::min(info.limit, kRotationalLimit);
+  }
+  return info;
+}
+
+// Per-device counters of one ParallelWalkTree run, for "--stats".
+struct WalkDeviceStats {
+  DeviceInfo info;
+  std::uint64_t dirs = 0;
+  std::uint64_t entries = 0;
+  double busy_seconds = 0;  // summed over workers
+  unsigned peak = 0;        // most concurrent listings seen
+  unsigned concurrency = 0;  // adaptive limit at the end of the walk
+  unsigned concurrency_low = 0;
+  unsigned concurrency_high = 0;
+};
+
+struct WalkStats {
+  unsigned workers = 0;
+  double seconds = 0;
+  std::vector<WalkDeviceStats> devices;
+};
+
+// One fully listed directory, handed to the visitor before its
+// subdirectories are scheduled.
+struct WalkDir {
+  std::string path;
+  int depth = 0;  // 0 for the walk root
+  std::vector<WalkEntry> entries;
+};
+
+// Directories still to be listed, with their depth below the walk root.
+using WalkFrontier = std::vector<std::pair<std::string, int>>;
+
+struct WalkOptions {
+  LinkPolicy links = LinkPolicy::kPhysical;
+  int max_depth = -1;  // deepest directory level that is listed; -1: no limit
+  // ParallelWalkTree only: offered between directories. The hook calls
+  // frontier() only when it wants to save one; the walk stays paused, with
+  // no directory in flight, until the hook returns. Returning false stops
+  // the walk (see WalkCheckpointer).
+  std::function<bool(const std::function<WalkFrontier()>& frontier)> checkpoint;
+  // ParallelWalkTree only: a saved frontier to continue from instead of root.
+  WalkFrontier resume;
+  // ParallelWalkTree only: receives per-device counters when set.
+  WalkStats* stats = nullptr;
+  // ParallelWalkTree only: list level by level -- no directory is started
+  // while a shallower one is pending or in flight -- so a visitor that
+  // stops the walk has seen everything above the deepest level it saw.
+  bool breadth_first = false;
+};
+
+enum class WalkAction {
+  kContinue,
+  kStop,
+};
+
+// I/O budget set by "throttle": every directory listing, entry examined and
+// copy chunk draws from one pair of token buckets (operations and bytes per
+// second), so parallel walkers and copies together stay under the limits.
+// The tokens live in StateDir()/throttle, mapped shared and updated under
+// flock, so every throttled instance of the same user draws from the same
+// buckets; each refills them at its own configured rates, which keeps the
+// sum under the limits when the instances are started with the same ones.
+// Without the file the buckets are private to the process. A bucket may go
+// into debt and the caller sleeps it off, which keeps megabyte-sized chunks
+// accurate at low rates; idle time refills at most kBurst worth of tokens.
+class IoThrottle {
+ public:
+  ~IoThrottle() {
+    if (shared_ != nullptr) {
+      ::munmap(shared_, sizeof(Tokens));
+    }
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+  }
+
+  bool active() const { return active_.load(std::memory_order_relaxed); }
+  double iops() const { return ops_rate_; }
+  double bandwidth() const { return bytes_rate_; }
+
+  // A rate of 0 removes that limit. The shared tokens are left alone: a
+  // reconfigured instance must not grant itself a fresh burst.
+  void Configure(double iops, double bandwidth) {
+    std::lock_guard<std::mutex> lock(mu_);
+    ops_rate_ = iops;
+    bytes_rate_ = bandwidth;
+    active_ = iops > 0 || bandwidth > 0;
+    if (active_ && shared_ == nullptr && fd_ < 0) {
+      MapShared();
+    }
+  }
+
+  // Accounts for ops operations moving bytes bytes, sleeping as long as the
+  // budget is overdrawn.
+  void Charge(std::uint64_t ops, std::uint64_t bytes) {
+    if (active()) {
+      ChargeSlow(ops, bytes);
+    }
+  }
+
+ private:
+  static constexpr double kBurst = 0.1;  // seconds
+
+  // Layout of the shared file; a new (zero-filled) file starts with empty
+  // buckets that the first charge refills.
+  struct Tokens {
+    double ops = 0;
+    double bytes = 0;
+    std::int64_t last_ns = 0;  // CLOCK_MONOTONIC, the same in every process
+  };
+
+  static std::int64_t MonotonicNs() {
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<std::int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  }
+
+  void MapShared() {
+    const std::string dir = StateDir();
+    if (!MakeStateDir(dir)) {
+      fd_ = -2;  // do not try again
+      return;
+    }
+    const int fd = ::open((dir + "/throttle").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    struct stat st;
+    if (fd < 0 || ::fstat(fd, &st) != 0 ||
+        (st.st_size < static_cast<off_t>(sizeof(Tokens)) &&
+         ::ftruncate(fd, sizeof(Tokens)) != 0)) {
+      if (fd >= 0) {
+        ::close(fd);
+      }
+      fd_ = -2;
+      return;
+    }
+    void* map = ::mmap(nullptr, sizeof(Tokens), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+      ::close(fd);
+      fd_ = -2;
+      return;
+    }
+    fd_ = fd;
+    shared_ = static_cast<Tokens*>(map);
+  }
+
+  void ChargeSlow(std::uint64_t ops, std::uint64_t bytes) {
+    double wait = 0;
+    {
+      // mu_ orders this process's threads; flock, which belongs to the open
+      // file and so does not exclude them, orders the processes.
+      std::lock_guard<std::mutex> lock(mu_);
+      Tokens* tokens = shared_ != nullptr ? shared_ : &local_;
+      const bool locked = shared_ != nullptr && ::flock(fd_, LOCK_EX) == 0;
+      const std::int64_t now = MonotonicNs();
+      const double elapsed =
+          static_cast<double>(std::max<std::int64_t>(0, now - tokens->last_ns)) / 1e9;
+      tokens->last_ns = now;
+      const std::pair<double*, std::pair<double, std::uint64_t>> buckets[] = {
+          {&tokens->ops, {ops_rate_, ops}}, {&tokens->bytes, {bytes_rate_, bytes}}};
+      for (const auto& bucket : buckets) {
+        const double rate = bucket.second.first;
+        if (rate <= 0) {
+          continue;
+        }
+        double& level = *bucket.first;
+        level = std::min(rate * kBurst, level + elapsed * rate) -
+                static_cast<double>(bucket.second.second);
+        if (level < 0) {
+          wait = std::max(wait, -level / rate);
+        }
+      }
+      if (locked) {
+        ::flock(fd_, LOCK_UN);
+      }
+    }
+    if (wait > 0) {
+      const TraceSpan span("throttle", "throttle_wait");
+      std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+    }
+  }
+
+  std::atomic<bool> active_{false};
+  std::mutex mu_;
+  double ops_rate_ = 0;
+  double bytes_rate_ = 0;
+  int fd_ = -1;  // -2: the shared file could not be set up
+  Tokens* shared_ = nullptr;
+  Tokens local_;
+};
+
+static IoThrottle g_io_throttle;
+
+// Copy loops move at most this much per charge while a throttle is set.
+static constexpr std::uint64_t kThrottledChunk = 256u << 10;
+
+// Lists one directory through the active VFS backend. The listing and
+// every entry examined count as one operation each against the throttle.
+static bool ReadDirectory(const std::string& path, LinkPolicy links,
+                          std::vector<WalkEntry>* entries) {
+  TraceSpan span("walk", "list_dir");
+  const bool ok = g_vfs->ListDir(path, links, entries);
+  span.set_arg(entries->size());
+  g_io_throttle.Charge(1 + entries->size(), 0);
+  return ok;
+}
+
+// Depth-first walk below root (the root itself is not reported). Every
+// directory is listed completely and passed to visit as one batch; then its
+// subdirectories are entered in listing order. Directories are entered at
+// most once per (dev, inode), so following links can neither loop nor count
+// a subtree twice. Returns false if the visitor stopped the walk.
+static bool WalkTree(const std::string& root, const WalkOptions& options,
+                     const std::function<WalkAction(WalkDir&)>& visit) {
+  DevInoSet visited;
+  struct stat root_st;
+  if (g_vfs->StatAt(AT_FDCWD, root, true, &root_st)) {
+    visited.Insert(root_st.st_dev, root_st.st_ino);
+  }
+
+  WalkFrontier pending;
+  pending.emplace_back(root, 0);
+  while (!pending.empty()) {
+    WalkDir dir;
+    dir.path = std::move(pending.back().first);
+    dir.depth = pending.back().second;
+    pending.pop_back();
+    if (!ReadDirectory(dir.path, options.links, &dir.entries)) {
+      continue;
+    }
+    const TraceSpan span("walk", "visit", dir.entries.size());
+    if (visit(dir) == WalkAction::kStop) {
+      return false;
+    }
+    if (options.max_depth >= 0 && dir.depth + 1 > options.max_depth) {
+      continue;
+    }
+    const size_t first_child = pending.size();
+    for (auto& entry : dir.entries) {
+      if (entry.descend && entry.IsDir() &&
+          visited.Insert(entry.st.st_dev, entry.st.st_ino)) {
+        pending.emplace_back(std::move(entry.path), dir.depth + 1);
+      }
+    }
+    std::reverse(pending.begin() + static_cast<std::ptrdiff_t>(first_child), pending.end());
+  }
+  return true;
+}
+
+// Parallel variant of WalkTree: directories are listed by a pool of workers.
+// Pending directories are queued per device (the st_dev of the directory
+// itself, so a mount point starts a queue of its own) and each device
+// admits as many concurrent listings as its ConcurrencyLimit currently
+// allows (at most DeviceInfo::limit); a free worker takes work from the
+// next device in round-robin order that is under its limit.
+// Fast and slow devices thus progress independently, and a rotational disk
+// is not thrashed by every worker at once. visit runs on the worker that
+// listed the directory -- concurrently with other calls, in no particular
+// order -- and gets that worker's index so callers can reduce into
+// per-worker aggregates and merge them at the end. Directories are still
+// entered at most once per (dev, inode).
+//
+// Within a device the walk is depth first, or level by level with
+// options.breadth_first.
+//
+// With options.checkpoint set, workers offer a checkpoint between
+// directories; when the hook asks for the frontier the walk is paused until
+// no directory is in flight, so the frontier and the callers' aggregates
+// are consistent until the hook returns. Returns false if a visitor or the
+// checkpoint hook stopped the walk.
+static bool ParallelWalkTree(const std::string& root, const WalkOptions& options,
+                             unsigned workers,
+                             const std::function<WalkAction(WalkDir&, unsigned)>& visit) {
+  struct Child {
+    std::string path;
+    int depth;
+    dev_t dev;
+    ino_t ino;
+  };
+  struct DeviceQueue {
+    DeviceQueue(DeviceInfo device, unsigned initial)
+        : info(std::move(device)), limit(initial, info.limit) {}
+
+    DeviceInfo info;
+    ConcurrencyLimit limit;
+    std::deque<std::pair<std::string, int>> pending;  // taken from the back, or front if BFS
+    unsigned active = 0;
+    WalkDeviceStats stats;
+  };
+  workers = std::max(1u, workers);
+  const auto started = std::chrono::steady_clock::now();
+  std::mutex mu;
+  std::condition_variable cv;
+  std::vector<std::unique_ptr<DeviceQueue>> devices;
+  std::unordered_map<dev_t, DeviceQueue*> by_dev;
+  size_t next_device = 0;  // round-robin cursor
+  size_t queued = 0;
+  size_t active = 0;  // directories taken from a queue but not finished
+  bool stopped = false;
+  bool pausing = false;
+  std::atomic<bool> checkpointing{false};
+  DevInoSet visited;
+  // Breadth first: directories pending or in flight, by depth.
+  std::vector<size_t> open_by_depth;
+
+  // Callers hold mu.
+  auto enqueue = [&](std::string path, int depth, dev_t dev) {
+    DeviceQueue*& queue = by_dev[dev];
+    if (queue == nullptr) {
+      // Start from one listing per core and let the limit find the rest.
+      devices.push_back(
+          std::make_unique<DeviceQueue>(DescribeDevice(dev, workers), DefaultWorkerCount()));
+      queue = devices.back().get();
+    }
+    queue->pending.emplace_back(std::move(path), depth);
+    ++queued;
+    if (options.breadth_first) {
+      if (open_by_depth.size() <= static_cast<size_t>(depth)) {
+        open_by_depth.resize(static_cast<size_t>(depth) + 1);
+      }
+      ++open_by_depth[static_cast<size_t>(depth)];
+    }
+  };
+  // Breadth first: nothing shallower than depth is left.
+  auto level_open = [&](int depth) {
+    for (int d = 0; d < depth && static_cast<size_t>(d) < open_by_depth.size(); ++d) {
+      if (open_by_depth[static_cast<size_t>(d)] != 0) {
+        return false;
+      }
+    }
+    return true;
+  };
+  auto eligible = [&]() -> DeviceQueue* {
+    for (size_t i = 0; i < devices.size(); ++i) {
+      DeviceQueue* queue = devices[(next_device + i) % devices.size()].get();
+      if (!queue->pending.empty() && queue->active < queue->limit.current() &&
+          (!options.breadth_first || level_open(queue->pending.front().second))) {
+        return queue;
+      }
+    }
+    return nullptr;
+  };
+
+  const WalkFrontier start = options.resume.empty() ? WalkFrontier{{root, 0}} : options.resume;
+  for (const auto& item : start) {
+    struct stat st;
+    if (g_vfs->StatAt(AT_FDCWD, item.first, true, &st)) {
+      visited.Insert(st.st_dev, st.st_ino);
+      enqueue(item.first, item.second, st.st_dev);
+    }
+  }
+
+  auto offer_checkpoint = [&]() {
+    if (checkpointing.exchange(true)) {
+      return true;
+    }
+    bool paused = false;
+    const bool go_on = options.checkpoint([&]() {
+      std::unique_lock<std::mutex> lock(mu);
+      pausing = true;
+      paused = true;
+      cv.wait(lock, [&]() { return active == 0; });
+      WalkFrontier frontier;
+      for (const auto& queue : devices) {
+        frontier.insert(frontier.end(), queue->pending.begin(), queue->pending.end());
+      }
+      return frontier;
+    });
+    {
+      std::lock_guard<std::mutex> lock(mu);
+      pausing = pausing && !paused;
+      stopped = stopped || !go_on;
+    }
+    if (paused || !go_on) {
+      cv.notify_all();
+    }
+    checkpointing = false;
+    return go_on;
+  };
+
+  auto run = [&](unsigned worker) {
+    std::vector<Child> children;
+    while (true) {
+      if (options.checkpoint && !offer_checkpoint()) {
+        return;
+      }
+      WalkDir dir;
+      DeviceQueue* queue = nullptr;
+      {
+        const TraceSpan wait_span("walk", "queue_wait");
+        std::unique_lock<std::mutex> lock(mu);
+        cv.wait(lock, [&]() {
+          return stopped || (queued == 0 && active == 0) ||
+                 (!pausing && (queue = eligible()) != nullptr);
+        });
+        if (stopped || queue == nullptr) {
+          return;
+        }
+        auto& next = options.breadth_first ? queue->pending.front() : queue->pending.back();
+        dir.path = std::move(next.first);
+        dir.depth = next.second;
+        if (options.breadth_first) {
+          queue->pending.pop_front();
+        } else {
+          queue->pending.pop_back();
+        }
+        --queued;
+        ++active;
+        ++queue->active;
+        queue->stats.peak = std::max(queue->stats.peak, queue->active);
+        next_device = (next_device + 1) % devices.size();
+      }
+
+      const auto list_start = std::chrono::steady_clock::now();
+      const bool listed = ReadDirectory(dir.path, options.links, &dir.entries);
+      const auto list_time = std::chrono::steady_clock::now() - list_start;
+      bool stop = false;
+      if (listed) {
+        const TraceSpan span("walk", "visit", dir.entries.size());
+        stop = visit(dir, worker) == WalkAction::kStop;
+      }
+      children.clear();
+      if (listed && !stop && (options.max_depth < 0 || dir.depth + 1 <= options.max_depth)) {
+        for (auto& entry : dir.entries) {
+          if (entry.descend && entry.IsDir()) {
+            children.push_back(Child{std::move(entry.path), dir.depth + 1, entry.st.st_dev,
+                                     entry.st.st_ino});
+          }
+        }
+      }
+      // Siblings are listed in inode order, which keeps a rotational disk's
+      // head moving one way: depth first queues are LIFO, so push them by
+      // descending inode.
+      std::sort(children.begin(), children.end(), [&](const Child& a, const Child& b) {
+        return options.breadth_first ? a.ino < b.ino : a.ino > b.ino;
+      });
+
+      std::lock_guard<std::mutex> lock(mu);
+      --active;
+      --queue->active;
+      ++queue->stats.dirs;
+      queue->stats.entries += dir.entries.size();
+      const double list_seconds = std::chrono::duration<double>(list_time).count();
+      queue->stats.busy_seconds += list_seconds;
+      const unsigned old_limit = queue->limit.current();
+      if (listed) {
+        queue->limit.Sample(list_seconds, dir.entries.size(), queue->active + 1);
+      }
+      stopped = stopped || stop;
+      bool level_done = false;
+      if (options.breadth_first) {
+        level_done = --open_by_depth[static_cast<size_t>(dir.depth)] == 0;
+      }
+      size_t pushed = 0;
+      for (auto& child : children) {
+        if (visited.Insert(child.dev, child.ino)) {
+          enqueue(std::move(child.path), child.depth, child.dev);
+          ++pushed;
+        }
+      }
+      // One more unit of work (or a freed or added slot on a waiting device)
+      // wakes one worker; anything else that may end a wait wakes all.
+      const size_t ready = pushed + (queue->pending.empty() ? 0 : 1) +
+                           (queue->limit.current() - std::min(old_limit, queue->limit.current()));
+      if (stopped || (queued == 0 && active == 0) || (pausing && active == 0) || ready > 1 ||
+          level_done) {
+        cv.notify_all();
+      } else if (ready == 1) {
+        cv.notify_one();
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned w = 1; w < workers; ++w) {
+    threads.emplace_back(run, w);
+  }
+  run(0);
+  for (auto& t : threads) {
+    t.join();
+  }
+  if (options.stats != nullptr) {
+    options.stats->workers = workers;
+    options.stats->seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    options.stats->devices.clear();
+    for (const auto& queue : devices) {
+      options.stats->devices.push_back(queue->stats);
+      WalkDeviceStats& device = options.stats->devices.back();
+      device.info = queue->info;
+      device.concurrency = queue->limit.current();
+      device.concurrency_low = queue->limit.low();
+      device.concurrency_high = queue->limit.high();
+    }
+  }
+  return !stopped;
+}
+
+struct LsItem {
+  std::string name;
+  std::string type;
+  std::string size;
+  std::string modify_time;
+  std::uintmax_t size_bytes = 0;
+  std::time_t modify_time_t = 0;
+  bool is_dir = false;
+  bool is_empty_dir = false;
+};
+
+static std::uintmax_t CalculateDirectorySizeBytes(const std::string& dir_path,
+                                                 LinkPolicy links);
+
+static void HandleLsCommand(const std::vector<std::string>& tokens) {
+  enum class Mode {
+    kNormal,
+    kSortSize,
+    kSortTime,
+  };
+  Mode mode = Mode::kNormal;
+  LinkPolicy links = LinkPolicy::kPhysical;
+  for (size_t i = 1; i < tokens.size(); ++i) {
+    if (tokens[i] == "-s") {
+      mode = Mode::kSortSize;
+    } else if (tokens[i] == "-t") {
+      mode = Mode::kSortTime;
+    } else if (!ParseLinkPolicyFlag(tokens[i], &links)) {
+      std::cout << "Invalid option: ls\n";
+      return;
+    }
+  }
+
+  std::vector<WalkEntry> entries;
+  if (!ReadDirectory(".", links, &entries)) {
+    std::cout << "Failed to access current directory\n";
+    return;
+  }
+
+  std::vector<LsItem> items;
+  items.reserve(entries.size());
+  for (const auto& entry : entries) {
+    const bool is_dir = entry.IsDir();
+    const bool is_file = entry.IsFile();
+    LsItem item;
+    item.is_dir = is_dir;
+    if (ShowAsLink(entry, links)) {
+      item.name = entry.name + " -> " + ReadLinkTarget(AT_FDCWD, entry.path);
+      item.type = "Link";
+    } else {
+      item.name = entry.name + (is_dir ? "/" : "");
+      item.type = is_dir ? "Dir" : "File";
+    }
+
+    if (mode == Mode::kSortSize && is_dir) {
+      item.is_empty_dir = g_vfs->IsEmptyDir(entry.path);
+      item.size_bytes = CalculateDirectorySizeBytes(entry.path, links);
+      item.size = std::to_string(item.size_bytes);
+    } else if (is_file) {
+      item.size_bytes = static_cast<std::uintmax_t>(entry.st.st_size);
+      item.size = std::to_string(item.size_bytes);
+    } else {
+      item.size = "-";
+      item.size_bytes = 0;
+    }
+
+    item.modify_time_t = entry.stat_ok ? entry.st.st_mtime : 0;
+    item.modify_time = entry.stat_ok ? FormatLocalTime(item.modify_time_t) : "-";
+
+    items.push_back(std::move(item));
+  }
+
+  if (mode == Mode::kSortTime) {
+    std::sort(items.begin(), items.end(), [](const LsItem& a, const LsItem& b) {
+      if (a.modify_time_t != b.modify_time_t) {
+        return a.modify_time_t > b.modify_time_t;
+      }
+      return a.name < b.name;
+    });
+  } else if (mode == Mode::kSortSize) {
+    std::sort(items.begin(), items.end(), [](const LsItem& a, const LsItem& b) {
+      if (a.is_empty_dir != b.is_empty_dir) {
+        return !a.is_empty_dir;
+      }
+      if (a.size_bytes != b.size_bytes) {
+        return a.size_bytes > b.size_bytes;
+      }
+      return a.name < b.name;
+    });
+  }
+
+  size_t name_w = std::string("Name").size();
+  size_t type_w = std::string("Type").size();
+  size_t size_w = std::string("Size(B)").size();
+  for (const auto& item : items) {
+    name_w = std::max(name_w, item.name.size());
+    type_w = std::max(type_w, item.type.size());
+    size_w = std::max(size_w, item.size.size());
+  }
+
+  std::cout << std::left << std::setw(static_cast<int>(name_w)) << "Name"
+            << " " << std::left << std::setw(static_cast<int>(type_w)) << "Type"
+            << " " << std::right << std::setw(static_cast<int>(size_w)) << "Size(B)"
+            << " " << "Modify Time" << "\n";
+
+  const TraceSpan span("output", "print_listing", items.size());
+  for (const auto& item : items) {
+    std::cout << std::left << std::setw(static_cast<int>(name_w)) << item.name
+              << " " << std::left << std::setw(static_cast<int>(type_w)) << item.type
+              << " " << std::right << std::setw(static_cast<int>(size_w)) << item.size
+              << " " << item.modify_time << "\n";
+  }
+}
+
+// Splits "a/b/c" into ("a/b", "c"); trailing slashes are ignored.
+static std::pair<std::string, std::string> SplitParentLeaf(std::string path) {
+  while (path.size() > 1 && path.back() == '/') {
+    path.pop_back();
+  }
+  const size_t slash = path.rfind('/');
+  if (slash == std::string::npos) {
+    return {std::string(), path};
+  }
+  return {slash == 0 ? std::string("/") : path.substr(0, slash),
+          path.substr(slash + 1)};
+}
+
+// Opens each distinct parent directory once, so creating many entries costs a
+// single openat/mkdirat per entry relative to the cached descriptor. A failed
+// open is cached with its errno, which every later Get for that directory
+// reports again.
+class DirFdCache {
+ public:
+  DirFdCache() = default;
+  DirFdCache(const DirFdCache&) = delete;
+  DirFdCache& operator=(const DirFdCache&) = delete;
+  ~DirFdCache() {
+    for (const auto& kv : fds_) {
+      if (kv.second.fd >= 0) {
+        g_vfs->CloseDir(kv.second.fd);
+      }
+    }
+  }
+
+  // Returns the descriptor, or -1 with errno set.
+  int Get(const std::string& dir) {
+    if (dir.empty()) {
+      return AT_FDCWD;
+    }
+    auto it = fds_.find(dir);
+    if (it == fds_.end()) {
+      const int fd = g_vfs->OpenDir(dir);
+      it = fds_.emplace(dir, Entry{fd, fd < 0 ? errno : 0}).first;
+    }
+    if (it->second.fd < 0) {
+      errno = it->second.error;
+    }
+    return it->second.fd;
+  }
+
+ private:
+  struct Entry {
+    int fd;
+    int error;
+  };
+
+  std::unordered_map<std::string, Entry> fds_;
+};
+
+static bool WriteAll(int fd, const char* data, size_t n);
+static std::uint32_t Xxh32(const unsigned char* p, size_t len, std::uint32_t seed);
+
+// Audit journal of mutating commands ("journal on"). A command encodes one
+// record per operation and pushes it into a bounded multi-producer ring --
+// the only cost on its path; a background thread appends batches to the
+// journal file and fdatasyncs after every fsync_every records or fsync_ms
+// milliseconds, whichever comes first, so a crash loses at most that
+// window. A full ring makes producers wait instead of dropping records.
+//
+// File format: the 8-byte magic, then records of
+//   u32 body size, u32 xxh32(body), body
+// with body = u64 realtime ns, u32 pid, i32 errno (0: success), u8 op,
+// 3 bytes padding, u32 size of path, u32 size of target, path, target --
+// all in host byte order. Paths are stored as typed; "session" and "cd"
+// records carry the working directory they are relative to.
+enum class JournalOp : std::uint8_t {
+  kSession,
+  kCd,
+  kRm,
+  kRmdir,
+  kMv,
+  kCp,
+  kTouch,
+  kMkdir,
+};
+
+static const char* JournalOpName(JournalOp op) {
+  static const char* const kNames[] = {"session", "cd", "rm", "rmdir", "mv", "cp", "touch", "mkdir"};
+  const auto index = static_cast<size_t>(op);
+  return index < sizeof(kNames) / sizeof(kNames[0]) ? kNames[index] : "?";
+}
+
+static constexpr char kJournalMagic[8] = {'M', 'F', 'E', 'J', 'R', 'N', 'L', '1'};
+static constexpr size_t kJournalBodyHeader = 28;
+
+// Bounded lock-free queue for many producers and the single journal writer
+// (sequence-numbered slots, after Vyukov).
+class JournalRing {
+ public:
+  explicit JournalRing(size_t capacity)  // a power of two
+      : slots_(new Slot[capacity]), mask_(capacity - 1) {
+    for (size_t i = 0; i < capacity; ++i) {
+      slots_[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  bool TryPush(std::string* record) {
+    size_t pos = tail_.load(std::memory_order_relaxed);
+    while (true) {
+      Slot& slot = slots_[pos & mask_];
+      const size_t seq = slot.seq.load(std::memory_order_acquire);
+      const auto diff = static_cast<std::ptrdiff_t>(seq - pos);
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          slot.record = std::move(*record);
+          slot.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;  // full
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Writer thread only.
+  bool TryPop(std::string* record) {
+    Slot& slot = slots_[head_ & mask_];
+    if (slot.seq.load(std::memory_order_acquire) != head_ + 1) {
+      return false;
+    }
+    *record = std::move(slot.record);
+    slot.seq.store(head_ + mask_ + 1, std::memory_order_release);
+    ++head_;
+    return true;
+  }
+
+ private:
+  struct Slot {
+    std::atomic<size_t> seq{0};
+    std::string record;
+  };
+
+  std::unique_ptr<Slot[]> slots_;
+  size_t mask_;
+  alignas(64) std::atomic<size_t> tail_{0};
+  alignas(64) size_t head_ = 0;
+};
+
+class AuditJournal {
+ public:
+  static constexpr size_t kRingCapacity = 1 << 14;
+
+  ~AuditJournal() { Stop(); }
+
+  bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+  const std::string& path() const { return path_; }
+  std::uint64_t records() const { return written_.load(); }
+  std::uint64_t syncs() const { return syncs_.load(); }
+  bool failed() const { return failed_.load(); }
+  size_t fsync_every() const { return fsync_every_; }
+  unsigned fsync_ms() const { return fsync_ms_; }
+
+  // Opens (or creates) path for appending and starts the writer.
+  bool Start(const std::string& path, size_t fsync_every, unsigned fsync_ms) {
+    Stop();
+    const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    struct stat st;
+    if (fd < 0 || ::fstat(fd, &st) != 0 ||
+        (st.st_size == 0 && !WriteAll(fd, kJournalMagic, sizeof(kJournalMagic)))) {
+      if (fd >= 0) {
+        ::close(fd);
+      }
+      return false;
+    }
+    fd_ = fd;
+    path_ = path;
+    fsync_every_ = std::max<size_t>(fsync_every, 1);
+    fsync_ms_ = fsync_ms;
+    stop_ = false;
+    pushed_ = 0;
+    written_ = 0;
+    syncs_ = 0;
+    failed_ = false;
+    ring_ = std::make_unique<JournalRing>(kRingCapacity);
+    writer_ = StartBackgroundThread([this]() { Run(); });
+    enabled_ = true;
+    return true;
+  }
+
+  // Writes and syncs everything pushed so far, then stops the writer.
+  void Stop() {
+    if (!writer_.joinable()) {
+      return;
+    }
+    enabled_ = false;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      stop_ = true;
+    }
+    cv_.notify_one();
+    writer_.join();
+    ::close(fd_);
+    fd_ = -1;
+  }
+
+  // Waits until every record pushed so far is in the file.
+  void Flush() {
+    const std::uint64_t target = pushed_.load();
+    while (written_.load() < target && writer_.joinable()) {
+      cv_.notify_one();
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+
+  void Push(std::string record) {
+    while (!ring_->TryPush(&record)) {
+      cv_.notify_one();
+      std::this_thread::yield();
+    }
+    pushed_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+ private:
+  void Run() {
+    std::string batch;
+    std::string record;
+    size_t unsynced = 0;
+    auto last_sync = std::chrono::steady_clock::now();
+    const auto interval = std::chrono::milliseconds(fsync_ms_ > 0 ? fsync_ms_ : 100);
+    while (true) {
+      size_t n = 0;
+      while (ring_->TryPop(&record)) {
+        batch += record;
+        ++n;
+      }
+      if (n > 0) {
+        if (!WriteAll(fd_, batch.data(), batch.size())) {
+          failed_ = true;
+        }
+        batch.clear();
+        unsynced += n;
+        written_ += n;
+      }
+      const auto now = std::chrono::steady_clock::now();
+      bool stopping = false;
+      if (n == 0) {
+        std::unique_lock<std::mutex> lock(mu_);
+        stopping = stop_;
+      }
+      if (unsynced > 0 && (stopping || unsynced >= fsync_every_ || now - last_sync >= interval)) {
+        ::fdatasync(fd_);
+        ++syncs_;
+        unsynced = 0;
+        last_sync = now;
+      }
+      if (stopping) {
+        return;
+      }
+      if (n == 0) {
+        // Producers do not signal every push; the timeout bounds how long a
+        // record waits in the ring.
+        std::unique_lock<std::mutex> lock(mu_);
+        cv_.wait_for(lock, std::chrono::milliseconds(10), [this]() { return stop_; });
+      }
+    }
+  }
+
+  std::atomic<bool> enabled_{false};
+  std::string path_;
+  int fd_ = -1;
+  size_t fsync_every_ = 256;
+  unsigned fsync_ms_ = 100;
+  std::unique_ptr<JournalRing> ring_;
+  std::thread writer_;
+  std::mutex mu_;
+  std::condition_variable cv_;
+  bool stop_ = false;
+  std::atomic<std::uint64_t> pushed_{0};
+  std::atomic<std::uint64_t> written_{0};
+  std::atomic<std::uint64_t> syncs_{0};
+  std::atomic<bool> failed_{false};
+};
+
+static AuditJournal g_journal;
+
+static std::string EncodeJournalRecord(JournalOp op, const std::string& path,
+                                       const std::string& target, int error) {
+  struct timespec now;
+  ::clock_gettime(CLOCK_REALTIME, &now);
+  const std::uint64_t time_ns = static_cast<std::uint64_t>(now.tv_sec) * 1000000000ull +
+                                static_cast<std::uint64_t>(now.tv_nsec);
+  const auto pid = static_cast<std::uint32_t>(::getpid());
+  const auto err = static_cast<std::int32_t>(error);
+  const auto path_size = static_cast<std::uint32_t>(path.size());
+  const auto target_size = static_cast<std::uint32_t>(target.size());
+  const auto body_size = static_cast<std::uint32_t>(kJournalBodyHeader + path.size() + target.size());
+
+  std::string record(8 + body_size, '\0');
+  char* body = &record[8];
+  std::memcpy(body, &time_ns, 8);
+  std::memcpy(body + 8, &pid, 4);
+  std::memcpy(body + 12, &err, 4);
+  body[16] = static_cast<char>(op);
+  std::memcpy(body + 20, &path_size, 4);
+  std::memcpy(body + 24, &target_size, 4);
+  std::memcpy(body + kJournalBodyHeader, path.data(), path.size());
+  std::memcpy(body + kJournalBodyHeader + path.size(), target.data(), target.size());
+  const std::uint32_t checksum = Xxh32(reinterpret_cast<const unsigned char*>(body), body_size, 0);
+  std::memcpy(&record[0], &body_size, 4);
+  std::memcpy(&record[4], &checksum, 4);
+  return record;
+}
+
+// Records one operation (error: its errno, 0 on success) if the journal is
+// on. Safe to call from worker threads.
+static void JournalOperation(JournalOp op, const std::string& path, const std::string& target,
+                             int error) {
+  if (g_journal.enabled()) {
+    g_journal.Push(EncodeJournalRecord(op, path, target, error));
+  }
+}
+
+struct CreateTarget {
+  std::string name;
+  std::string parent;
+  std::string leaf;
+  int dir_fd = -1;
+  int error = 0;
+};
+
+static std::vector<CreateTarget> PrepareCreateTargets(const std::vector<std::string>& names) {
+  std::vector<CreateTarget> targets;
+  targets.reserve(names.size());
+  for (const auto& name : names) {
+    auto [parent, leaf] = SplitParentLeaf(name);
+    CreateTarget target;
+    target.name = name;
+    target.parent = std::move(parent);
+    target.leaf = std::move(leaf);
+    targets.push_back(std::move(target));
+  }
+  return targets;
+}
+
+// Splits targets into creation rounds: a target whose parent directory is
+// itself a target of the same command ("mkdir a a/b") goes in the round
+// after its parent, so the parent exists before its descriptor is opened.
+// Usually there is a single round.
+static std::vector<std::vector<size_t>> CreateRounds(const std::vector<CreateTarget>& targets) {
+  auto key = [](std::string path) {
+    while (path.size() > 1 && path.back() == '/') {
+      path.pop_back();
+    }
+    return path;
+  };
+  std::unordered_map<std::string, size_t> by_name;
+  for (size_t i = 0; i < targets.size(); ++i) {
+    by_name.emplace(key(targets[i].name), i);
+  }
+  std::vector<size_t> round(targets.size(), SIZE_MAX);
+  std::vector<std::vector<size_t>> rounds;
+  for (size_t i = 0; i < targets.size(); ++i) {
+    // Follow the chain of in-batch parents (each strictly shorter) up to
+    // one whose round is known or that has none, then number downwards.
+    std::vector<size_t> chain;
+    size_t base = 0;
+    for (size_t at = i; round[at] == SIZE_MAX;) {
+      chain.push_back(at);
+      const auto parent = by_name.find(key(targets[at].parent));
+      if (targets[at].parent.empty() || parent == by_name.end()) {
+        break;
+      }
+      if (round[parent->second] != SIZE_MAX) {
+        base = round[parent->second] + 1;
+        break;
+      }
+      at = parent->second;
+    }
+    for (auto it = chain.rbegin(); it != chain.rend(); ++it, ++base) {
+      round[*it] = base;
+    }
+  }
+  for (size_t i = 0; i < targets.size(); ++i) {
+    if (round[i] >= rounds.size()) {
+      rounds.resize(round[i] + 1);
+    }
+    rounds[round[i]].push_back(i);
+  }
+  return rounds;
+}
+
+// Opens the parent directories of one round; a target that already failed
+// keeps its error.
+static void OpenCreateParents(const std::vector<size_t>& round, DirFdCache* cache,
+                              std::vector<CreateTarget>* targets) {
+  for (size_t i : round) {
+    CreateTarget& target = (*targets)[i];
+    if (target.error != 0) {
+      continue;
+    }
+    target.dir_fd = cache->Get(target.parent);
+    if (target.dir_fd == -1) {
+      target.error = errno;
+    }
+  }
+}
+
+static constexpr size_t kCreateChunk = 4096;
+
+static void HandleTouchCommand(const std::vector<std::string>& tokens) {
+  if (tokens.size() < 2) {
+    std::cout << "Missing filename: Please enter 'touch [name]'\n";
+    return;
+  }
+  const std::vector<std::string> names = ExpandTargets(
+      std::vector<std::string>(tokens.begin() + 1, tokens.end()));
+
+  DirFdCache cache;
+  std::vector<CreateTarget> targets = PrepareCreateTargets(names);
+  for (const auto& round : CreateRounds(targets)) {
+    OpenCreateParents(round, &cache, &targets);
+    ParallelFor(round.size(), kCreateChunk, [&targets, &round](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i) {
+        CreateTarget& target = targets[round[i]];
+        if (target.error == 0 && !g_vfs->CreateFileAt(target.dir_fd, target.leaf, 0666)) {
+          target.error = errno;
+        }
+        JournalOperation(JournalOp::kTouch, target.name, {}, target.error);
+      }
+    });
+  }
+
+  std::ostringstream out;
+  for (const auto& target : targets) {
+    if (target.error == EEXIST) {
+      out << "File already exists: " << target.name << "\n";
+    } else if (target.error != 0) {
+      out << "Failed to create file: " << target.name << "\n";
+    }
+  }
+  std::cout << out.str();
+}
+
+// Creates every missing component of dir (like "mkdir -p" for parents).
+// Each directory it creates, or fails to create, is journaled as a mkdir.
+static bool EnsureDirectoryPath(const std::string& dir,
+                                std::unordered_set<std::string>* ensured) {
+  if (dir.empty() || ensured->count(dir) != 0) {
+    return true;
+  }
+  size_t pos = (dir[0] == '/') ? 1 : 0;
+  while (true) {
+    const size_t slash = dir.find('/', pos);
+    const std::string prefix = dir.substr(0, slash);
+    if (!prefix.empty() && ensured->count(prefix) == 0) {
+      if (g_vfs->MakeDirAt(AT_FDCWD, prefix, 0777)) {
+        JournalOperation(JournalOp::kMkdir, prefix, {}, 0);
+      } else {
+        const int error = errno;
+        struct stat st;
+        if (error != EEXIST || !g_vfs->StatAt(AT_FDCWD, prefix, true, &st) ||
+            !S_ISDIR(st.st_mode)) {
+          JournalOperation(JournalOp::kMkdir, prefix, {}, error);
+          errno = error;
+          return false;
+        }
+      }
+      ensured->insert(prefix);
+    }
+    if (slash == std::string::npos) {
+      return true;
+    }
+    pos = slash + 1;
+  }
+}
+
+static void HandleMkdirCommand(const std::vector<std::string>& tokens) {
+  bool parents = false;
+  std::vector<std::string> args;
+  for (size_t i = 1; i < tokens.size(); ++i) {
+    if (tokens[i] == "-p") {
+      parents = true;
+    } else {
+      args.push_back(tokens[i]);
+    }
+  }
+  if (args.empty()) {
+    std::cout << "Missing directory name: Please enter 'mkdir [name]'\n";
+    return;
+  }
+  const std::vector<std::string> names = ExpandTargets(args);
+
+  std::vector<int> parent_errors(names.size(), 0);
+  if (parents) {
+    std::unordered_set<std::string> ensured;
+    for (size_t i = 0; i < names.size(); ++i) {
+      if (!EnsureDirectoryPath(SplitParentLeaf(names[i]).first, &ensured)) {
+        parent_errors[i] = errno;
+      }
+    }
+  }
+
+  DirFdCache cache;
+  std::vector<CreateTarget> targets = PrepareCreateTargets(names);
+  for (size_t i = 0; i < targets.size(); ++i) {
+    targets[i].error = parent_errors[i];
+  }
+  for (const auto& round : CreateRounds(targets)) {
+    OpenCreateParents(round, &cache, &targets);
+    ParallelFor(round.size(), kCreateChunk,
+                [&targets, &round, parents](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i) {
+        CreateTarget& target = targets[round[i]];
+        if (target.error == 0 && !g_vfs->MakeDirAt(target.dir_fd, target.leaf, 0777)) {
+          target.error = errno;
+          struct stat st;
+          if (parents && target.error == EEXIST &&
+              g_vfs->StatAt(target.dir_fd, target.leaf, true, &st) && S_ISDIR(st.st_mode)) {
+            target.error = 0;
+            continue;  // nothing was created, so nothing is journaled
+          }
+        }
+        JournalOperation(JournalOp::kMkdir, target.name, {}, target.error);
+      }
+    });
+  }
+
+  std::ostringstream out;
+  for (const auto& target : targets) {
+    if (target.error == EEXIST && !parents) {
+      out << "Directory already exists: " << target.name << "\n";
+    } else if (target.error != 0) {
+      out << "Failed to create directory: " << target.name << "\n";
+    }
+  }
+  std::cout << out.str();
+}
+
+// Renames from -> to, failing with EEXIST instead of replacing an existing
+// target.
+static bool RenameNoReplace(int from_fd, const std::string& from, int to_fd,
+                            const std::string& to) {
+  return g_vfs->RenameAt(from_fd, from, to_fd, to, true);
+}
+
+// dir_fd may be a failed DirFdCache::Get (-1); its errno is kept.
+static bool RenameNoReplace(int dir_fd, const std::string& from, const std::string& to) {
+  return dir_fd != -1 && RenameNoReplace(dir_fd, from, dir_fd, to);
+}
+
+// Parses "512", "64K", "10M", "2G" or "1T" (binary units, optional "B" or
+// "iB" suffix) into bytes.
+static bool ParseByteSize(const std::string& text, std::uint64_t* bytes) {
+  size_t pos = 0;
+  std::uint64_t value = 0;
+  while (pos < text.size() && std::isdigit(static_cast<unsigned char>(text[pos]))) {
+    if (value > (UINT64_MAX - 9) / 10) {
+      return false;
+    }
+    value = value * 10 + static_cast<std::uint64_t>(text[pos] - '0');
+    ++pos;
+  }
+  if (pos == 0) {
+    return false;
+  }
+  std::string unit = ToLowerAscii(text.substr(pos));
+  if (unit.size() == 3 && EndsWith(unit, "ib")) {
+    unit.resize(1);
+  } else if (unit.size() == 2 && unit[1] == 'b') {
+    unit.resize(1);
+  }
+  unsigned shift = 0;
+  if (unit == "k") {
+    shift = 10;
+  } else if (unit == "m") {
+    shift = 20;
+  } else if (unit == "g") {
+    shift = 30;
+  } else if (unit == "t") {
+    shift = 40;
+  } else if (!unit.empty() && unit != "b") {
+    return false;
+  }
+  if (shift != 0 && value > (UINT64_MAX >> shift)) {
+    return false;
+  }
+  *bytes = value << shift;
+  return true;
+}
+
+// Absolute, lexically normalized form of path (symbolic links untouched),
+// relative to the working directory of the active VFS.
+static std::string AbsolutePath(const std::string& path) {
+  const std::filesystem::path p(path);
+  if (p.is_absolute()) {
+    return p.lexically_normal().string();
+  }
+  const std::string cwd = g_vfs->CurrentDir();
+  return cwd.empty() ? path : (std::filesystem::path(cwd) / p).lexically_normal().string();
+}
+
+// Trash mode: rm and rmdir move the entry into a trash directory on the same
+// filesystem with one renameat, so neither deleting nor restoring copies
+// data. Entries on the home filesystem go to $XDG_DATA_HOME (default
+// ~/.local/share)/MiniFileExplorer-Trash, others to
+// <mount root>/.MiniFileExplorer-Trash-<uid>. Each trash directory keeps a
+// "journal" of "time<TAB>original<TAB>entry" lines; trash entries are named
+// "<time>.<pid>.<seq>-<leaf>" so the purger can evict the oldest first.
+enum class UndoKind {
+  kTrash,  // rm/rmdir: current is inside a trash directory
+  kMove,   // mv: current is the move target
+};
+
+struct UndoRecord {
+  UndoKind kind = UndoKind::kTrash;
+  std::string original;  // absolute path before the operation
+  std::string current;   // absolute path after it
+};
+
+struct TrashDir {
+  std::string path;
+  std::atomic<std::uint64_t> bytes{0};  // estimate; refreshed by each purge
+};
+
+struct TrashState {
+  bool enabled = false;
+  std::uint64_t budget = std::uint64_t{1} << 30;  // per trash directory
+  std::uint64_t seq = 0;
+  std::vector<UndoRecord> journal;  // undo stack, newest last
+  std::unordered_map<std::uint64_t, std::unique_ptr<TrashDir>> dirs;  // by st_dev
+  std::thread purger;
+  std::atomic<bool> purging{false};
+};
+
+static TrashState g_trash;
+
+static const char* const kTrashJournal = "journal";
+
+// Highest ancestor of dir that is still on device dev.
+static std::string FindMountRoot(std::string dir, dev_t dev) {
+  while (dir != "/") {
+    const std::string up = SplitParentLeaf(dir).first;
+    struct stat st;
+    if (up.empty() || ::stat(up.c_str(), &st) != 0 || st.st_dev != dev) {
+      break;
+    }
+    dir = up;
+  }
+  return dir;
+}
+
+// A usable trash directory is a real directory owned by us and not
+// accessible to others; a link planted in its place is rejected.
+static bool PrepareTrashDir(const std::string& path, dev_t dev) {
+  std::unordered_set<std::string> ensured;
+  if (::mkdir(path.c_str(), 0700) != 0 && errno == ENOENT) {
+    if (!EnsureDirectoryPath(SplitParentLeaf(path).first, &ensured)) {
+      return false;
+    }
+    ::mkdir(path.c_str(), 0700);
+  }
+  struct stat st;
+  return ::lstat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode) && st.st_uid == ::getuid() &&
+         (st.st_mode & 0077) == 0 && st.st_dev == dev;
+}
+
+// Finds (and on first use creates) the trash directory for entries on dev.
+// parent is the absolute directory that holds the entry being deleted.
+static TrashDir* TrashDirFor(dev_t dev, const std::string& parent) {
+  const auto key = static_cast<std::uint64_t>(dev);
+  const auto it = g_trash.dirs.find(key);
+  if (it != g_trash.dirs.end()) {
+    return it->second.get();
+  }
+
+  std::vector<std::string> candidates;
+  const std::string home = GetHomeDir();
+  struct stat home_st;
+  if (!home.empty() && ::stat(home.c_str(), &home_st) == 0 && home_st.st_dev == dev) {
+    const char* data_home = std::getenv("XDG_DATA_HOME");
+    const std::string base = (data_home != nullptr && data_home[0] == '/')
+                                 ? std::string(data_home)
+                                 : JoinPath(home, ".local/share");
+    candidates.push_back(JoinPath(base, "MiniFileExplorer-Trash"));
+  }
+  candidates.push_back(JoinPath(FindMountRoot(parent, dev),
+                                ".MiniFileExplorer-Trash-" + std::to_string(::getuid())));
+
+  for (const auto& path : candidates) {
+    if (!PrepareTrashDir(path, dev)) {
+      continue;
+    }
+    auto dir = std::make_unique<TrashDir>();
+    dir->path = path;
+    std::vector<WalkEntry> entries;
+    ReadDirectory(path, LinkPolicy::kPhysical, &entries);
+    std::uint64_t bytes = 0;
+    for (const auto& entry : entries) {
+      if (entry.stat_ok && entry.name != kTrashJournal) {
+        bytes += static_cast<std::uint64_t>(entry.st.st_size);
+      }
+    }
+    dir->bytes = bytes;
+    TrashDir* raw = dir.get();
+    g_trash.dirs.emplace(key, std::move(dir));
+    return raw;
+  }
+  return nullptr;
+}
+
+// Removes the oldest trash entries until every directory fits in budget; a
+// budget of 0 ("trash purge") removes every entry, empty files included.
+// Runs on the purger thread; entries renamed in meanwhile are simply newer.
+static void PurgeTrashDirs(const std::vector<TrashDir*>& dirs, std::uint64_t budget) {
+  for (TrashDir* dir : dirs) {
+    std::vector<WalkEntry> entries;
+    if (!ReadDirectory(dir->path, LinkPolicy::kPhysical, &entries)) {
+      continue;
+    }
+    std::vector<std::pair<std::uint64_t, const WalkEntry*>> owned;
+    std::uint64_t total = 0;
+    for (const auto& entry : entries) {
+      char* end = nullptr;
+      const std::uint64_t stamp = std::strtoull(entry.name.c_str(), &end, 10);
+      if (entry.name == kTrashJournal || end == entry.name.c_str() || *end != '.') {
+        continue;  // not ours
+      }
+      owned.emplace_back(stamp, &entry);
+      total += entry.stat_ok ? static_cast<std::uint64_t>(entry.st.st_size) : 0;
+    }
+    std::sort(owned.begin(), owned.end(), [](const auto& a, const auto& b) {
+      return a.first != b.first ? a.first < b.first : a.second->name < b.second->name;
+    });
+    for (const auto& item : owned) {
+      if (budget > 0 && total <= budget) {
+        break;
+      }
+      const WalkEntry& entry = *item.second;
+      std::error_code ec;
+      if (entry.IsDir() && !entry.is_link) {
+        std::filesystem::remove_all(entry.path, ec);
+      } else if (::unlink(entry.path.c_str()) != 0) {
+        continue;
+      }
+      total -= entry.stat_ok ? static_cast<std::uint64_t>(entry.st.st_size) : 0;
+    }
+    dir->bytes = total;
+  }
+  g_trash.purging = false;
+}
+
+// Starts a background purge unless one is still running.
+static bool StartTrashPurge(std::uint64_t budget) {
+  if (g_trash.purging) {
+    return false;
+  }
+  if (g_trash.purger.joinable()) {
+    g_trash.purger.join();
+  }
+  std::vector<TrashDir*> dirs;
+  for (const auto& kv : g_trash.dirs) {
+    dirs.push_back(kv.second.get());
+  }
+  g_trash.purging = true;
+  g_trash.purger = StartBackgroundThread(
+      [dirs = std::move(dirs), budget]() { PurgeTrashDirs(dirs, budget); });
+  return true;
+}
+
+static void FinishTrashPurge() {
+  if (g_trash.purger.joinable()) {
+    g_trash.purger.join();
+  }
+}
+
+// Moves path into its filesystem's trash and records the undo entry. Trash
+// directories live on real filesystems only.
+static bool MoveToTrash(const std::string& path) {
+  if (!g_vfs->Posix()) {
+    return false;
+  }
+  const std::string abs = AbsolutePath(path);
+  const std::string parent = SplitParentLeaf(abs).first;
+  struct stat st;
+  if (::lstat(abs.c_str(), &st) != 0) {
+    return false;
+  }
+  TrashDir* dir = TrashDirFor(st.st_dev, parent);
+  if (dir == nullptr) {
+    return false;
+  }
+  const std::time_t now = std::time(nullptr);
+  const std::string entry = std::to_string(static_cast<long long>(now)) + "." +
+                            std::to_string(::getpid()) + "." +
+                            std::to_string(++g_trash.seq) + "-" +
+                            SplitParentLeaf(abs).second;
+  const std::string trashed = JoinPath(dir->path, entry);
+  if (!RenameNoReplace(AT_FDCWD, abs, AT_FDCWD, trashed)) {
+    return false;
+  }
+
+  std::ofstream journal(JoinPath(dir->path, kTrashJournal), std::ios::app);
+  journal << now << "\t" << abs << "\t" << entry << "\n";
+  g_trash.journal.push_back(UndoRecord{UndoKind::kTrash, abs, trashed});
+
+  dir->bytes += static_cast<std::uint64_t>(st.st_size);
+  if (dir->bytes > g_trash.budget) {
+    StartTrashPurge(g_trash.budget);
+  }
+  return true;
+}
+
+static void RecordMove(const std::string& from, const std::string& to) {
+  g_trash.journal.push_back(UndoRecord{UndoKind::kMove, AbsolutePath(from), AbsolutePath(to)});
+}
+
+enum class UndoResult {
+  kDone,
+  kGone,    // nothing left to restore; the record can only be dropped
+  kFailed,
+};
+
+// Puts one journal entry back. Restores never overwrite: if the original
+// name has been reused meanwhile the entry stays where it is.
+static UndoResult UndoOne(const UndoRecord& record) {
+  struct stat st;
+  if (!g_vfs->StatAt(AT_FDCWD, record.current, false, &st)) {
+    if (record.kind == UndoKind::kTrash) {
+      std::cout << "Cannot undo: " << record.original << " was purged from trash\n";
+    } else {
+      std::cout << "Cannot undo: " << record.current << " no longer exists\n";
+    }
+    return UndoResult::kGone;
+  }
+  std::unordered_set<std::string> ensured;
+  if (!EnsureDirectoryPath(SplitParentLeaf(record.original).first, &ensured)) {
+    std::cout << "Cannot undo: failed to recreate parent of " << record.original << "\n";
+    return UndoResult::kFailed;
+  }
+  if (!RenameNoReplace(AT_FDCWD, record.current, AT_FDCWD, record.original)) {
+    bool restored = false;
+    if (errno == EXDEV && g_vfs->Posix() && S_ISREG(st.st_mode)) {
+      // mv fell back to copy + remove across filesystems; so does undo.
+      std::error_code ec;
+      restored = std::filesystem::copy_file(record.current, record.original,
+                                            std::filesystem::copy_options::none, ec) &&
+                 !ec && std::filesystem::remove(record.current, ec) && !ec;
+    } else if (errno == EEXIST) {
+      std::cout << "Cannot undo: target exists: " << record.original << "\n";
+      return UndoResult::kFailed;
+    }
+    if (!restored) {
+      std::cout << "Cannot undo: failed to restore " << record.original << "\n";
+      return UndoResult::kFailed;
+    }
+  }
+  if (record.kind == UndoKind::kTrash) {
+    std::cout << "Restored: " << record.original << "\n";
+  } else {
+    std::cout << "Moved back: " << record.current << " -> " << record.original << "\n";
+  }
+  return UndoResult::kDone;
+}
+
+static void HandleUndoCommand(const std::vector<std::string>& tokens) {
+  size_t count = 1;
+  if (tokens.size() > 2) {
+    std::cout << "Invalid option: " << tokens[2] << "\n";
+    return;
+  }
+  if (tokens.size() == 2) {
+    char* end = nullptr;
+    const unsigned long n = std::strtoul(tokens[1].c_str(), &end, 10);
+    if (tokens[1].empty() || *end != '\0' || n == 0 ||
+        !std::isdigit(static_cast<unsigned char>(tokens[1][0]))) {
+      std::cout << "Invalid option: " << tokens[1] << "\n";
+      return;
+    }
+    count = static_cast<size_t>(n);
+  }
+  if (g_trash.journal.empty()) {
+    std::cout << "Nothing to undo\n";
+    return;
+  }
+  // Undo runs newest first; a failed step stops the sequence so that later
+  // (older) operations are not replayed on top of a partial state. Records
+  // with nothing left to restore (purged from trash, moved away since) are
+  // reported, dropped and not counted.
+  while (count > 0 && !g_trash.journal.empty()) {
+    const UndoResult result = UndoOne(g_trash.journal.back());
+    if (result == UndoResult::kFailed) {
+      return;
+    }
+    g_trash.journal.pop_back();
+    if (result == UndoResult::kDone) {
+      --count;
+    }
+  }
+}
+
+static void HandleTrashCommand(const std::vector<std::string>& tokens) {
+  const std::string sub = tokens.size() >= 2 ? tokens[1] : "status";
+  if (sub == "on" || sub == "off") {
+    g_trash.enabled = (sub == "on");
+    std::cout << "Trash mode " << (g_trash.enabled ? "enabled" : "disabled") << "\n";
+    return;
+  }
+  if (sub == "budget") {
+    std::uint64_t budget = 0;
+    if (tokens.size() != 3 || !ParseByteSize(tokens[2], &budget)) {
+      std::cout << "Missing size: Please enter 'trash budget [size]'\n";
+      return;
+    }
+    g_trash.budget = budget;
+    std::cout << "Trash budget set to " << budget << " bytes\n";
+    StartTrashPurge(budget);
+    return;
+  }
+  if (sub == "purge") {
+    if (!StartTrashPurge(0)) {
+      std::cout << "Purge already running\n";
+      return;
+    }
+    std::cout << "Purging trash in background\n";
+    return;
+  }
+  if (sub != "status") {
+    std::cout << "Invalid option: " << sub << "\n";
+    return;
+  }
+  std::cout << "Trash mode: " << (g_trash.enabled ? "on" : "off") << "\n";
+  std::cout << "Budget: " << g_trash.budget << " bytes per filesystem\n";
+  std::cout << "Undo journal: " << g_trash.journal.size() << " operations\n";
+  if (g_trash.purging) {
+    std::cout << "Purge: running\n";
+  }
+  for (const auto& kv : g_trash.dirs) {
+    std::cout << "  " << kv.second->path << ": " << kv.second->bytes << " bytes\n";
+  }
+}
+
+static void HandleRmCommand(const std::vector<std::string>& tokens) {
+  if (tokens.size() < 2) {
+    std::cout << "Missing filename: Please enter 'rm [name]'\n";
+    return;
+  }
+  const std::string& name = tokens[1];
+
+  struct stat st;
+  if (!g_vfs->StatAt(AT_FDCWD, name, true, &st)) {
+    std::cout << "File not found: " << name << "\n";
+    return;
+  }
+  if (!S_ISREG(st.st_mode)) {
+    std::cout << "Not a file: " << name << "\n";
+    return;
+  }
+
+  std::cout << "Are you sure to delete " << name << "? (y/n)" << std::flush;
+  std::string confirm;
+  if (!std::getline(std::cin, confirm)) {
+    return;
+  }
+
+  if (confirm != "y") {
+    return;
+  }
+
+  if (g_trash.enabled) {
+    const bool moved = MoveToTrash(name);
+    JournalOperation(JournalOp::kRm, name, "(trash)", moved ? 0 : errno);
+    if (!moved) {
+      std::cout << "Failed to move to trash: " << name << "\n";
+    }
+    return;
+  }
+  const bool removed = g_vfs->RemoveAt(AT_FDCWD, name, false);
+  JournalOperation(JournalOp::kRm, name, {}, removed ? 0 : errno);
+  if (!removed) {
+    std::cout << "Failed to delete file: " << name << "\n";
+  }
+}
+
+static void HandleRmdirCommand(const std::vector<std::string>& tokens) {
+  if (tokens.size() < 2) {
+    std::cout << "Missing directory name: Please enter 'rmdir [name]'\n";
+    return;
+  }
+  const std::string& name = tokens[1];
+
+  struct stat st;
+  if (!g_vfs->StatAt(AT_FDCWD, name, true, &st)) {
+    std::cout << "Directory not found: " << name << "\n";
+    return;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    std::cout << "Not a directory: " << name << "\n";
+    return;
+  }
+  if (!g_vfs->IsEmptyDir(name)) {
+    std::cout << "Directory not empty: " << name << "\n";
+    return;
+  }
+  if (g_trash.enabled) {
+    const bool moved = MoveToTrash(name);
+    JournalOperation(JournalOp::kRmdir, name, "(trash)", moved ? 0 : errno);
+    if (!moved) {
+      std::cout << "Failed to move to trash: " << name << "\n";
+    }
+    return;
+  }
+  const bool removed = g_vfs->RemoveAt(AT_FDCWD, name, true);
+  JournalOperation(JournalOp::kRmdir, name, {}, removed ? 0 : errno);
+  if (!removed) {
+    std::cout << "Failed to delete directory: " << name << "\n";
+  }
+}
+
+// Uses statx on Linux so that the real birth time (ext4/xfs/btrfs) and the
+// mount id are available; other platforms fall back to fstatat.
+static bool QueryFileInfo(int dir_fd, const char* path, int flags,
+                          FileInfo* info) {
+#if defined(__linux__) && defined(STATX_BTIME)
+  struct statx stx;
+  unsigned int mask = STATX_BASIC_STATS | STATX_BTIME;
+#if defined(STATX_MNT_ID)
+  mask |= STATX_MNT_ID;
+#endif
+  if (::statx(dir_fd, path, flags, mask, &stx) != 0) {
+    return false;
+  }
+  info->mode = stx.stx_mode;
+  info->size = stx.stx_size;
+  info->blocks = stx.stx_blocks;
+  info->inode = stx.stx_ino;
+  info->links = stx.stx_nlink;
+  info->modify_time = stx.stx_mtime.tv_sec;
+  info->access_time = stx.stx_atime.tv_sec;
+  info->has_create_time = (stx.stx_mask & STATX_BTIME) != 0;
+  info->create_time = info->has_create_time ? stx.stx_btime.tv_sec : 0;
+#if defined(STATX_MNT_ID)
+  info->has_mount_id = (stx.stx_mask & STATX_MNT_ID) != 0;
+  info->mount_id = info->has_mount_id ? stx.stx_mnt_id : 0;
+#endif
+  return true;
+#else
+  struct stat st;
+  if (::fstatat(dir_fd, path, &st, flags) != 0) {
+    return false;
+  }
+  info->mode = st.st_mode;
+  info->size = static_cast<std::uint64_t>(st.st_size);
+  info->blocks = static_cast<std::uint64_t>(st.st_blocks);
+  info->inode = static_cast<std::uint64_t>(st.st_ino);
+  info->links = static_cast<std::uint64_t>(st.st_nlink);
+  info->modify_time = st.st_mtime;
+  info->access_time = st.st_atime;
+#if defined(__APPLE__)
+  info->has_create_time = true;
+  info->create_time = st.st_birthtimespec.tv_sec;
+#endif
+  return true;
+#endif
+}
+
+static void HandleStatCommand(const std::vector<std::string>& tokens) {
+  if (tokens.size() < 2) {
+    std::cout << "Missing target: Please enter'stat [name]'\n";
+    return;
+  }
+
+  LinkPolicy links = LinkPolicy::kPhysical;
+  std::vector<std::string> args;
+  for (size_t i = 1; i < tokens.size(); ++i) {
+    if (!ParseLinkPolicyFlag(tokens[i], &links)) {
+      args.push_back(tokens[i]);
+    }
+  }
+  if (args.empty()) {
+    std::cout << "Missing target: Please enter'stat [name]'\n";
+    return;
+  }
+  const std::vector<std::string> names = ExpandTargets(args);
+
+  // Query everything first, then format the whole report in one buffer, so
+  // that thousands of targets cost one pass of statx calls and one write.
+  std::vector<FileInfo> infos(names.size());
+  std::vector<bool> found(names.size(), false);
+  for (size_t i = 0; i < names.size(); ++i) {
+    found[i] = g_vfs->QueryInfo(names[i], links == LinkPolicy::kLogical, &infos[i]);
+  }
+
+  namespace fs = std::filesystem;
+  const std::string cwd_str = g_vfs->CurrentDir();
+  const bool cwd_ec = cwd_str.empty();
+  const fs::path cwd(cwd_str);
+  std::ostringstream out;
+  for (size_t i = 0; i < names.size(); ++i) {
+    const std::string& name = names[i];
+    if (i > 0) {
+      out << "\n";
+    }
+    if (!found[i]) {
+      out << "Target not found: " << name << "\n";
+      continue;
+    }
+    const FileInfo& info = infos[i];
+    const bool is_dir = S_ISDIR(info.mode);
+    const bool is_link = S_ISLNK(info.mode);
+    const std::string type = is_dir ? "Dir" : (is_link ? "Link" : "File");
+
+    const fs::path path(name);
+    const std::string abs_path =
+        (path.is_absolute() || cwd_ec) ? name : (cwd / path).string();
+
+    out << "Type: " << type << "\n";
+    out << "Path: " << abs_path << "\n";
+    if (is_link) {
+      out << "Link Target: " << ReadLinkTarget(AT_FDCWD, name) << "\n";
+    }
+    out << "Size: " << (is_dir ? "-" : std::to_string(info.size)) << "\n";
+    out << "Create Time: "
+        << (info.has_create_time ? FormatLocalTime(info.create_time) : "-")
+        << "\n";
+    out << "Modify Time: " << FormatLocalTime(info.modify_time) << "\n";
+    out << "Access Time: " << FormatLocalTime(info.access_time) << "\n";
+    out << "Blocks: " << info.blocks << "\n";
+    out << "Inode: " << info.inode << "\n";
+    out << "Links: " << info.links << "\n";
+    out << "Mount ID: "
+        << (info.has_mount_id ? std::to_string(info.mount_id) : "-") << "\n";
+  }
+  std::cout << out.str();
+}
+
+// Checkpoints for long walks (du, search). Between directories the walk
+// offers a checkpoint; roughly every kCheckpointInterval the
+// frontier and the command's partial aggregates are written to a small state
+// file under $XDG_STATE_HOME (default ~/.local/state)/MiniFileExplorer,
+// replaced atomically. The interval stretches to 100x the last write time,
+// so checkpointing never costs more than 1% of the walk. Ctrl-C stops the
+// walk at the next boundary after a final checkpoint, and "--resume"
+// continues from the saved frontier without listing completed subtrees
+// again. The file is removed once the walk completes. Only physical walks
+// are checkpointed: a logical walk would also have to save its visited set.
+class WalkCheckpointer {
+ public:
+  using Values = std::function<std::vector<std::string>()>;
+
+  // key identifies the walk (command, absolute root, arguments).
+  explicit WalkCheckpointer(std::string key) : key_(std::move(key)) {
+    dir_ = StateDir();
+    std::uint64_t hash = 14695981039346656037ull;  // FNV-1a
+    for (const char ch : key_) {
+      hash = (hash ^ static_cast<unsigned char>(ch)) * 1099511628211ull;
+    }
+    std::ostringstream name;
+    name << key_.substr(0, key_.find('\n')) << "-" << std::hex << std::setw(16)
+         << std::setfill('0') << hash << ".ckpt";
+    path_ = JoinPath(dir_, name.str());
+    next_due_ = std::chrono::steady_clock::now() + kCheckpointInterval;
+    g_walk_interrupted = 0;
+    previous_handler_ = std::signal(SIGINT, OnInterrupt);
+  }
+
+  ~WalkCheckpointer() { std::signal(SIGINT, previous_handler_); }
+
+  WalkCheckpointer(const WalkCheckpointer&) = delete;
+  WalkCheckpointer& operator=(const WalkCheckpointer&) = delete;
+
+  // Reads the saved frontier and aggregates; false if there is no usable
+  // checkpoint for this walk.
+  bool Load(WalkFrontier* frontier, std::vector<std::string>* values) const {
+    std::ifstream in(path_, std::ios::binary);
+    std::string header;
+    std::string key;
+    size_t count = 0;
+    if (!std::getline(in, header) || header != kHeader || !ReadField(in, &key) ||
+        key != key_ || !(in >> count) || in.get() != '\n') {
+      return false;
+    }
+    WalkFrontier loaded;
+    for (size_t i = 0; i < count; ++i) {
+      int depth = 0;
+      std::string path;
+      if (!(in >> depth) || in.get() != ' ' || !ReadField(in, &path)) {
+        return false;
+      }
+      loaded.emplace_back(std::move(path), depth);
+    }
+    std::vector<std::string> loaded_values;
+    if (!(in >> count) || in.get() != '\n') {
+      return false;
+    }
+    for (size_t i = 0; i < count; ++i) {
+      std::string value;
+      if (!ReadField(in, &value)) {
+        return false;
+      }
+      loaded_values.push_back(std::move(value));
+    }
+    if (loaded.empty()) {
+      return false;
+    }
+    *frontier = std::move(loaded);
+    *values = std::move(loaded_values);
+    return true;
+  }
+
+  // The WalkOptions::checkpoint hook; values snapshots the aggregates and is
+  // only called while the walk is paused.
+  std::function<bool(const std::function<WalkFrontier()>&)> Hook(Values values) {
+    return [this, values = std::move(values)](const std::function<WalkFrontier()>& frontier) {
+      const auto now = std::chrono::steady_clock::now();
+      if (g_walk_interrupted != 0) {
+        saved_ = Save(frontier(), values());
+        return false;
+      }
+      if (now >= next_due_) {
+        Save(frontier(), values());
+        const auto cost = std::chrono::steady_clock::now() - now;  // includes the pause
+        next_due_ = std::chrono::steady_clock::now() +
+                    std::max<std::chrono::steady_clock::duration>(kCheckpointInterval, cost * 100);
+      }
+      return true;
+    };
+  }
+
+  // Reports a walk stopped by Ctrl-C.
+  void ReportInterrupted(const std::string& resume_command) const {
+    if (saved_) {
+      std::cout << "Interrupted: progress saved to " << path_ << "; continue with '"
+                << resume_command << "'\n";
+    } else {
+      std::cout << "Interrupted: failed to save progress to " << path_ << "\n";
+    }
+  }
+
+  // The walk completed; its checkpoint is no longer needed.
+  void Finish() const { ::unlink(path_.c_str()); }
+
+ private:
+  static constexpr const char* kHeader = "MiniFileExplorer walk checkpoint 1";
+  static constexpr std::chrono::seconds kCheckpointInterval{5};
+  static volatile std::sig_atomic_t g_walk_interrupted;
+
+  static void OnInterrupt(int) {
+    g_walk_interrupted = 1;
+    std::signal(SIGINT, SIG_DFL);  // a second Ctrl-C ends the program
+  }
+
+  static void WriteField(std::string* out, const std::string& field) {
+    *out += std::to_string(field.size());
+    *out += ':';
+    *out += field;
+    *out += '\n';
+  }
+
+  static bool ReadField(std::istream& in, std::string* field) {
+    size_t size = 0;
+    if (!(in >> size) || in.get() != ':') {
+      return false;
+    }
+    field->resize(size);
+    return static_cast<bool>(in.read(&(*field)[0], static_cast<std::streamsize>(size))) &&
+           in.get() == '\n';
+  }
+
+  bool Save(const WalkFrontier& pending, const std::vector<std::string>& values) {
+    std::string out = std::string(kHeader) + "\n";
+    WriteField(&out, key_);
+    out += std::to_string(pending.size()) + "\n";
+    for (const auto& item : pending) {
+      out += std::to_string(item.second) + " ";
+      WriteField(&out, item.first);
+    }
+    out += std::to_string(values.size()) + "\n";
+    for (const auto& value : values) {
+      WriteField(&out, value);
+    }
+
+    if (!MakeStateDir(dir_)) {
+      return false;
+    }
+    const std::string temp = path_ + ".tmp";
+    const int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+      return false;
+    }
+    const bool ok = WriteAll(fd, out.data(), out.size()) && ::fsync(fd) == 0;
+    ::close(fd);
+    if (!ok || ::rename(temp.c_str(), path_.c_str()) != 0) {
+      ::unlink(temp.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  std::string key_;
+  std::string dir_;
+  std::string path_;
+  std::chrono::steady_clock::time_point next_due_;
+  bool saved_ = false;
+  void (*previous_handler_)(int) = SIG_DFL;
+};
+
+volatile std::sig_atomic_t WalkCheckpointer::g_walk_interrupted = 0;
+
+// Sets up checkpointing for a du or search walk over root; a null result
+// means the walk is not checkpointed. With resume, options->resume and
+// *values are filled from the saved state. Returns false (after printing
+// why) if resuming is impossible.
+static bool PrepareWalkCheckpoint(const std::string& key, bool resume,
+                                  const std::string& what, WalkOptions* options,
+                                  std::unique_ptr<WalkCheckpointer>* checkpoint,
+                                  std::vector<std::string>* values) {
+  if (options->links != LinkPolicy::kPhysical || !g_vfs->Posix()) {
+    if (resume) {
+      std::cout << "Invalid option: --resume needs a physical walk on the posix VFS\n";
+      return false;
+    }
+    return true;
+  }
+  *checkpoint = std::make_unique<WalkCheckpointer>(key);
+  if (resume && !(*checkpoint)->Load(&options->resume, values)) {
+    std::cout << "No checkpoint to resume for " << what << "; starting from the beginning\n";
+  }
+  return true;
+}
+
+// "--stats" for du and search: how the walk was spread over devices.
+static void PrintWalkStats(const WalkStats& stats) {
+  std::cout << "Walk: " << stats.workers << " workers, " << std::fixed << std::setprecision(2)
+            << stats.seconds << " s\n";
+  for (const auto& d : stats.devices) {
+    const std::string name =
+        d.info.mount_point.empty() ? "device " + std::to_string(d.info.dev) : d.info.mount_point;
+    std::cout << "  " << name << " (" << d.info.fs_type << ", " << DeviceKindName(d.info.kind)
+              << ", cap " << d.info.limit << "): " << d.dirs << " directories, " << d.entries
+              << " entries, " << d.busy_seconds << " s listing, peak " << d.peak
+              << " concurrent\n";
+    const double rate = stats.seconds > 0 ? static_cast<double>(d.entries) / stats.seconds : 0;
+    std::cout << "    concurrency " << d.concurrency << " (adapted between "
+              << d.concurrency_low << " and " << d.concurrency_high << "), " << std::setprecision(0)
+              << rate << " entries/s\n" << std::setprecision(2);
+  }
+  std::cout.unsetf(std::ios::floatfield);
+  std::cout << std::setprecision(6);
+}
+
+static void HandleSearchCommand(const std::vector<std::string>& tokens) {
+  LinkPolicy links = LinkPolicy::kPhysical;
+  bool resume = false;
+  bool show_stats = false;
+  bool bfs = false;
+  size_t max_results = 0;  // 0: all
+  size_t max_depth = 0;    // 0: unlimited; 1: entries of the current directory
+  std::vector<std::string> args;
+  for (size_t i = 1; i < tokens.size(); ++i) {
+    if (tokens[i] == "--resume") {
+      resume = true;
+    } else if (tokens[i] == "--stats") {
+      show_stats = true;
+    } else if (tokens[i] == "--bfs") {
+      bfs = true;
+    } else if (tokens[i] == "--max-results" || tokens[i] == "--max-depth") {
+      size_t* value = tokens[i] == "--max-results" ? &max_results : &max_depth;
+      if (i + 1 >= tokens.size() || !ParseCountValue(tokens[i + 1], value)) {
+        std::cout << "Invalid option: " << tokens[i] << "\n";
+        return;
+      }
+      ++i;
+    } else if (!ParseLinkPolicyFlag(tokens[i], &links)) {
+      args.push_back(tokens[i]);
+    }
+  }
+  if (args.empty()) {
+    std::cout << "Missing keyword: Please enter 'search [keyword]'\n";
+    return;
+  }
+  // Bounded searches are meant to be quick and are not checkpointed.
+  const bool bounded = bfs || max_results != 0 || max_depth != 0;
+  if (bounded && resume) {
+    std::cout << "Invalid option: --resume cannot be combined with --max-results, --max-depth "
+                 "or --bfs\n";
+    return;
+  }
+
+  const std::string keyword = args[0];
+  const std::string keyword_lower = ToLowerAscii(keyword);
+
+  const std::string base = g_vfs->CurrentDir();
+  if (base.empty()) {
+    std::cout << "Failed to access current directory\n";
+    return;
+  }
+
+  struct SearchResult {
+    std::string path;
+    std::string type;
+    int depth = 0;  // 1 for entries of the current directory
+  };
+  std::vector<SearchResult> results;
+
+  WalkOptions options;
+  options.links = links;
+  options.breadth_first = bfs;
+  options.max_depth = static_cast<int>(max_depth) - 1;
+  std::unique_ptr<WalkCheckpointer> checkpoint;
+  std::vector<std::string> saved;
+  if (!bounded && !PrepareWalkCheckpoint("search\n" + base + "\n" + keyword, resume,
+                                         "search '" + keyword + "' in " + base, &options,
+                                         &checkpoint, &saved)) {
+    return;
+  }
+  for (size_t i = 0; i + 1 < saved.size(); i += 2) {
+    results.push_back(SearchResult{saved[i + 1], saved[i]});
+  }
+  const unsigned workers = WalkWorkerCount();
+  std::vector<std::vector<SearchResult>> found(workers);
+  if (checkpoint) {
+    options.checkpoint = checkpoint->Hook([&]() {
+      std::vector<std::string> values;
+      auto add = [&](const std::vector<SearchResult>& list) {
+        for (const auto& r : list) {
+          values.push_back(r.type);
+          values.push_back(r.path);
+        }
+      };
+      add(results);
+      for (const auto& list : found) {
+        add(list);
+      }
+      return values;
+    });
+  }
+  WalkStats walk_stats;
+  if (show_stats) {
+    options.stats = &walk_stats;
+  }
+  // With --max-results the walk stops once enough matches are in; breadth
+  // first, the level being listed then holds the deepest of them.
+  std::atomic<size_t> matches{0};
+  const bool complete = ParallelWalkTree(base, options, workers, [&](WalkDir& dir, unsigned worker) {
+    size_t matched = 0;
+    for (const auto& entry : dir.entries) {
+      if (ToLowerAscii(entry.name).find(keyword_lower) == std::string::npos) {
+        continue;
+      }
+      const bool is_dir = entry.IsDir();
+      const std::string type = ShowAsLink(entry, links) ? "Link" : (is_dir ? "Dir" : "File");
+      found[worker].push_back(SearchResult{entry.path + (is_dir ? "/" : ""), type, dir.depth + 1});
+      ++matched;
+    }
+    if (max_results != 0 && matched != 0 && matches.fetch_add(matched) + matched >= max_results) {
+      return WalkAction::kStop;
+    }
+    return WalkAction::kContinue;
+  });
+  if (checkpoint) {
+    if (!complete) {
+      checkpoint->ReportInterrupted("search --resume " + keyword);
+      return;
+    }
+    checkpoint->Finish();
+  }
+  for (auto& list : found) {
+    results.insert(results.end(), std::make_move_iterator(list.begin()),
+                   std::make_move_iterator(list.end()));
+  }
+  // Workers finish directories in no particular order.
+  std::sort(results.begin(), results.end(), [bfs](const SearchResult& a, const SearchResult& b) {
+    if (bfs && a.depth != b.depth) {
+      return a.depth < b.depth;
+    }
+    return a.path < b.path;
+  });
+  const bool stopped_early = !complete && max_results != 0;
+  if (max_results != 0 && results.size() > max_results) {
+    results.resize(max_results);
+  }
+
+  if (results.empty()) {
+    std::cout << "No results found for '" << keyword << "'\n";
+  } else {
+    const TraceSpan span("output", "print_results", results.size());
+    std::cout << "Search results for '" << keyword << "' (" << results.size()
+              << " items):\n";
+    for (const auto& r : results) {
+      std::cout << r.path << " (" << r.type << ")\n";
+    }
+    if (stopped_early) {
+      std::cout << "Stopped after " << results.size() << " results\n";
+    }
+  }
+  if (show_stats) {
+    PrintWalkStats(walk_stats);
+  }
+}
+
+// Read-only view of a file's bytes: large files are mmap'ed with a
+// sequential-access hint, small ones are read into a buffer in one call.
+class FileView {
+ public:
+  static constexpr size_t kMmapThreshold = 64 * 1024;
+
+  FileView() = default;
+  FileView(const FileView&) = delete;
+  FileView& operator=(const FileView&) = delete;
+  ~FileView() { Reset(); }
+
+  bool Open(const std::string& path) {
+    Reset();
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    bool ok = ::fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    const size_t size = ok ? static_cast<size_t>(st.st_size) : 0;
+    if (ok && size >= kMmapThreshold) {
+      void* addr = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (addr != MAP_FAILED) {
+        ::madvise(addr, size, MADV_SEQUENTIAL);
+        mapped_ = static_cast<const char*>(addr);
+        data_ = mapped_;
+        size_ = size;
+      } else {
+        ok = false;
+      }
+    } else if (ok) {
+      buffer_.resize(size);
+      size_t done = 0;
+      while (done < size) {
+        const ssize_t n = ::read(fd, &buffer_[done], size - done);
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        if (n <= 0) {
+          break;
+        }
+        done += static_cast<size_t>(n);
+      }
+      buffer_.resize(done);
+      data_ = buffer_.data();
+      size_ = done;
+    }
+    ::close(fd);
+    return ok;
+  }
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  void Reset() {
+    if (mapped_ != nullptr) {
+      ::munmap(const_cast<char*>(mapped_), size_);
+    }
+    mapped_ = nullptr;
+    data_ = nullptr;
+    size_ = 0;
+    buffer_.clear();
+  }
+
+  const char* mapped_ = nullptr;
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+  std::string buffer_;
+};
+
+// A NUL byte in the first block marks the file as binary (as grep does).
+static bool LooksBinary(const char* data, size_t size) {
+  return std::memchr(data, '\0', std::min<size_t>(size, 8192)) != nullptr;
+}
+
+// Literal substring scanner. With SSE2 it tests 16 candidate positions at a
+// time by comparing the first and last needle bytes, then verifies the
+// surviving candidates; otherwise it falls back to memchr on the first byte.
+class LiteralScanner {
+ public:
+  LiteralScanner(const std::string& needle, bool ignore_case)
+      : needle_(ignore_case ? ToLowerAscii(needle) : needle), ignore_case_(ignore_case) {}
+
+  // Offset of the first match at or after from, or npos.
+  size_t Find(const char* data, size_t size, size_t from) const {
+    const size_t n = needle_.size();
+    if (n == 0 || size < n || from > size - n) {
+      return n == 0 ? from : std::string::npos;
+    }
+    size_t i = from;
+#if defined(__SSE2__)
+    const unsigned char first = static_cast<unsigned char>(needle_[0]);
+    const unsigned char last = static_cast<unsigned char>(needle_[n - 1]);
+    const __m128i first_lo = _mm_set1_epi8(static_cast<char>(first));
+    const __m128i last_lo = _mm_set1_epi8(static_cast<char>(last));
+    const __m128i first_up = _mm_set1_epi8(static_cast<char>(ignore_case_ ? std::toupper(first) : first));
+    const __m128i last_up = _mm_set1_epi8(static_cast<char>(ignore_case_ ? std::toupper(last) : last));
+    for (; i + n - 1 + 16 <= size; i += 16) {
+      const __m128i head = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+      const __m128i tail = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + n - 1));
+      const __m128i eq_first = _mm_or_si128(_mm_cmpeq_epi8(head, first_lo), _mm_cmpeq_epi8(head, first_up));
+      const __m128i eq_last = _mm_or_si128(_mm_cmpeq_epi8(tail, last_lo), _mm_cmpeq_epi8(tail, last_up));
+      unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_and_si128(eq_first, eq_last)));
+      while (mask != 0) {
+        const size_t pos = i + static_cast<size_t>(__builtin_ctz(mask));
+        if (Matches(data + pos)) {
+          return pos;
+        }
+        mask &= mask - 1;
+      }
+    }
+#endif
+    for (; i + n <= size; ++i) {
+      if (!ignore_case_) {
+        const void* hit = std::memchr(data + i, needle_[0], size - n + 1 - i);
+        if (hit == nullptr) {
+          return std::string::npos;
+        }
+        i = static_cast<size_t>(static_cast<const char*>(hit) - data);
+      }
+      if (Matches(data + i)) {
+        return i;
+      }
+    }
+    return std::string::npos;
+  }
+
+ private:
+  bool Matches(const char* p) const {
+    if (!ignore_case_) {
+      return std::memcmp(p, needle_.data(), needle_.size()) == 0;
+    }
+    for (size_t k = 0; k < needle_.size(); ++k) {
+      if (std::tolower(static_cast<unsigned char>(p[k])) !=
+          static_cast<unsigned char>(needle_[k])) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  std::string needle_;
+  bool ignore_case_;
+};
+
+struct GrepFileResult {
+  std::string output;
+  size_t matched_lines = 0;
+};
+
+static void GrepFile(const std::string& path, const LiteralScanner& scanner,
+                     bool names_only, GrepFileResult* result) {
+  FileView view;
+  if (!view.Open(path) || LooksBinary(view.data(), view.size())) {
+    return;
+  }
+  const char* data = view.data();
+  const size_t size = view.size();
+  size_t line_no = 1;
+  size_t counted_to = 0;
+  size_t pos = 0;
+  while ((pos = scanner.Find(data, size, pos)) != std::string::npos) {
+    const char* line_begin = static_cast<const char*>(::memrchr(data, '\n', pos));
+    const size_t begin = line_begin == nullptr ? 0 : static_cast<size_t>(line_begin - data) + 1;
+    const char* line_end = static_cast<const char*>(std::memchr(data + pos, '\n', size - pos));
+    const size_t end = line_end == nullptr ? size : static_cast<size_t>(line_end - data);
+    ++result->matched_lines;
+    if (names_only) {
+      result->output = path + "\n";
+      return;
+    }
+    line_no += static_cast<size_t>(std::count(data + counted_to, data + begin, '\n'));
+    counted_to = begin;
+    result->output += path;
+    result->output += ':';
+    result->output += std::to_string(line_no);
+    result->output += ": ";
+    result->output.append(data + begin, end - begin);
+    result->output += '\n';
+    pos = end;
+  }
+}
+
+static void HandleGrepCommand(const std::vector<std::string>& tokens) {
+  LinkPolicy links = LinkPolicy::kPhysical;
+  bool ignore_case = false;
+  bool names_only = false;
+  std::vector<std::string> args;
+  for (size_t i = 1; i < tokens.size(); ++i) {
+    if (tokens[i] == "-i") {
+      ignore_case = true;
+    } else if (tokens[i] == "-l") {
+      names_only = true;
+    } else if (!ParseLinkPolicyFlag(tokens[i], &links)) {
+      args.push_back(tokens[i]);
+    }
+  }
+  if (args.empty() || args[0].empty()) {
+    std::cout << "Missing pattern: Please enter 'grep [pattern] [dir]'\n";
+    return;
+  }
+  const std::string& pattern = args[0];
+  const std::string root = args.size() >= 2 ? args[1] : ".";
+
+  struct stat root_st;
+  if (::stat(root.c_str(), &root_st) != 0 || !S_ISDIR(root_st.st_mode)) {
+    std::cout << "Invalid directory: " << root << "\n";
+    return;
+  }
+
+  std::vector<std::string> files;
+  DevInoSet seen_files;
+  WalkOptions options;
+  options.links = links;
+  WalkTree(root, options, [&](WalkDir& dir) {
+    for (auto& entry : dir.entries) {
+      if (entry.IsFile() && seen_files.Insert(entry.st.st_dev, entry.st.st_ino)) {
+        files.push_back(entry.path);
+      }
+    }
+    return WalkAction::kContinue;
+  });
+
+  // Workers claim files in walk order; the calling thread prints each file's
+  // result as soon as it and all earlier files are done.
+  const LiteralScanner scanner(pattern, ignore_case);
+  std::vector<GrepFileResult> results(files.size());
+  std::vector<char> done(files.size(), 0);
+  std::atomic<size_t> next{0};
+  std::mutex mu;
+  std::condition_variable cv;
+
+  const size_t worker_count = std::min<size_t>(DefaultWorkerCount(), files.size());
+  std::vector<std::thread> workers;
+  for (size_t w = 0; w < worker_count; ++w) {
+    workers.emplace_back([&]() {
+      for (size_t i = next.fetch_add(1); i < files.size(); i = next.fetch_add(1)) {
+        GrepFile(files[i], scanner, names_only, &results[i]);
+        std::lock_guard<std::mutex> lock(mu);
+        done[i] = 1;
+        cv.notify_one();
+      }
+    });
+  }
+
+  size_t matched_files = 0;
+  size_t matched_lines = 0;
+  for (size_t i = 0; i < files.size(); ++i) {
+    {
+      std::unique_lock<std::mutex> lock(mu);
+      cv.wait(lock, [&]() { return done[i] != 0; });
+    }
+    if (results[i].matched_lines > 0) {
+      ++matched_files;
+      matched_lines += results[i].matched_lines;
+      const TraceSpan span("output", "print_matches", results[i].output.size());
+      std::cout << results[i].output;
+    }
+    std::string().swap(results[i].output);
+  }
+  for (auto& t : workers) {
+    t.join();
+  }
+
+  if (matched_files == 0) {
+    std::cout << "No matches found for '" << pattern << "'\n";
+    return;
+  }
+  std::cout << "Found '" << pattern << "' in " << matched_files << " files";
+  if (!names_only) {
+    std::cout << " (" << matched_lines << " lines)";
+  }
+  std::cout << "\n";
+}
+
+// Writes length bytes of fd starting at offset to stdout without copying
+// through user space where possible: splice when stdout is a pipe, sendfile
+// otherwise, and a plain read/write loop if neither is supported.
+static bool CopyFdToStdout(int fd, off_t offset, std::uint64_t length) {
+  const TraceSpan span("output", "write_stdout", length);
+  std::cout << std::flush;
+  std::fflush(stdout);
+
+  struct stat out_st;
+  const bool out_is_pipe = ::fstat(STDOUT_FILENO, &out_st) == 0 && S_ISFIFO(out_st.st_mode);
+  std::uint64_t remaining = length;
+#if defined(__linux__)
+  while (remaining > 0) {
+    const size_t chunk = static_cast<size_t>(std::min<std::uint64_t>(remaining, 1u << 30));
+    ssize_t n;
+    if (out_is_pipe) {
+      loff_t in_off = offset;
+      n = ::splice(fd, &in_off, STDOUT_FILENO, nullptr, chunk, SPLICE_F_MORE);
+    } else {
+      n = ::sendfile(STDOUT_FILENO, fd, &offset, chunk);
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      if (n < 0 && (errno == EINVAL || errno == ENOSYS) && remaining == length) {
+        break;  // unsupported pairing: fall back to read/write below
+      }
+      return n == 0;
+    }
+    if (out_is_pipe) {
+      offset += n;
+    }
+    remaining -= static_cast<std::uint64_t>(n);
+  }
+#else
+  (void)out_is_pipe;
+#endif
+  std::vector<char> buf(128 * 1024);
+  while (remaining > 0) {
+    const size_t want = static_cast<size_t>(std::min<std::uint64_t>(remaining, buf.size()));
+    const ssize_t n = ::pread(fd, buf.data(), want, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return n == 0;
+    }
+    for (ssize_t written = 0; written < n;) {
+      const ssize_t w = ::write(STDOUT_FILENO, buf.data() + written, static_cast<size_t>(n - written));
+      if (w < 0 && errno == EINTR) {
+        continue;
+      }
+      if (w <= 0) {
+        return false;
+      }
+      written += w;
+    }
+    offset += n;
+    remaining -= static_cast<std::uint64_t>(n);
+  }
+  return true;
+}
+
+static constexpr size_t kPreviewBlock = 64 * 1024;
+
+// End offset of the first `lines` lines, scanning forward block by block.
+static off_t FindHeadEnd(int fd, off_t size, std::uint64_t lines) {
+  std::vector<char> buf(kPreviewBlock);
+  off_t offset = 0;
+  while (lines > 0 && offset < size) {
+    const ssize_t n = ::pread(fd, buf.data(), buf.size(), offset);
+    if (n <= 0) {
+      break;
+    }
+    const char* p = buf.data();
+    const char* end = buf.data() + n;
+    while (lines > 0 && p < end) {
+      const char* nl = static_cast<const char*>(std::memchr(p, '\n', static_cast<size_t>(end - p)));
+      if (nl == nullptr) {
+        p = end;
+        break;
+      }
+      --lines;
+      p = nl + 1;
+    }
+    offset += static_cast<off_t>(p - buf.data());
+  }
+  return std::min(offset, size);
+}
+
+// Start offset of the last `lines` lines, reading backwards in large blocks
+// and counting newlines with memrchr, so the cost is independent of the file
+// size. A newline that terminates the file does not start an empty line.
+// Returns -1 if a block cannot be read in full (an error, or the file
+// shrank), rather than guessing an offset.
+static off_t FindTailStart(int fd, off_t size, std::uint64_t lines) {
+  if (lines == 0) {
+    return size;
+  }
+  std::vector<char> buf(kPreviewBlock);
+  off_t end = size;
+  bool skip_final_newline = true;
+  while (end > 0) {
+    const off_t begin = end > static_cast<off_t>(buf.size()) ? end - static_cast<off_t>(buf.size()) : 0;
+    const size_t len = static_cast<size_t>(end - begin);
+    for (size_t got = 0; got < len;) {
+      const ssize_t n = ::pread(fd, buf.data() + got, len - got, begin + static_cast<off_t>(got));
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return -1;
+      }
+      got += static_cast<size_t>(n);
+    }
+    size_t scan = len;
+    if (skip_final_newline) {
+      skip_final_newline = false;
+      if (buf[len - 1] == '\n') {
+        --scan;
+      }
+    }
+    while (scan > 0) {
+      const char* nl = static_cast<const char*>(::memrchr(buf.data(), '\n', scan));
+      if (nl == nullptr) {
+        break;
+      }
+      scan = static_cast<size_t>(nl - buf.data());
+      if (--lines == 0) {
+        return begin + static_cast<off_t>(scan) + 1;
+      }
+    }
+    end = begin;
+  }
+  return 0;
+}
+
+// Parses "-n N" / "-nN" (default 10) and, when follow is given, "-f";
+// collects the remaining operands.
+static bool ParseLineCountArgs(const std::vector<std::string>& tokens,
+                               std::uint64_t* lines, bool* follow,
+                               std::vector<std::string>* operands) {
+  *lines = 10;
+  for (size_t i = 1; i < tokens.size(); ++i) {
+    std::string value;
+    if (follow != nullptr && tokens[i] == "-f") {
+      *follow = true;
+      continue;
+    }
+    if (tokens[i] == "-n") {
+      if (i + 1 >= tokens.size()) {
+        return false;
+      }
+      value = tokens[++i];
+    } else if (tokens[i].rfind("-n", 0) == 0) {
+      value = tokens[i].substr(2);
+    } else if (tokens[i].size() > 1 && tokens[i][0] == '-') {
+      return false;
+    } else {
+      operands->push_back(tokens[i]);
+      continue;
+    }
+    if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos) {
+      return false;
+    }
+    errno = 0;
+    *lines = std::strtoull(value.c_str(), nullptr, 10);
+    if (errno == ERANGE) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#if defined(__linux__)
+// Streams bytes appended to path until Ctrl-C. Blocks in poll() on an
+// inotify fd (file: modify/move/delete, parent dir: create/move-in) and a
+// signalfd for SIGINT, so an idle follow uses no CPU. Truncation restarts
+// from offset 0; rotation (the file moved or deleted and recreated) reopens
+// the path and follows the new file from its start.
+static void FollowFile(const std::string& path, int fd, off_t offset) {
+  const int in_fd = ::inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+  if (in_fd < 0) {
+    std::cout << "Failed to watch file: " << path << "\n";
+    return;
+  }
+  const std::string parent = SplitParentLeaf(path).first;
+  const std::string leaf = SplitParentLeaf(path).second;
+  const uint32_t file_events = IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF | IN_ATTRIB;
+  int file_wd = ::inotify_add_watch(in_fd, path.c_str(), file_events);
+  const int dir_wd = ::inotify_add_watch(in_fd, parent.empty() ? "." : parent.c_str(),
+                                         IN_CREATE | IN_MOVED_TO);
+
+  sigset_t mask;
+  sigset_t old_mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  ::pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+  const int sig_fd = ::signalfd(-1, &mask, SFD_CLOEXEC);
+
+  auto drain = [&]() {
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+      return;
+    }
+    if (st.st_size < offset) {
+      std::cout << "tail: " << path << ": file truncated\n";
+      offset = 0;
+    }
+    if (st.st_size > offset) {
+      CopyFdToStdout(fd, offset, static_cast<std::uint64_t>(st.st_size - offset));
+      offset = st.st_size;
+    }
+  };
+  // Switches to a new file at path if one exists and differs from the
+  // one currently open.
+  auto try_reopen = [&]() {
+    const int new_fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (new_fd < 0) {
+      return false;
+    }
+    struct stat old_st;
+    struct stat new_st;
+    if (::fstat(fd, &old_st) == 0 && ::fstat(new_fd, &new_st) == 0 &&
+        old_st.st_dev == new_st.st_dev && old_st.st_ino == new_st.st_ino) {
+      ::close(new_fd);
+      return false;
+    }
+    drain();
+    ::close(fd);
+    fd = new_fd;
+    offset = 0;
+    if (file_wd >= 0) {
+      ::inotify_rm_watch(in_fd, file_wd);
+    }
+    file_wd = ::inotify_add_watch(in_fd, path.c_str(), file_events);
+    std::cout << "tail: " << path << " has been replaced; following new file\n";
+    drain();
+    return true;
+  };
+
+  std::cout << std::flush;
+  bool rotated = false;
+  alignas(struct inotify_event) char events[4096];
+  while (true) {
+    pollfd fds[2] = {{in_fd, POLLIN, 0}, {sig_fd, POLLIN, 0}};
+    if (::poll(fds, sig_fd >= 0 ? 2 : 1, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    if (sig_fd >= 0 && (fds[1].revents & POLLIN) != 0) {
+      signalfd_siginfo info;
+      (void)::read(sig_fd, &info, sizeof(info));
+      break;
+    }
+    bool modified = false;
+    bool check_rotation = false;
+    ssize_t n;
+    while ((n = ::read(in_fd, events, sizeof(events))) > 0) {
+      for (ssize_t i = 0; i < n;) {
+        const auto* ev = reinterpret_cast<const inotify_event*>(events + i);
+        if (ev->wd == file_wd) {
+          modified = modified || (ev->mask & IN_MODIFY) != 0;
+          if ((ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) != 0) {
+            rotated = true;
+          }
+          check_rotation = check_rotation || (ev->mask & IN_ATTRIB) != 0;
+        } else if (ev->wd == dir_wd && ev->len > 0 && leaf == ev->name) {
+          check_rotation = true;
+        }
+        i += static_cast<ssize_t>(sizeof(inotify_event) + ev->len);
+      }
+    }
+    if (modified) {
+      drain();
+    }
+    if (rotated || check_rotation) {
+      if (try_reopen()) {
+        rotated = false;
+      } else if (rotated) {
+        drain();
+      }
+    }
+  }
+
+  std::cout << "\n";
+  ::close(fd);
+  if (sig_fd >= 0) {
+    ::close(sig_fd);
+  }
+  ::close(in_fd);
+  ::pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+}
+#endif
+
+static void HandlePreviewCommand(const std::vector<std::string>& tokens) {
+  const std::string& cmd = tokens[0];
+  std::uint64_t lines = 0;
+  bool follow = false;
+  std::vector<std::string> names;
+  if (cmd == "cat") {
+    names.assign(tokens.begin() + 1, tokens.end());
+  } else if (!ParseLineCountArgs(tokens, &lines, cmd == "tail" ? &follow : nullptr,
+                                 &names)) {
+    std::cout << "Invalid option: " << cmd << "\n";
+    return;
+  }
+  if (follow && names.size() != 1) {
+    std::cout << "Invalid option: tail -f follows exactly one file\n";
+    return;
+  }
+  if (names.empty()) {
+    std::cout << "Missing filename: Please enter '" << cmd << " [name]'\n";
+    return;
+  }
+
+  for (const auto& name : ExpandTargets(names)) {
+    const int fd = ::open(name.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || ::fstat(fd, &st) != 0) {
+      std::cout << "File not found: " << name << "\n";
+      if (fd >= 0) {
+        ::close(fd);
+      }
+      continue;
+    }
+    if (!S_ISREG(st.st_mode)) {
+      std::cout << "Not a file: " << name << "\n";
+      ::close(fd);
+      continue;
+    }
+    off_t begin = 0;
+    off_t end = st.st_size;
+    if (cmd == "head") {
+      end = FindHeadEnd(fd, st.st_size, lines);
+    } else if (cmd == "tail") {
+      begin = FindTailStart(fd, st.st_size, lines);
+      if (begin < 0) {
+        std::cout << "Failed to read file: " << name << "\n";
+        ::close(fd);
+        continue;
+      }
+    } else {
+      ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    if (!CopyFdToStdout(fd, begin, static_cast<std::uint64_t>(end - begin))) {
+      std::cout << "Failed to read file: " << name << "\n";
+    }
+    if (follow) {
+#if defined(__linux__)
+      FollowFile(name, fd, end);
+#else
+      std::cout << "tail -f is not supported on this platform\n";
+      ::close(fd);
+#endif
+      continue;
+    }
+    ::close(fd);
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Archives: ustar streams, optionally wrapped in LZ4 frames (.tar.lz4) whose
+// independent blocks are compressed on a worker pool.
+
+static inline std::uint32_t Load32(const unsigned char* p) {
+  std::uint32_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline std::uint32_t Rotl32(std::uint32_t v, int r) {
+  return (v << r) | (v >> (32 - r));
+}
+
+static std::uint32_t Xxh32(const unsigned char* p, size_t len, std::uint32_t seed) {
+  constexpr std::uint32_t kP1 = 2654435761U;
+  constexpr std::uint32_t kP2 = 2246822519U;
+  constexpr std::uint32_t kP3 = 3266489917U;
+  constexpr std::uint32_t kP4 = 668265263U;
+  constexpr std::uint32_t kP5 = 374761393U;
+  const unsigned char* end = p + len;
+  std::uint32_t h;
+  if (len >= 16) {
+    std::uint32_t v[4] = {seed + kP1 + kP2, seed + kP2, seed, seed - kP1};
+    for (; p + 16 <= end; p += 16) {
+      for (int i = 0; i < 4; ++i) {
+        v[i] = Rotl32(v[i] + Load32(p + 4 * i) * kP2, 13) * kP1;
+      }
+    }
+    h = Rotl32(v[0], 1) + Rotl32(v[1], 7) + Rotl32(v[2], 12) + Rotl32(v[3], 18);
+  } else {
+    h = seed + kP5;
+  }
+  h += static_cast<std::uint32_t>(len);
+  for (; p + 4 <= end; p += 4) {
+    h = Rotl32(h + Load32(p) * kP3, 17) * kP4;
+  }
+  for (; p < end; ++p) {
+    h = Rotl32(h + *p * kP5, 11) * kP1;
+  }
+  h ^= h >> 15;
+  h *= kP2;
+  h ^= h >> 13;
+  h *= kP3;
+  h ^= h >> 16;
+  return h;
+}
+
+static constexpr size_t kLz4BlockSize = 1 << 20;  // frame BD code 6
+static constexpr std::uint32_t kLz4Magic = 0x184D2204;
+
+static size_t Lz4CompressBound(size_t n) { return n + n / 255 + 16; }
+
+// Greedy LZ4 block compressor with a single-probe hash table. Follows the
+// block format end rules: the last 5 bytes are literals and no match starts
+// within the last 12 bytes.
+static size_t Lz4CompressBlock(const unsigned char* src, size_t n, unsigned char* dst,
+                               std::vector<std::uint32_t>* table) {
+  constexpr size_t kMinMatch = 4;
+  constexpr size_t kLastLiterals = 5;
+  constexpr size_t kMfLimit = 12;
+  unsigned char* op = dst;
+  size_t anchor = 0;
+
+  auto emit = [&](size_t literal_end, size_t offset, size_t match_len) {
+    size_t literals = literal_end - anchor;
+    unsigned char* token = op++;
+    *token = static_cast<unsigned char>((literals >= 15 ? 15 : literals) << 4);
+    if (literals >= 15) {
+      size_t rest = literals - 15;
+      for (; rest >= 255; rest -= 255) {
+        *op++ = 255;
+      }
+      *op++ = static_cast<unsigned char>(rest);
+    }
+    std::memcpy(op, src + anchor, literals);
+    op += literals;
+    if (match_len == 0) {
+      return;
+    }
+    *op++ = static_cast<unsigned char>(offset & 0xFF);
+    *op++ = static_cast<unsigned char>(offset >> 8);
+    size_t rest = match_len - kMinMatch;
+    *token |= static_cast<unsigned char>(rest >= 15 ? 15 : rest);
+    if (rest >= 15) {
+      for (rest -= 15; rest >= 255; rest -= 255) {
+        *op++ = 255;
+      }
+      *op++ = static_cast<unsigned char>(rest);
+    }
+  };
+  auto hash = [](std::uint32_t seq) { return (seq * 2654435761U) >> 16; };
+
+  if (n > kMfLimit) {
+    table->assign(size_t{1} << 16, 0);  // position + 1; 0 means empty
+    const size_t match_limit = n - kLastLiterals;
+    size_t ip = 0;
+    size_t attempts = 1 << 6;
+    while (ip + kMfLimit <= n) {
+      const std::uint32_t seq = Load32(src + ip);
+      std::uint32_t& slot = (*table)[hash(seq)];
+      size_t ref = slot;
+      slot = static_cast<std::uint32_t>(ip + 1);
+      if (ref == 0 || ip - (ref - 1) > 65535 || Load32(src + ref - 1) != seq) {
+        ip += attempts++ >> 6;  // skip faster through incompressible data
+        continue;
+      }
+      --ref;
+      while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+        --ip;
+        --ref;
+      }
+      size_t len = 0;
+      while (ip + len < match_limit && src[ip + len] == src[ref + len]) {
+        ++len;
+      }
+      emit(ip, ip - ref, len);
+      ip += len;
+      anchor = ip;
+      attempts = 1 << 6;
+      if (ip + kMfLimit <= n) {
+        (*table)[hash(Load32(src + ip - 2))] = static_cast<std::uint32_t>(ip - 2 + 1);
+      }
+    }
+  }
+  emit(n, 0, 0);
+  return static_cast<size_t>(op - dst);
+}
+
+// Appends the decoded block to out. Matches may reach back into bytes that
+// are already in out, which is how linked-block frames pass their window.
+static bool Lz4DecompressBlock(const unsigned char* src, size_t n, std::string* out,
+                               size_t max_out) {
+  size_t ip = 0;
+  const size_t limit = out->size() + max_out;
+  auto read_length = [&](size_t* len) {
+    unsigned char b;
+    do {
+      if (ip >= n) {
+        return false;
+      }
+      b = src[ip++];
+      *len += b;
+    } while (b == 255);
+    return true;
+  };
+  while (ip < n) {
+    const unsigned token = src[ip++];
+    size_t literals = token >> 4;
+    if (literals == 15 && !read_length(&literals)) {
+      return false;
+    }
+    if (literals > n - ip || out->size() + literals > limit) {
+      return false;
+    }
+    out->append(reinterpret_cast<const char*>(src + ip), literals);
+    ip += literals;
+    if (ip == n) {
+      return true;
+    }
+    if (n - ip < 2) {
+      return false;
+    }
+    const size_t offset = src[ip] | (static_cast<size_t>(src[ip + 1]) << 8);
+    ip += 2;
+    size_t match_len = token & 15;
+    if (match_len == 15 && !read_length(&match_len)) {
+      return false;
+    }
+    match_len += 4;
+    const size_t pos = out->size();
+    if (offset == 0 || offset > pos || pos + match_len > limit) {
+      return false;
+    }
+    out->resize(pos + match_len);
+    char* d = &(*out)[0];
+    if (offset >= match_len) {
+      std::memcpy(d + pos, d + pos - offset, match_len);
+    } else {
+      for (size_t k = 0; k < match_len; ++k) {
+        d[pos + k] = d[pos - offset + k];
+      }
+    }
+  }
+  return true;
+}
+
+struct PipelineBlock {
+  std::string data;
+  bool stored = false;  // LZ4 block kept uncompressed
+};
+
+// Transforms blocks on a worker pool and hands the results to sink, on one
+// dedicated thread, in submission order. At most `window` blocks are queued
+// or in flight, which bounds memory regardless of the input size.
+class OrderedBlockPipeline {
+ public:
+  using Transform = std::function<bool(PipelineBlock*)>;
+  using Sink = std::function<bool(const PipelineBlock&)>;
+
+  OrderedBlockPipeline(size_t workers, Transform transform, Sink sink)
+      : window_(std::min<size_t>(2 * workers + 2, 64)),
+        transform_(std::move(transform)),
+        sink_(std::move(sink)) {
+    for (size_t i = 0; i < workers; ++i) {
+      workers_.emplace_back([this]() { WorkerLoop(); });
+    }
+    sink_thread_ = std::thread([this]() { SinkLoop(); });
+  }
+  OrderedBlockPipeline(const OrderedBlockPipeline&) = delete;
+  OrderedBlockPipeline& operator=(const OrderedBlockPipeline&) = delete;
+  ~OrderedBlockPipeline() { Finish(); }
+
+  // Waits while the window is full; returns false once any stage failed.
+  bool Submit(PipelineBlock block) {
+    std::unique_lock<std::mutex> lock(mu_);
+    cv_.wait(lock, [this]() { return failed_ || in_window_ < window_; });
+    if (failed_) {
+      return false;
+    }
+    ++in_window_;
+    pending_.emplace_back(next_seq_++, std::move(block));
+    cv_.notify_all();
+    return true;
+  }
+
+  bool Finish() {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      if (closed_) {
+        return !failed_;
+      }
+      closed_ = true;
+      cv_.notify_all();
+    }
+    for (auto& t : workers_) {
+      t.join();
+    }
+    sink_thread_.join();
+    return !failed_;
+  }
+
+ private:
+  void WorkerLoop() {
+    while (true) {
+      std::pair<size_t, PipelineBlock> job;
+      {
+        std::unique_lock<std::mutex> lock(mu_);
+        cv_.wait(lock, [this]() { return failed_ || closed_ || !pending_.empty(); });
+        if (pending_.empty() || failed_) {
+          return;
+        }
+        job = std::move(pending_.front());
+        pending_.pop_front();
+      }
+      const bool ok = transform_(&job.second);
+      std::lock_guard<std::mutex> lock(mu_);
+      failed_ = failed_ || !ok;
+      done_.emplace(job.first, std::move(job.second));
+      cv_.notify_all();
+    }
+  }
+
+  void SinkLoop() {
+    while (true) {
+      PipelineBlock block;
+      {
+        std::unique_lock<std::mutex> lock(mu_);
+        cv_.wait(lock, [this]() {
+          return failed_ || done_.count(next_out_) != 0 ||
+                 (closed_ && next_out_ == next_seq_);
+        });
+        if (failed_ || done_.count(next_out_) == 0) {
+          return;
+        }
+        auto it = done_.find(next_out_);
+        block = std::move(it->second);
+        done_.erase(it);
+      }
+      const bool ok = sink_(block);
+      std::lock_guard<std::mutex> lock(mu_);
+      ++next_out_;
+      --in_window_;
+      failed_ = failed_ || !ok;
+      cv_.notify_all();
+    }
+  }
+
+  const size_t window_;
+  Transform transform_;
+  Sink sink_;
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::deque<std::pair<size_t, PipelineBlock>> pending_;
+  std::map<size_t, PipelineBlock> done_;
+  size_t next_seq_ = 0;
+  size_t next_out_ = 0;
+  size_t in_window_ = 0;
+  bool closed_ = false;
+  bool failed_ = false;
+  std::vector<std::thread> workers_;
+  std::thread sink_thread_;
+};
+
+static bool WriteAll(int fd, const char* data, size_t n) {
+  while (n > 0) {
+    const ssize_t w = ::write(fd, data, n);
+    if (w < 0 && errno == EINTR) {
+      continue;
+    }
+    if (w <= 0) {
+      return false;
+    }
+    data += w;
+    n -= static_cast<size_t>(w);
+  }
+  return true;
+}
+
+// Copies length bytes from the current offset of in to out, in the kernel
+// with copy_file_range where possible and through a buffer otherwise.
+// copied is advanced as data is written.
+static bool CopyFdData(int in, int out, std::uint64_t length, std::uint64_t* copied) {
+  const TraceSpan span("copy", "copy_data", length);
+  // Under a throttle the data moves in small chunks, each charged up front.
+  const std::uint64_t max_chunk = g_io_throttle.active() ? kThrottledChunk : (1u << 30);
+#if defined(__linux__)
+  while (length > 0) {
+    const auto chunk = static_cast<size_t>(std::min<std::uint64_t>(length, max_chunk));
+    g_io_throttle.Charge(1, chunk);
+    const ssize_t n = ::copy_file_range(in, nullptr, out, nullptr, chunk, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    length -= static_cast<std::uint64_t>(n);
+    *copied += static_cast<std::uint64_t>(n);
+  }
+#endif
+  std::vector<char> buf(length > 0 ? static_cast<size_t>(std::min<std::uint64_t>(max_chunk, 1 << 20)) : 0);
+  while (length > 0) {
+    const auto chunk = static_cast<size_t>(std::min<std::uint64_t>(length, buf.size()));
+    g_io_throttle.Charge(1, chunk);
+    const ssize_t n = ::read(in, buf.data(), chunk);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    if (!WriteAll(out, buf.data(), static_cast<size_t>(n))) {
+      return false;
+    }
+    length -= static_cast<std::uint64_t>(n);
+    *copied += static_cast<std::uint64_t>(n);
+  }
+  return true;
+}
+
+// Byte sink for the tar stream.
+class ArchiveSink {
+ public:
+  virtual ~ArchiveSink() = default;
+  virtual bool Write(const char* data, size_t n) = 0;
+  // Appends length bytes read from fd at its current offset.
+  virtual bool WriteFromFd(int fd, std::uint64_t length) = 0;
+  virtual bool Finish() = 0;
+  std::uint64_t bytes_in() const { return bytes_in_; }
+  std::uint64_t bytes_out() const { return bytes_out_; }
+
+ protected:
+  std::uint64_t bytes_in_ = 0;
+  std::uint64_t bytes_out_ = 0;
+};
+
+// Uncompressed .tar: headers are buffered, file bodies are copied by the
+// kernel with copy_file_range where available.
+class PlainArchiveSink : public ArchiveSink {
+ public:
+  explicit PlainArchiveSink(int fd) : fd_(fd) { buffer_.reserve(kFlushSize); }
+
+  bool Write(const char* data, size_t n) override {
+    bytes_in_ += n;
+    buffer_.append(data, n);
+    return buffer_.size() < kFlushSize || Flush();
+  }
+
+  bool WriteFromFd(int fd, std::uint64_t length) override {
+    if (!Flush()) {
+      return false;
+    }
+    bytes_in_ += length;
+    return CopyFdData(fd, fd_, length, &bytes_out_);
+  }
+
+  bool Finish() override { return Flush(); }
+
+ private:
+  static constexpr size_t kFlushSize = 1 << 20;
+
+  bool Flush() {
+    const bool ok = WriteAll(fd_, buffer_.data(), buffer_.size());
+    bytes_out_ += buffer_.size();
+    buffer_.clear();
+    return ok;
+  }
+
+  int fd_;
+  std::string buffer_;
+};
+
+// .tar.lz4: the stream is cut into independent 1 MiB blocks that are
+// compressed in parallel and written as one LZ4 frame.
+class Lz4ArchiveSink : public ArchiveSink {
+ public:
+  explicit Lz4ArchiveSink(int fd)
+      : fd_(fd),
+        pipeline_(DefaultWorkerCount(), CompressBlock,
+                  [this](const PipelineBlock& block) {
+                    bytes_out_ += block.data.size();
+                    return WriteAll(fd_, block.data.data(), block.data.size());
+                  }) {
+    unsigned char header[7];
+    const std::uint32_t magic = kLz4Magic;
+    std::memcpy(header, &magic, 4);
+    header[4] = 0x60;  // version 01, independent blocks, no checksums
+    header[5] = 0x60;  // max block size 1 MiB
+    header[6] = static_cast<unsigned char>((Xxh32(header + 4, 2, 0) >> 8) & 0xFF);
+    ok_ = WriteAll(fd_, reinterpret_cast<const char*>(header), sizeof(header));
+    bytes_out_ += sizeof(header);
+    current_.data.reserve(kLz4BlockSize);
+  }
+
+  bool Write(const char* data, size_t n) override {
+    bytes_in_ += n;
+    while (n > 0 && ok_) {
+      const size_t take = std::min(n, kLz4BlockSize - current_.data.size());
+      current_.data.append(data, take);
+      data += take;
+      n -= take;
+      SubmitIfFull();
+    }
+    return ok_;
+  }
+
+  bool WriteFromFd(int fd, std::uint64_t length) override {
+    bytes_in_ += length;
+    while (length > 0 && ok_) {
+      const size_t used = current_.data.size();
+      const size_t take = static_cast<size_t>(std::min<std::uint64_t>(length, kLz4BlockSize - used));
+      current_.data.resize(used + take);
+      size_t got = 0;
+      while (got < take) {
+        const ssize_t n = ::read(fd, &current_.data[used + got], take - got);
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        if (n <= 0) {
+          return false;
+        }
+        got += static_cast<size_t>(n);
+      }
+      length -= take;
+      SubmitIfFull();
+    }
+    return ok_;
+  }
+
+  bool Finish() override {
+    if (ok_ && !current_.data.empty()) {
+      ok_ = pipeline_.Submit(std::move(current_));
+    }
+    ok_ = pipeline_.Finish() && ok_;
+    const std::uint32_t end_mark = 0;
+    ok_ = ok_ && WriteAll(fd_, reinterpret_cast<const char*>(&end_mark), 4);
+    bytes_out_ += 4;
+    return ok_;
+  }
+
+ private:
+  static bool CompressBlock(PipelineBlock* block) {
+    thread_local std::vector<std::uint32_t> table;
+    const std::string& raw = block->data;
+    std::string out(4 + Lz4CompressBound(raw.size()), '\0');
+    const size_t n = Lz4CompressBlock(reinterpret_cast<const unsigned char*>(raw.data()), raw.size(),
+                                      reinterpret_cast<unsigned char*>(&out[4]), &table);
+    std::uint32_t size_field;
+    if (n < raw.size()) {
+      size_field = static_cast<std::uint32_t>(n);
+      out.resize(4 + n);
+    } else {
+      size_field = static_cast<std::uint32_t>(raw.size()) | 0x80000000U;
+      out.replace(4, std::string::npos, raw);
+    }
+    std::memcpy(&out[0], &size_field, 4);
+    block->data = std::move(out);
+    return true;
+  }
+
+  void SubmitIfFull() {
+    if (current_.data.size() == kLz4BlockSize) {
+      ok_ = pipeline_.Submit(std::move(current_));
+      current_ = PipelineBlock();
+      current_.data.reserve(kLz4BlockSize);
+    }
+  }
+
+  int fd_;
+  bool ok_ = true;
+  PipelineBlock current_;
+  OrderedBlockPipeline pipeline_;
+};
+
+static constexpr size_t kTarBlock = 512;
+
+// Writes value as zero-padded octal into a field of width bytes (including
+// the terminating NUL). Returns false if it does not fit.
+static bool PutTarOctal(char* field, size_t width, std::uint64_t value) {
+  std::string digits(width - 1, '0');
+  for (size_t i = width - 1; i-- > 0;) {
+    digits[i] = static_cast<char>('0' + (value & 7));
+    value >>= 3;
+  }
+  std::memcpy(field, digits.data(), width - 1);
+  field[width - 1] = '\0';
+  return value == 0;
+}
+
+static std::string PaxRecord(const std::string& key, const std::string& value) {
+  const std::string body = " " + key + "=" + value + "\n";
+  size_t len = body.size() + 1;
+  while (std::to_string(len).size() + body.size() != len) {
+    ++len;
+  }
+  return std::to_string(len) + body;
+}
+
+// Emits one ustar header; names, link targets and sizes that do not fit the
+// fixed fields are carried by a preceding pax extended header.
+static bool WriteTarHeader(ArchiveSink* sink, const std::string& name, char type,
+                           const struct stat& st, std::uint64_t size,
+                           const std::string& link_target) {
+  std::string pax;
+  std::string short_name = name;
+  std::string prefix;
+  if (name.size() > 100) {
+    const size_t split = name.rfind('/', 155);
+    if (split != std::string::npos && split > 0 && name.size() - split - 1 <= 100 &&
+        name.size() - split - 1 > 0) {
+      prefix = name.substr(0, split);
+      short_name = name.substr(split + 1);
+    } else {
+      pax += PaxRecord("path", name);
+      short_name = name.substr(0, 100);
+    }
+  }
+  if (link_target.size() > 100) {
+    pax += PaxRecord("linkpath", link_target);
+  }
+  char size_probe[12];
+  if (!PutTarOctal(size_probe, sizeof(size_probe), size)) {
+    pax += PaxRecord("size", std::to_string(size));
+  }
+  if (!pax.empty()) {
+    struct stat pax_st = st;
+    pax_st.st_mode = 0644;
+    if (!WriteTarHeader(sink, "PaxHeader/" + short_name.substr(0, 80), 'x', pax_st,
+                        pax.size(), std::string())) {
+      return false;
+    }
+    pax.resize((pax.size() + kTarBlock - 1) / kTarBlock * kTarBlock, '\0');
+    if (!sink->Write(pax.data(), pax.size())) {
+      return false;
+    }
+  }
+
+  char h[kTarBlock] = {};
+  std::memcpy(h, short_name.data(), std::min<size_t>(short_name.size(), 100));
+  PutTarOctal(h + 100, 8, st.st_mode & 07777);
+  PutTarOctal(h + 108, 8, st.st_uid & 07777777);
+  PutTarOctal(h + 116, 8, st.st_gid & 07777777);
+  if (!PutTarOctal(h + 124, 12, size)) {
+    PutTarOctal(h + 124, 12, 0);
+  }
+  PutTarOctal(h + 136, 12, st.st_mtime < 0 ? 0 : static_cast<std::uint64_t>(st.st_mtime));
+  h[156] = type;
+  std::memcpy(h + 157, link_target.data(), std::min<size_t>(link_target.size(), 100));
+  std::memcpy(h + 257, "ustar", 6);
+  std::memcpy(h + 263, "00", 2);
+  std::memcpy(h + 345, prefix.data(), std::min<size_t>(prefix.size(), 155));
+  std::memset(h + 148, ' ', 8);
+  unsigned sum = 0;
+  for (unsigned char c : h) {
+    sum += c;
+  }
+  PutTarOctal(h + 148, 7, sum);
+  h[155] = ' ';
+  return sink->Write(h, sizeof(h));
+}
+
+static void HandlePackCommand(const std::vector<std::string>& tokens) {
+  if (tokens.size() < 3) {
+    std::cout << "Missing arguments: Please enter 'pack [dir] [out.tar|out.tar.lz4]'\n";
+    return;
+  }
+  std::string src = tokens[1];
+  const std::string& out_name = tokens[2];
+  const bool compress = EndsWith(out_name, ".lz4");
+  if (!compress && !EndsWith(out_name, ".tar")) {
+    std::cout << "Unsupported archive type: " << out_name << " (use .tar or .tar.lz4)\n";
+    return;
+  }
+  while (src.size() > 1 && src.back() == '/') {
+    src.pop_back();
+  }
+  struct stat root_st;
+  if (::stat(src.c_str(), &root_st) != 0 || !S_ISDIR(root_st.st_mode)) {
+    std::cout << "Invalid directory: " << tokens[1] << "\n";
+    return;
+  }
+  namespace fs = std::filesystem;
+  std::error_code ec;
+  std::string root_name = fs::absolute(fs::path(src), ec).lexically_normal().filename().string();
+  if (ec || root_name.empty()) {
+    root_name = "root";
+  }
+
+  const int out_fd = ::open(out_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (out_fd < 0) {
+    std::cout << "Invalid target path\n";
+    return;
+  }
+  struct stat out_st;
+  ::fstat(out_fd, &out_st);
+
+  std::unique_ptr<ArchiveSink> sink;
+  if (compress) {
+    sink = std::make_unique<Lz4ArchiveSink>(out_fd);
+  } else {
+    sink = std::make_unique<PlainArchiveSink>(out_fd);
+  }
+
+  static const char kZeros[kTarBlock] = {};
+  size_t entries = 1;
+  bool ok = WriteTarHeader(sink.get(), root_name + "/", '5', root_st, 0, std::string());
+  const size_t strip = src.size() + (src.back() == '/' ? 0 : 1);
+  // Archive name of the first file seen per (dev, inode) with more than one
+  // link; later links are stored as hard link entries pointing at it.
+  std::map<std::pair<dev_t, ino_t>, std::string> linked;
+  WalkTree(src, WalkOptions(), [&](WalkDir& dir) {
+    for (const auto& entry : dir.entries) {
+      if (!ok) {
+        return WalkAction::kStop;
+      }
+      if (!entry.stat_ok || (entry.st.st_dev == out_st.st_dev && entry.st.st_ino == out_st.st_ino)) {
+        continue;
+      }
+      const std::string name = root_name + "/" + entry.path.substr(strip);
+      if (entry.IsDir()) {
+        ok = WriteTarHeader(sink.get(), name + "/", '5', entry.st, 0, std::string());
+      } else if (entry.is_link) {
+        ok = WriteTarHeader(sink.get(), name, '2', entry.st, 0, ReadLinkTarget(AT_FDCWD, entry.path));
+      } else if (entry.IsFile()) {
+        const auto key = std::make_pair(entry.st.st_dev, entry.st.st_ino);
+        const auto first = entry.st.st_nlink > 1 ? linked.find(key) : linked.end();
+        if (first != linked.end()) {
+          ok = WriteTarHeader(sink.get(), name, '1', entry.st, 0, first->second);
+          ++entries;
+          continue;
+        }
+        const int fd = ::open(entry.path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+          std::cout << "Skipped unreadable file: " << entry.path << "\n";
+          continue;
+        }
+        if (entry.st.st_nlink > 1) {
+          linked.emplace(key, name);
+        }
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        const std::uint64_t size = static_cast<std::uint64_t>(entry.st.st_size);
+        ok = WriteTarHeader(sink.get(), name, '0', entry.st, size, std::string()) &&
+             sink->WriteFromFd(fd, size);
+        ::close(fd);
+        const size_t pad = static_cast<size_t>((kTarBlock - size % kTarBlock) % kTarBlock);
+        ok = ok && sink->Write(kZeros, pad);
+      } else {
+        continue;
+      }
+      ++entries;
+    }
+    return WalkAction::kContinue;
+  });
+  ok = ok && sink->Write(kZeros, kTarBlock) && sink->Write(kZeros, kTarBlock);
+  ok = sink->Finish() && ok;
+  ::close(out_fd);
+  if (!ok) {
+    std::cout << "Failed to write archive: " << out_name << "\n";
+    return;
+  }
+  std::cout << "Packed " << entries << " entries into " << out_name << " ("
+            << sink->bytes_in() << " -> " << sink->bytes_out() << " bytes)\n";
+}
+
+static std::uint64_t ParseTarNumber(const char* field, size_t width) {
+  const auto* p = reinterpret_cast<const unsigned char*>(field);
+  if ((p[0] & 0x80) != 0) {  // GNU base-256
+    std::uint64_t v = p[0] & 0x7F;
+    for (size_t i = 1; i < width; ++i) {
+      v = (v << 8) | p[i];
+    }
+    return v;
+  }
+  std::uint64_t v = 0;
+  for (size_t i = 0; i < width && p[i] != '\0' && p[i] != ' '; ++i) {
+    if (p[i] < '0' || p[i] > '7') {
+      break;
+    }
+    v = (v << 3) | static_cast<std::uint64_t>(p[i] - '0');
+  }
+  return v;
+}
+
+static std::string TarField(const char* field, size_t width) {
+  return std::string(field, strnlen(field, width));
+}
+
+// Push-based tar parser that recreates entries below dest. Absolute names are
+// made relative, and names with ".." components or passing through a
+// symbolic link created by this archive are refused.
+class TarExtractor {
+ public:
+  explicit TarExtractor(std::string dest) : dest_(std::move(dest)) {}
+  TarExtractor(const TarExtractor&) = delete;
+  TarExtractor& operator=(const TarExtractor&) = delete;
+  ~TarExtractor() { CloseFile(); }
+
+  bool Feed(const char* data, size_t n) {
+    while (n > 0 && !failed_ && !finished_) {
+      if (remaining_ > 0) {
+        const size_t take = static_cast<size_t>(std::min<std::uint64_t>(n, remaining_));
+        if (state_ == State::kFileData && out_fd_ >= 0) {
+          failed_ = !WriteAll(out_fd_, data, take);
+        } else if (state_ == State::kMetaData) {
+          meta_.append(data, take);
+        }
+        data += take;
+        n -= take;
+        remaining_ -= take;
+        if (remaining_ == 0) {
+          EndEntryData();
+        }
+        continue;
+      }
+      if (skip_ > 0) {
+        const size_t take = static_cast<size_t>(std::min<std::uint64_t>(n, skip_));
+        data += take;
+        n -= take;
+        skip_ -= take;
+        continue;
+      }
+      const size_t take = std::min(n, kTarBlock - header_.size());
+      header_.append(data, take);
+      data += take;
+      n -= take;
+      if (header_.size() == kTarBlock) {
+        HandleHeader();
+        header_.clear();
+      }
+    }
+    return !failed_;
+  }
+
+  bool Finish() {
+    CloseFile();
+    for (auto it = dirs_.rbegin(); it != dirs_.rend(); ++it) {
+      const timespec times[2] = {{0, UTIME_OMIT}, {it->second.mtime, 0}};
+      ::utimensat(AT_FDCWD, it->first.c_str(), times, AT_SYMLINK_NOFOLLOW);
+      ::chmod(it->first.c_str(), it->second.mode);
+    }
+    return !failed_;
+  }
+
+  size_t entries() const { return entries_; }
+  size_t skipped() const { return skipped_; }
+
+ private:
+  enum class State { kHeader, kFileData, kMetaData };
+  struct DirAttrs {
+    mode_t mode;
+    std::time_t mtime;
+  };
+
+  void HandleHeader() {
+    const char* h = header_.data();
+    if (std::all_of(header_.begin(), header_.end(), [](char c) { return c == '\0'; })) {
+      if (++zero_blocks_ == 2) {
+        finished_ = true;
+      }
+      return;
+    }
+    zero_blocks_ = 0;
+    const char type = h[156];
+    std::uint64_t size = ParseTarNumber(h + 124, 12);
+    std::string name = TarField(h, 100);
+    if (std::memcmp(h + 257, "ustar", 5) == 0 && h[345] != '\0') {
+      name = TarField(h + 345, 155) + "/" + name;
+    }
+    std::string link = TarField(h + 157, 100);
+    if (!pax_path_.empty()) {
+      name = std::move(pax_path_);
+    }
+    if (!pax_link_.empty()) {
+      link = std::move(pax_link_);
+    }
+    if (pax_size_set_) {
+      size = pax_size_;
+    }
+    pax_path_.clear();
+    pax_link_.clear();
+    pax_size_set_ = false;
+
+    const std::uint64_t padded = (size + kTarBlock - 1) / kTarBlock * kTarBlock;
+    if (type == 'x' || type == 'L' || type == 'K') {
+      meta_type_ = type;
+      meta_.clear();
+      BeginData(State::kMetaData, size, padded);
+      return;
+    }
+    if (type == 'g') {
+      BeginData(State::kMetaData, 0, padded);
+      skip_ = padded;
+      return;
+    }
+
+    const mode_t mode = static_cast<mode_t>(ParseTarNumber(h + 100, 8) & 07777);
+    const std::time_t mtime = static_cast<std::time_t>(ParseTarNumber(h + 136, 12));
+    const std::string path = SafePath(name);
+    const bool has_data = type == '0' || type == '\0' || type == '7';
+    if (path.empty()) {
+      ++skipped_;
+      BeginData(State::kFileData, has_data ? size : 0, has_data ? padded : 0);
+      return;
+    }
+    EnsureDirectoryPath(SplitParentLeaf(path).first, &ensured_);
+    if (type == '5') {
+      if (::mkdir(path.c_str(), 0700) != 0 && errno != EEXIST) {
+        ++skipped_;
+        return;
+      }
+      ::chmod(path.c_str(), 0700 | mode);
+      dirs_.emplace_back(path, DirAttrs{mode, mtime});
+      ensured_.insert(path);
+      ++entries_;
+    } else if (type == '2') {
+      ::unlink(path.c_str());
+      if (::symlink(link.c_str(), path.c_str()) == 0) {
+        links_.push_back(path + "/");
+        ++entries_;
+      } else {
+        ++skipped_;
+      }
+    } else if (type == '1') {
+      const std::string target = SafePath(link);
+      ::unlink(path.c_str());
+      if (!target.empty() && ::link(target.c_str(), path.c_str()) == 0) {
+        ++entries_;
+      } else {
+        ++skipped_;
+      }
+    } else if (has_data) {
+      ::unlink(path.c_str());
+      out_fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+      if (out_fd_ < 0) {
+        ++skipped_;
+      } else {
+        file_mode_ = mode;
+        file_mtime_ = mtime;
+        ++entries_;
+      }
+      BeginData(State::kFileData, size, padded);
+      if (size == 0) {
+        CloseFile();
+      }
+    } else {
+      ++skipped_;
+      BeginData(State::kFileData, 0, padded);
+    }
+  }
+
+  void BeginData(State state, std::uint64_t size, std::uint64_t padded) {
+    state_ = state;
+    remaining_ = size;
+    skip_ = padded - size;
+  }
+
+  void EndEntryData() {
+    if (state_ == State::kFileData) {
+      CloseFile();
+      return;
+    }
+    if (meta_type_ == 'L') {
+      pax_path_ = TarField(meta_.data(), meta_.size());
+    } else if (meta_type_ == 'K') {
+      pax_link_ = TarField(meta_.data(), meta_.size());
+    } else {
+      ParsePax();
+    }
+    state_ = State::kHeader;
+  }
+
+  void ParsePax() {
+    size_t pos = 0;
+    while (pos < meta_.size()) {
+      const size_t space = meta_.find(' ', pos);
+      if (space == std::string::npos) {
+        break;
+      }
+      const size_t len = std::strtoull(meta_.c_str() + pos, nullptr, 10);
+      if (len == 0 || pos + len > meta_.size()) {
+        break;
+      }
+      const std::string record = meta_.substr(space + 1, pos + len - space - 2);
+      const size_t eq = record.find('=');
+      if (eq != std::string::npos) {
+        const std::string key = record.substr(0, eq);
+        const std::string value = record.substr(eq + 1);
+        if (key == "path") {
+          pax_path_ = value;
+        } else if (key == "linkpath") {
+          pax_link_ = value;
+        } else if (key == "size") {
+          pax_size_ = std::strtoull(value.c_str(), nullptr, 10);
+          pax_size_set_ = true;
+        }
+      }
+      pos += len;
+    }
+  }
+
+  void CloseFile() {
+    if (out_fd_ < 0) {
+      return;
+    }
+    ::fchmod(out_fd_, file_mode_);
+    const timespec times[2] = {{0, UTIME_OMIT}, {file_mtime_, 0}};
+    ::futimens(out_fd_, times);
+    ::close(out_fd_);
+    out_fd_ = -1;
+  }
+
+  std::string SafePath(const std::string& name) const {
+    std::string rel;
+    std::stringstream parts(name);
+    std::string part;
+    while (std::getline(parts, part, '/')) {
+      if (part.empty() || part == ".") {
+        continue;
+      }
+      if (part == "..") {
+        return {};
+      }
+      rel += (rel.empty() ? "" : "/") + part;
+    }
+    if (rel.empty()) {
+      return {};
+    }
+    const std::string path = JoinPath(dest_, rel);
+    for (const auto& link : links_) {
+      if (path.compare(0, link.size(), link) == 0) {
+        return {};
+      }
+    }
+    return path;
+  }
+
+  std::string dest_;
+  std::string header_;
+  std::string meta_;
+  char meta_type_ = 'x';
+  std::string pax_path_;
+  std::string pax_link_;
+  std::uint64_t pax_size_ = 0;
+  bool pax_size_set_ = false;
+  State state_ = State::kHeader;
+  std::uint64_t remaining_ = 0;
+  std::uint64_t skip_ = 0;
+  int out_fd_ = -1;
+  mode_t file_mode_ = 0644;
+  std::time_t file_mtime_ = 0;
+  int zero_blocks_ = 0;
+  bool failed_ = false;
+  bool finished_ = false;
+  size_t entries_ = 0;
+  size_t skipped_ = 0;
+  std::unordered_set<std::string> ensured_;
+  std::vector<std::pair<std::string, DirAttrs>> dirs_;
+  std::vector<std::string> links_;
+};
+
+static bool ReadFull(int fd, void* buf, size_t n) {
+  auto* p = static_cast<char*>(buf);
+  while (n > 0) {
+    const ssize_t r = ::read(fd, p, n);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      return false;
+    }
+    p += r;
+    n -= static_cast<size_t>(r);
+  }
+  return true;
+}
+
+// Decodes LZ4 frames from fd into extractor. Frames with independent blocks
+// are decompressed in parallel; linked-block frames (the lz4 tool's default)
+// are decoded in order with the previous 64 KiB as the window.
+static bool ExtractLz4Stream(int fd, TarExtractor* extractor) {
+  OrderedBlockPipeline pipeline(
+      DefaultWorkerCount(),
+      [](PipelineBlock* block) {
+        if (block->stored) {
+          return true;
+        }
+        std::string out;
+        out.reserve(kLz4BlockSize);
+        const bool ok = Lz4DecompressBlock(reinterpret_cast<const unsigned char*>(block->data.data()),
+                                           block->data.size(), &out, 4 << 20);
+        block->data = std::move(out);
+        return ok;
+      },
+      [extractor](const PipelineBlock& block) {
+        return extractor->Feed(block.data.data(), block.data.size());
+      });
+
+  bool ok = true;
+  std::uint32_t magic;
+  bool any_frame = false;
+  while (ok && ReadFull(fd, &magic, 4)) {
+    if ((magic & 0xFFFFFFF0U) == 0x184D2A50U) {  // skippable frame
+      std::uint32_t len;
+      ok = ReadFull(fd, &len, 4) && ::lseek(fd, len, SEEK_CUR) >= 0;
+      continue;
+    }
+    if (magic != kLz4Magic) {
+      ok = false;
+      break;
+    }
+    any_frame = true;
+    unsigned char desc[2];
+    ok = ReadFull(fd, desc, 2);
+    const bool independent = (desc[0] & 0x20) != 0;
+    const bool block_checksum = (desc[0] & 0x10) != 0;
+    const bool content_size = (desc[0] & 0x08) != 0;
+    const bool content_checksum = (desc[0] & 0x04) != 0;
+    const bool dict_id = (desc[0] & 0x01) != 0;
+    unsigned char skip[13];
+    ok = ok && (desc[0] >> 6) == 1 &&
+         ReadFull(fd, skip, (content_size ? 8 : 0) + (dict_id ? 4 : 0) + 1);
+    std::string window;
+    while (ok) {
+      std::uint32_t size_field;
+      if (!ReadFull(fd, &size_field, 4)) {
+        ok = false;
+        break;
+      }
+      if (size_field == 0) {
+        break;
+      }
+      PipelineBlock block;
+      block.stored = (size_field & 0x80000000U) != 0;
+      const size_t len = size_field & 0x7FFFFFFFU;
+      if (len > (4u << 20) + 16) {
+        ok = false;
+        break;
+      }
+      block.data.resize(len);
+      ok = ReadFull(fd, &block.data[0], len);
+      if (ok && block_checksum) {
+        ok = ReadFull(fd, skip, 4);
+      }
+      if (!ok) {
+        break;
+      }
+      if (!independent) {
+        std::string out = window;
+        if (block.stored) {
+          out += block.data;
+        } else {
+          ok = Lz4DecompressBlock(reinterpret_cast<const unsigned char*>(block.data.data()),
+                                  block.data.size(), &out, 4 << 20);
+        }
+        block.data = out.substr(window.size());
+        block.stored = true;
+        window = out.substr(out.size() > 65536 ? out.size() - 65536 : 0);
+      }
+      ok = ok && pipeline.Submit(std::move(block));
+    }
+    if (ok && content_checksum) {
+      ok = ReadFull(fd, skip, 4);
+    }
+  }
+  return pipeline.Finish() && ok && any_frame;
+}
+
+static void HandleUnpackCommand(const std::vector<std::string>& tokens) {
+  if (tokens.size() < 2) {
+    std::cout << "Missing archive: Please enter 'unpack [archive] [dir]'\n";
+    return;
+  }
+  const std::string& archive = tokens[1];
+  const std::string dest = tokens.size() >= 3 ? tokens[2] : ".";
+  const int fd = ::open(archive.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    std::cout << "Source not found\n";
+    return;
+  }
+  std::unordered_set<std::string> ensured;
+  if (!EnsureDirectoryPath(dest, &ensured)) {
+    ::close(fd);
+    std::cout << "Invalid target path\n";
+    return;
+  }
+  ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  std::uint32_t magic = 0;
+  const bool is_lz4 = ::pread(fd, &magic, 4, 0) == 4 && magic == kLz4Magic;
+  TarExtractor extractor(dest);
+  bool ok;
+  if (is_lz4) {
+    ok = ExtractLz4Stream(fd, &extractor);
+  } else {
+    std::vector<char> buf(1 << 20);
+    ok = true;
+    ssize_t n;
+    while (ok && (n = ::read(fd, buf.data(), buf.size())) > 0) {
+      ok = extractor.Feed(buf.data(), static_cast<size_t>(n));
+    }
+  }
+  ok = extractor.Finish() && ok;
+  ::close(fd);
+  if (!ok) {
+    std::cout << "Failed to unpack archive: " << archive << "\n";
+    return;
+  }
+  std::cout << "Unpacked " << extractor.entries() << " entries into " << dest;
+  if (extractor.skipped() > 0) {
+    std::cout << " (" << extractor.skipped() << " skipped)";
+  }
+  std::cout << "\n";
+}
+
+// ---------------------------------------------------------------------------
+// Hashing: SHA-256 (scalar and 4-lane multi-buffer), XXH3-64 and CRC32C.
+
+static inline std::uint64_t Load64(const unsigned char* p) {
+  std::uint64_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline std::uint32_t LoadBe32(const unsigned char* p) {
+  return (static_cast<std::uint32_t>(p[0]) << 24) | (static_cast<std::uint32_t>(p[1]) << 16) |
+         (static_cast<std::uint32_t>(p[2]) << 8) | p[3];
+}
+
+static std::string ToHex(const unsigned char* bytes, size_t n) {
+  static const char kDigits[] = "0123456789abcdef";
+  std::string hex(n * 2, '0');
+  for (size_t i = 0; i < n; ++i) {
+    hex[2 * i] = kDigits[bytes[i] >> 4];
+    hex[2 * i + 1] = kDigits[bytes[i] & 15];
+  }
+  return hex;
+}
+
+static std::string ToHex64(std::uint64_t v, size_t digits) {
+  unsigned char be[8];
+  for (int i = 7; i >= 0; --i) {
+    be[i] = static_cast<unsigned char>(v & 0xFF);
+    v >>= 8;
+  }
+  return ToHex(be + 8 - digits / 2, digits / 2);
+}
+
+static const std::uint32_t kSha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static const std::uint32_t kSha256Init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                             0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+// Builds the one or two final SHA-256 blocks (tail bytes, 0x80, zeros and
+// the bit length) into out; returns the number of blocks.
+static size_t Sha256Padding(const unsigned char* data, size_t len, unsigned char out[128]) {
+  const size_t tail = len % 64;
+  std::memset(out, 0, 128);
+  std::memcpy(out, data + len - tail, tail);
+  out[tail] = 0x80;
+  const size_t blocks = tail + 9 <= 64 ? 1 : 2;
+  const std::uint64_t bits = static_cast<std::uint64_t>(len) * 8;
+  for (int i = 0; i < 8; ++i) {
+    out[blocks * 64 - 1 - i] = static_cast<unsigned char>(bits >> (8 * i));
+  }
+  return blocks;
+}
+
+static void Sha256Compress(std::uint32_t state[8], const unsigned char* block) {
+  auto rotr = [](std::uint32_t x, int n) { return (x >> n) | (x << (32 - n)); };
+  std::uint32_t w[64];
+  for (int t = 0; t < 16; ++t) {
+    w[t] = LoadBe32(block + 4 * t);
+  }
+  for (int t = 16; t < 64; ++t) {
+    const std::uint32_t s0 = rotr(w[t - 15], 7) ^ rotr(w[t - 15], 18) ^ (w[t - 15] >> 3);
+    const std::uint32_t s1 = rotr(w[t - 2], 17) ^ rotr(w[t - 2], 19) ^ (w[t - 2] >> 10);
+    w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+  }
+  std::uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+  std::uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+  for (int t = 0; t < 64; ++t) {
+    const std::uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) +
+                             kSha256K[t] + w[t];
+    const std::uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+  state[5] += f;
+  state[6] += g;
+  state[7] += h;
+}
+
+static std::string Sha256Hex(const unsigned char* data, size_t len) {
+  std::uint32_t state[8];
+  std::memcpy(state, kSha256Init, sizeof(state));
+  for (size_t i = 0; i + 64 <= len; i += 64) {
+    Sha256Compress(state, data + i);
+  }
+  unsigned char pad[128];
+  const size_t blocks = Sha256Padding(data, len, pad);
+  for (size_t b = 0; b < blocks; ++b) {
+    Sha256Compress(state, pad + 64 * b);
+  }
+  unsigned char digest[32];
+  for (int i = 0; i < 8; ++i) {
+    for (int k = 0; k < 4; ++k) {
+      digest[4 * i + k] = static_cast<unsigned char>(state[i] >> (24 - 8 * k));
+    }
+  }
+  return ToHex(digest, sizeof(digest));
+}
+
+// Four 32-bit lanes map onto one SSE2/NEON register, the baseline vector
+// width of every supported target, so no per-CPU dispatch is needed.
+static constexpr size_t kShaLanes = 4;
+typedef std::uint32_t ShaVec __attribute__((vector_size(4 * kShaLanes)));
+
+// One compression step for independent messages: word t of lane i lives in
+// w[t][i]. Lanes whose mask is zero keep their previous state.
+static void Sha256CompressLanes(ShaVec state[8], const ShaVec w_in[16], const ShaVec& active) {
+  auto rotr = [](ShaVec x, int n) { return (x >> n) | (x << (32 - n)); };
+  ShaVec w[64];
+  for (int t = 0; t < 16; ++t) {
+    w[t] = w_in[t];
+  }
+  for (int t = 16; t < 64; ++t) {
+    const ShaVec s0 = rotr(w[t - 15], 7) ^ rotr(w[t - 15], 18) ^ (w[t - 15] >> 3);
+    const ShaVec s1 = rotr(w[t - 2], 17) ^ rotr(w[t - 2], 19) ^ (w[t - 2] >> 10);
+    w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+  }
+  ShaVec a = state[0], b = state[1], c = state[2], d = state[3];
+  ShaVec e = state[4], f = state[5], g = state[6], h = state[7];
+  for (int t = 0; t < 64; ++t) {
+    const ShaVec t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) +
+                      kSha256K[t] + w[t];
+    const ShaVec t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  const ShaVec out[8] = {a, b, c, d, e, f, g, h};
+  for (int i = 0; i < 8; ++i) {
+    state[i] += out[i] & active;
+  }
+}
+
+// Hashes up to kShaLanes messages in lock step, one SIMD lane each. Callers
+// group messages of similar length so that few lanes idle.
+static void Sha256MultiBuffer(const std::vector<std::pair<const unsigned char*, size_t>>& msgs,
+                              std::vector<std::string>* digests) {
+  const size_t lanes = msgs.size();
+  unsigned char pad[kShaLanes][128];
+  size_t full_blocks[kShaLanes] = {};
+  size_t total_blocks[kShaLanes] = {};
+  size_t max_blocks = 0;
+  for (size_t l = 0; l < lanes; ++l) {
+    full_blocks[l] = msgs[l].second / 64;
+    total_blocks[l] = full_blocks[l] + Sha256Padding(msgs[l].first, msgs[l].second, pad[l]);
+    max_blocks = std::max(max_blocks, total_blocks[l]);
+  }
+
+  ShaVec state[8];
+  for (int i = 0; i < 8; ++i) {
+    for (size_t l = 0; l < kShaLanes; ++l) {
+      state[i][l] = kSha256Init[i];
+    }
+  }
+  static const unsigned char kZeroBlock[64] = {};
+  for (size_t b = 0; b < max_blocks; ++b) {
+    ShaVec w[16];
+    ShaVec active;
+    for (size_t l = 0; l < kShaLanes; ++l) {
+      const unsigned char* block = kZeroBlock;
+      active[l] = 0;
+      if (l < lanes && b < total_blocks[l]) {
+        block = b < full_blocks[l] ? msgs[l].first + 64 * b : pad[l] + 64 * (b - full_blocks[l]);
+        active[l] = 0xFFFFFFFFU;
+      }
+      for (int t = 0; t < 16; ++t) {
+        w[t][l] = LoadBe32(block + 4 * t);
+      }
+    }
+    Sha256CompressLanes(state, w, active);
+  }
+
+  for (size_t l = 0; l < lanes; ++l) {
+    unsigned char digest[32];
+    for (int i = 0; i < 8; ++i) {
+      for (int k = 0; k < 4; ++k) {
+        digest[4 * i + k] = static_cast<unsigned char>(state[i][l] >> (24 - 8 * k));
+      }
+    }
+    (*digests)[l] = ToHex(digest, sizeof(digest));
+  }
+}
+
+static const unsigned char kXxh3Secret[192] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+static constexpr std::uint64_t kXxhP32_1 = 0x9E3779B1U;
+static constexpr std::uint64_t kXxhP32_2 = 0x85EBCA77U;
+static constexpr std::uint64_t kXxhP32_3 = 0xC2B2AE3DU;
+static constexpr std::uint64_t kXxhP64_1 = 0x9E3779B185EBCA87ULL;
+static constexpr std::uint64_t kXxhP64_2 = 0xC2B2AE3D27D4EB4FULL;
+static constexpr std::uint64_t kXxhP64_3 = 0x165667B19E3779F9ULL;
+static constexpr std::uint64_t kXxhP64_4 = 0x85EBCA77C2B2AE63ULL;
+static constexpr std::uint64_t kXxhP64_5 = 0x27D4EB2F165667C5ULL;
+
+static inline std::uint64_t Rotl64(std::uint64_t v, int r) { return (v << r) | (v >> (64 - r)); }
+
+__extension__ typedef unsigned __int128 Uint128;
+
+static inline std::uint64_t Mul128Fold64(std::uint64_t a, std::uint64_t b) {
+  const Uint128 product = static_cast<Uint128>(a) * b;
+  return static_cast<std::uint64_t>(product) ^ static_cast<std::uint64_t>(product >> 64);
+}
+
+static inline std::uint64_t Xxh64Avalanche(std::uint64_t h) {
+  h ^= h >> 33;
+  h *= kXxhP64_2;
+  h ^= h >> 29;
+  h *= kXxhP64_3;
+  return h ^ (h >> 32);
+}
+
+static inline std::uint64_t Xxh3Avalanche(std::uint64_t h) {
+  h ^= h >> 37;
+  h *= 0x165667919E3779F9ULL;
+  return h ^ (h >> 32);
+}
+
+static inline std::uint64_t Xxh3Mix16(const unsigned char* in, const unsigned char* secret) {
+  return Mul128Fold64(Load64(in) ^ Load64(secret), Load64(in + 8) ^ Load64(secret + 8));
+}
+
+static inline void Xxh3Accumulate512(std::uint64_t acc[8], const unsigned char* in,
+                                     const unsigned char* secret) {
+  for (int i = 0; i < 8; ++i) {
+    const std::uint64_t value = Load64(in + 8 * i);
+    const std::uint64_t key = value ^ Load64(secret + 8 * i);
+    acc[i ^ 1] += value;
+    acc[i] += (key & 0xFFFFFFFFULL) * (key >> 32);
+  }
+}
+
+// XXH3 64-bit with seed 0 and the default secret (same values as xxhsum -H3).
+static std::uint64_t Xxh3_64(const unsigned char* in, size_t len) {
+  const unsigned char* s = kXxh3Secret;
+  if (len == 0) {
+    return Xxh64Avalanche(Load64(s + 56) ^ Load64(s + 64));
+  }
+  if (len <= 3) {
+    const std::uint32_t combined = (static_cast<std::uint32_t>(in[0]) << 16) |
+                                   (static_cast<std::uint32_t>(in[len >> 1]) << 24) |
+                                   in[len - 1] | (static_cast<std::uint32_t>(len) << 8);
+    const std::uint64_t bitflip = Load32(s) ^ Load32(s + 4);
+    return Xxh64Avalanche(combined ^ bitflip);
+  }
+  if (len <= 8) {
+    const std::uint64_t input = Load32(in + len - 4) + (static_cast<std::uint64_t>(Load32(in)) << 32);
+    std::uint64_t h = input ^ (Load64(s + 8) ^ Load64(s + 16));
+    h ^= Rotl64(h, 49) ^ Rotl64(h, 24);
+    h *= 0x9FB21C651E98DF25ULL;
+    h ^= (h >> 35) + len;
+    h *= 0x9FB21C651E98DF25ULL;
+    return h ^ (h >> 28);
+  }
+  if (len <= 16) {
+    const std::uint64_t lo = Load64(in) ^ (Load64(s + 24) ^ Load64(s + 32));
+    const std::uint64_t hi = Load64(in + len - 8) ^ (Load64(s + 40) ^ Load64(s + 48));
+    return Xxh3Avalanche(len + __builtin_bswap64(lo) + hi + Mul128Fold64(lo, hi));
+  }
+  if (len <= 128) {
+    std::uint64_t acc = len * kXxhP64_1;
+    if (len > 32) {
+      if (len > 64) {
+        if (len > 96) {
+          acc += Xxh3Mix16(in + 48, s + 96);
+          acc += Xxh3Mix16(in + len - 64, s + 112);
+        }
+        acc += Xxh3Mix16(in + 32, s + 64);
+        acc += Xxh3Mix16(in + len - 48, s + 80);
+      }
+      acc += Xxh3Mix16(in + 16, s + 32);
+      acc += Xxh3Mix16(in + len - 32, s + 48);
+    }
+    acc += Xxh3Mix16(in, s);
+    acc += Xxh3Mix16(in + len - 16, s + 16);
+    return Xxh3Avalanche(acc);
+  }
+  if (len <= 240) {
+    std::uint64_t acc = len * kXxhP64_1;
+    for (size_t i = 0; i < 8; ++i) {
+      acc += Xxh3Mix16(in + 16 * i, s + 16 * i);
+    }
+    acc = Xxh3Avalanche(acc);
+    for (size_t i = 8; i < len / 16; ++i) {
+      acc += Xxh3Mix16(in + 16 * i, s + 16 * (i - 8) + 3);
+    }
+    acc += Xxh3Mix16(in + len - 16, s + 136 - 17);
+    return Xxh3Avalanche(acc);
+  }
+
+  std::uint64_t acc[8] = {kXxhP32_3, kXxhP64_1, kXxhP64_2, kXxhP64_3,
+                          kXxhP64_4, kXxhP32_2, kXxhP64_5, kXxhP32_1};
+  constexpr size_t kStripe = 64;
+  constexpr size_t kStripesPerBlock = (sizeof(kXxh3Secret) - kStripe) / 8;
+  constexpr size_t kBlock = kStripe * kStripesPerBlock;
+  const size_t blocks = (len - 1) / kBlock;
+  for (size_t n = 0; n < blocks; ++n) {
+    for (size_t k = 0; k < kStripesPerBlock; ++k) {
+      Xxh3Accumulate512(acc, in + n * kBlock + k * kStripe, s + k * 8);
+    }
+    const unsigned char* key = s + sizeof(kXxh3Secret) - kStripe;
+    for (int i = 0; i < 8; ++i) {
+      std::uint64_t a = acc[i];
+      a ^= a >> 47;
+      a ^= Load64(key + 8 * i);
+      acc[i] = a * kXxhP32_1;
+    }
+  }
+  const size_t stripes = ((len - 1) - kBlock * blocks) / kStripe;
+  for (size_t k = 0; k < stripes; ++k) {
+    Xxh3Accumulate512(acc, in + blocks * kBlock + k * kStripe, s + k * 8);
+  }
+  Xxh3Accumulate512(acc, in + len - kStripe, s + sizeof(kXxh3Secret) - kStripe - 7);
+
+  std::uint64_t result = len * kXxhP64_1;
+  for (int i = 0; i < 4; ++i) {
+    result += Mul128Fold64(acc[2 * i] ^ Load64(s + 11 + 16 * i), acc[2 * i + 1] ^ Load64(s + 11 + 16 * i + 8));
+  }
+  return Xxh3Avalanche(result);
+}
+
+static std::uint32_t Crc32cSoftware(std::uint32_t crc, const unsigned char* p, size_t n) {
+  static const std::vector<std::uint32_t> table = []() {
+    std::vector<std::uint32_t> t(256);
+    for (std::uint32_t i = 0; i < 256; ++i) {
+      std::uint32_t c = i;
+      for (int k = 0; k < 8; ++k) {
+        c = (c & 1) ? (c >> 1) ^ 0x82F63B78U : c >> 1;
+      }
+      t[i] = c;
+    }
+    return t;
+  }();
+  for (size_t i = 0; i < n; ++i) {
+    crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2")))
+static std::uint32_t Crc32cHardware(std::uint32_t crc, const unsigned char* p, size_t n) {
+  std::uint64_t c = crc;
+  for (; n >= 8; n -= 8, p += 8) {
+    c = __builtin_ia32_crc32di(c, Load64(p));
+  }
+  std::uint32_t c32 = static_cast<std::uint32_t>(c);
+  for (; n > 0; --n, ++p) {
+    c32 = __builtin_ia32_crc32qi(c32, *p);
+  }
+  return c32;
+}
+#endif
+
+static std::uint32_t Crc32c(const unsigned char* p, size_t n) {
+#if defined(__x86_64__) && defined(__GNUC__)
+  static const bool hardware = __builtin_cpu_supports("sse4.2");
+  if (hardware) {
+    return ~Crc32cHardware(0xFFFFFFFFU, p, n);
+  }
+#endif
+  return ~Crc32cSoftware(0xFFFFFFFFU, p, n);
+}
+
+enum class HashAlgo {
+  kSha256,
+  kXxh3,
+  kCrc32c,
+};
+
+static std::string HashBytes(HashAlgo algo, const unsigned char* data, size_t len) {
+  switch (algo) {
+    case HashAlgo::kSha256:
+      return Sha256Hex(data, len);
+    case HashAlgo::kXxh3:
+      return ToHex64(Xxh3_64(data, len), 16);
+    case HashAlgo::kCrc32c:
+      return ToHex64(Crc32c(data, len), 8);
+  }
+  return {};
+}
+
+struct HashJob {
+  std::string path;
+  std::uint64_t size = 0;
+  std::string digest;  // empty when the file could not be read
+};
+
+// Files up to this size are read whole and, for SHA-256, hashed several at
+// a time in SIMD lanes; larger files are mmap'ed and hashed one per worker.
+static constexpr std::uint64_t kSmallHashFile = 64 * 1024;
+
+static void HashSmallBatch(HashAlgo algo, std::vector<HashJob*>& batch) {
+  const TraceSpan span("hash", "hash_batch", batch.size());
+  std::vector<std::string> contents(batch.size());
+  std::vector<bool> readable(batch.size(), false);
+  for (size_t i = 0; i < batch.size(); ++i) {
+    const int fd = ::open(batch[i]->path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      continue;
+    }
+    contents[i].resize(static_cast<size_t>(batch[i]->size));
+    const ssize_t n = contents[i].empty() ? 0 : ::pread(fd, &contents[i][0], contents[i].size(), 0);
+    ::close(fd);
+    if (n >= 0) {
+      contents[i].resize(static_cast<size_t>(n));
+      readable[i] = true;
+    }
+  }
+  if (algo == HashAlgo::kSha256) {
+    std::vector<std::pair<const unsigned char*, size_t>> msgs;
+    for (const auto& content : contents) {
+      msgs.emplace_back(reinterpret_cast<const unsigned char*>(content.data()), content.size());
+    }
+    std::vector<std::string> digests(batch.size());
+    Sha256MultiBuffer(msgs, &digests);
+    for (size_t i = 0; i < batch.size(); ++i) {
+      batch[i]->digest = readable[i] ? digests[i] : std::string();
+    }
+    return;
+  }
+  for (size_t i = 0; i < batch.size(); ++i) {
+    if (readable[i]) {
+      batch[i]->digest = HashBytes(algo, reinterpret_cast<const unsigned char*>(contents[i].data()),
+                                   contents[i].size());
+    }
+  }
+}
+
+static void HashLargeFile(HashAlgo algo, HashJob* job) {
+  const TraceSpan span("hash", "hash_file", job->size);
+  FileView view;
+  if (!view.Open(job->path)) {
+    return;
+  }
+  if (view.size() >= FileView::kMmapThreshold) {
+    ::madvise(const_cast<char*>(view.data()), view.size(), MADV_WILLNEED);
+  }
+  job->digest = HashBytes(algo, reinterpret_cast<const unsigned char*>(view.data()), view.size());
+}
+
+// Hashes all jobs on a worker pool. Small files are sorted by size and cut
+// into lane-sized batches so that lanes in a batch finish together.
+static void HashJobs(HashAlgo algo, std::vector<HashJob>* jobs) {
+  std::vector<HashJob*> small;
+  std::vector<HashJob*> large;
+  for (auto& job : *jobs) {
+    (job.size <= kSmallHashFile ? small : large).push_back(&job);
+  }
+  std::sort(small.begin(), small.end(),
+            [](const HashJob* a, const HashJob* b) { return a->size < b->size; });
+
+  std::vector<std::vector<HashJob*>> tasks;
+  for (HashJob* job : large) {
+    tasks.push_back({job});
+  }
+  for (size_t i = 0; i < small.size(); i += kShaLanes) {
+    tasks.emplace_back(small.begin() + static_cast<std::ptrdiff_t>(i),
+                       small.begin() + static_cast<std::ptrdiff_t>(std::min(small.size(), i + kShaLanes)));
+  }
+
+  std::atomic<size_t> next{0};
+  const size_t worker_count = std::min<size_t>(DefaultWorkerCount(), tasks.size());
+  std::vector<std::thread> workers;
+  for (size_t w = 0; w < worker_count; ++w) {
+    workers.emplace_back([&]() {
+      for (size_t i = next.fetch_add(1); i < tasks.size(); i = next.fetch_add(1)) {
+        if (tasks[i].size() == 1 && tasks[i][0]->size > kSmallHashFile) {
+          HashLargeFile(algo, tasks[i][0]);
+        } else {
+          HashSmallBatch(algo, tasks[i]);
+        }
+      }
+    });
+  }
+  for (auto& t : workers) {
+    t.join();
+  }
+}
+
+// Verifies a manifest of "<hex>  <path>" lines; the algorithm of each line
+// is implied by its digest length.
+static void CheckHashManifest(const std::string& manifest) {
+  std::ifstream in(manifest);
+  if (!in) {
+    std::cout << "File not found: " << manifest << "\n";
+    return;
+  }
+  std::vector<HashJob> jobs;
+  std::vector<std::string> expected;
+  std::vector<HashAlgo> algos;
+  std::string line;
+  size_t malformed = 0;
+  while (std::getline(in, line)) {
+    const size_t space = line.find(' ');
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    if (space == std::string::npos || space + 2 > line.size()) {
+      ++malformed;
+      continue;
+    }
+    const std::string hex = ToLowerAscii(line.substr(0, space));
+    const size_t name_at = (line[space + 1] == ' ' || line[space + 1] == '*') ? space + 2 : space + 1;
+    HashAlgo algo;
+    if (hex.size() == 64) {
+      algo = HashAlgo::kSha256;
+    } else if (hex.size() == 16) {
+      algo = HashAlgo::kXxh3;
+    } else if (hex.size() == 8) {
+      algo = HashAlgo::kCrc32c;
+    } else {
+      ++malformed;
+      continue;
+    }
+    HashJob job;
+    job.path = line.substr(name_at);
+    struct stat st;
+    job.size = ::stat(job.path.c_str(), &st) == 0 ? static_cast<std::uint64_t>(st.st_size) : 0;
+    jobs.push_back(std::move(job));
+    expected.push_back(hex);
+    algos.push_back(algo);
+  }
+
+  // Group by algorithm so each group can use its batched path.
+  for (HashAlgo algo : {HashAlgo::kSha256, HashAlgo::kXxh3, HashAlgo::kCrc32c}) {
+    std::vector<HashJob> group;
+    std::vector<size_t> index;
+    for (size_t i = 0; i < jobs.size(); ++i) {
+      if (algos[i] == algo) {
+        group.push_back(jobs[i]);
+        index.push_back(i);
+      }
+    }
+    HashJobs(algo, &group);
+    for (size_t k = 0; k < group.size(); ++k) {
+      jobs[index[k]].digest = std::move(group[k].digest);
+    }
+  }
+
+  size_t failed = 0;
+  std::ostringstream out;
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    if (jobs[i].digest.empty()) {
+      out << jobs[i].path << ": FAILED open or read\n";
+      ++failed;
+    } else if (jobs[i].digest != expected[i]) {
+      out << jobs[i].path << ": FAILED\n";
+      ++failed;
+    } else {
+      out << jobs[i].path << ": OK\n";
+    }
+  }
+  std::cout << out.str();
+  std::cout << "Checked " << jobs.size() << " files: " << (jobs.size() - failed) << " OK, " << failed
+            << " failed";
+  if (malformed > 0) {
+    std::cout << ", " << malformed << " malformed lines";
+  }
+  std::cout << "\n";
+}
+
+static void HandleHashCommand(const std::vector<std::string>& tokens) {
+  HashAlgo algo = HashAlgo::kSha256;
+  std::string check_manifest;
+  std::string out_path;
+  std::vector<std::string> args;
+  for (size_t i = 1; i < tokens.size(); ++i) {
+    const std::string& t = tokens[i];
+    if ((t == "-a" || t == "--check" || t == "-o") && i + 1 >= tokens.size()) {
+      std::cout << "Invalid option: hash\n";
+      return;
+    }
+    if (t == "-a") {
+      const std::string name = ToLowerAscii(tokens[++i]);
+      if (name == "sha256") {
+        algo = HashAlgo::kSha256;
+      } else if (name == "xxh3") {
+        algo = HashAlgo::kXxh3;
+      } else if (name == "crc32c") {
+        algo = HashAlgo::kCrc32c;
+      } else {
+        std::cout << "Unknown algorithm: " << tokens[i] << " (sha256, xxh3, crc32c)\n";
+        return;
+      }
+    } else if (t == "--check") {
+      check_manifest = tokens[++i];
+    } else if (t == "-o") {
+      out_path = tokens[++i];
+    } else {
+      args.push_back(t);
+    }
+  }
+  if (!check_manifest.empty()) {
+    CheckHashManifest(check_manifest);
+    return;
+  }
+  if (args.empty()) {
+    std::cout << "Missing target: Please enter 'hash [file|dir...]'\n";
+    return;
+  }
+
+  const std::vector<std::string> targets = ExpandTargets(args);
+  if (targets.empty()) {
+    return;
+  }
+  std::vector<HashJob> jobs;
+  for (const auto& target : targets) {
+    struct stat st;
+    if (::stat(target.c_str(), &st) != 0) {
+      std::cout << "Target not found: " << target << "\n";
+      continue;
+    }
+    if (S_ISREG(st.st_mode)) {
+      jobs.push_back(HashJob{target, static_cast<std::uint64_t>(st.st_size), std::string()});
+      continue;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+      continue;
+    }
+    WalkTree(target, WalkOptions(), [&](WalkDir& dir) {
+      for (const auto& entry : dir.entries) {
+        if (entry.IsFile()) {
+          jobs.push_back(HashJob{entry.path, static_cast<std::uint64_t>(entry.st.st_size), std::string()});
+        }
+      }
+      return WalkAction::kContinue;
+    });
+  }
+
+  HashJobs(algo, &jobs);
+
+  std::ostringstream manifest;
+  size_t written = 0;
+  for (const auto& job : jobs) {
+    if (job.digest.empty()) {
+      std::cout << "Failed to read file: " << job.path << "\n";
+      continue;
+    }
+    manifest << job.digest << "  " << job.path << "\n";
+    ++written;
+  }
+  if (out_path.empty()) {
+    std::cout << manifest.str();
+    return;
+  }
+  std::ofstream out(out_path, std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!(out << manifest.str())) {
+    std::cout << "Invalid target path\n";
+    return;
+  }
+  std::cout << "Wrote " << written << " digests to " << out_path << "\n";
+}
+
+// Copies src into a temporary file next to dst and renames it over dst, so an
+// interrupted copy never leaves a truncated file behind. Permission bits and
+// timestamps are taken from src_st, which lets the next sync recognize the
+// file as unchanged by size and mtime alone.
+static bool CopyFileAtomically(const std::string& src, const std::string& dst,
+                               const struct stat& src_st, std::uint64_t* written) {
+  const TraceSpan span("copy", "copy_file", static_cast<std::uint64_t>(src_st.st_size));
+  static std::atomic<std::uint64_t> counter{0};
+  const auto parts = SplitParentLeaf(dst);
+  const std::string temp = JoinPath(parts.first, "." + parts.second + ".sync-" +
+                                                     std::to_string(::getpid()) + "-" +
+                                                     std::to_string(counter.fetch_add(1)));
+  const int in = ::open(src.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    return false;
+  }
+  const int out = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (out < 0) {
+    ::close(in);
+    return false;
+  }
+  const struct timespec times[2] = {src_st.st_atim, src_st.st_mtim};
+  bool ok = CopyFdData(in, out, static_cast<std::uint64_t>(src_st.st_size), written) &&
+            ::fchmod(out, src_st.st_mode & 07777) == 0 && ::futimens(out, times) == 0;
+  ::close(in);
+  ok = (::close(out) == 0) && ok;
+  if (!ok || ::rename(temp.c_str(), dst.c_str()) != 0) {
+    ::unlink(temp.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Plain copy of src over dst (created with src's permission bits) for cp
+// while a throttle is set.
+static bool CopyFileThrottled(const std::string& src, const std::string& dst) {
+  const int in = ::open(src.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (in < 0 || ::fstat(in, &st) != 0) {
+    if (in >= 0) {
+      ::close(in);
+    }
+    return false;
+  }
+  const int out = ::open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 07777);
+  if (out < 0) {
+    ::close(in);
+    return false;
+  }
+  std::uint64_t copied = 0;
+  const bool ok = CopyFdData(in, out, static_cast<std::uint64_t>(st.st_size), &copied);
+  ::close(in);
+  return (::close(out) == 0) && ok;
+}
+
+// Files at least this large that already exist at the destination are
+// updated in place block by block instead of being rewritten.
+static constexpr std::uint64_t kDeltaMinSize = 16ull << 20;
+static constexpr size_t kDeltaBlock = 4096;          // compare/write granularity
+static constexpr size_t kDeltaChunk = 1 << 20;       // bytes per pread
+static constexpr std::uint64_t kDeltaStripe = 64ull << 20;  // unit of work per worker
+
+static bool PreadFull(int fd, char* buf, size_t n, std::uint64_t offset) {
+  g_io_throttle.Charge(1, n);
+  while (n > 0) {
+    const ssize_t r = ::pread(fd, buf, n, static_cast<off_t>(offset));
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      return false;
+    }
+    buf += r;
+    n -= static_cast<size_t>(r);
+    offset += static_cast<std::uint64_t>(r);
+  }
+  return true;
+}
+
+static bool PwriteAll(int fd, const char* buf, size_t n, std::uint64_t offset) {
+  g_io_throttle.Charge(1, n);
+  while (n > 0) {
+    const ssize_t w = ::pwrite(fd, buf, n, static_cast<off_t>(offset));
+    if (w < 0 && errno == EINTR) {
+      continue;
+    }
+    if (w <= 0) {
+      return false;
+    }
+    buf += w;
+    n -= static_cast<size_t>(w);
+    offset += static_cast<std::uint64_t>(w);
+  }
+  return true;
+}
+
+// Rewrites dst in place so that it equals src, writing only the 4 KiB blocks
+// that differ (adjacent ones coalesced into one pwrite). Both files are read
+// once, in 64 MiB stripes spread over the workers. Growth is appended with
+// copy_file_range and shrinkage truncated. Mode and timestamps are applied
+// last: an interrupted update leaves dst with a fresh mtime, so the next
+// size+mtime comparison still treats it as changed.
+static bool DeltaUpdateFile(const std::string& src, const std::string& dst,
+                            const struct stat& src_st, std::uint64_t* written) {
+  const TraceSpan span("copy", "delta_update", static_cast<std::uint64_t>(src_st.st_size));
+  const int in = ::open(src.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    return false;
+  }
+  const int out = ::open(dst.c_str(), O_RDWR | O_CLOEXEC);
+  struct stat dst_st;
+  if (out < 0 || ::fstat(out, &dst_st) != 0) {
+    ::close(in);
+    if (out >= 0) {
+      ::close(out);
+    }
+    return false;
+  }
+  const auto src_size = static_cast<std::uint64_t>(src_st.st_size);
+  const std::uint64_t common = std::min(src_size, static_cast<std::uint64_t>(dst_st.st_size));
+  const std::uint64_t stripes = (common + kDeltaStripe - 1) / kDeltaStripe;
+
+  std::atomic<std::uint64_t> next{0};
+  std::atomic<std::uint64_t> total{0};
+  std::atomic<bool> ok{true};
+  const size_t worker_count =
+      static_cast<size_t>(std::min<std::uint64_t>(DefaultWorkerCount(), std::max<std::uint64_t>(stripes, 1)));
+  std::vector<std::thread> workers;
+  for (size_t w = 0; w < worker_count; ++w) {
+    workers.emplace_back([&]() {
+      std::vector<char> a(kDeltaChunk);
+      std::vector<char> b(kDeltaChunk);
+      std::uint64_t local = 0;
+      for (std::uint64_t s = next.fetch_add(1); s < stripes && ok; s = next.fetch_add(1)) {
+        const TraceSpan stripe_span("copy", "delta_stripe", s);
+        const std::uint64_t stripe_end = std::min(common, (s + 1) * kDeltaStripe);
+        for (std::uint64_t pos = s * kDeltaStripe; pos < stripe_end && ok; pos += kDeltaChunk) {
+          const size_t n = static_cast<size_t>(std::min<std::uint64_t>(kDeltaChunk, stripe_end - pos));
+          if (!PreadFull(in, a.data(), n, pos) || !PreadFull(out, b.data(), n, pos)) {
+            ok = false;
+            break;
+          }
+          auto block_differs = [&](size_t off) {
+            return std::memcmp(a.data() + off, b.data() + off, std::min(kDeltaBlock, n - off)) != 0;
+          };
+          size_t off = 0;
+          while (off < n && ok) {
+            if (!block_differs(off)) {
+              off += kDeltaBlock;
+              continue;
+            }
+            const size_t run = off;
+            while (off < n && block_differs(off)) {
+              off += kDeltaBlock;
+            }
+            off = std::min(off, n);
+            if (!PwriteAll(out, a.data() + run, off - run, pos + run)) {
+              ok = false;
+            }
+            local += off - run;
+          }
+        }
+      }
+      total += local;
+    });
+  }
+  for (auto& t : workers) {
+    t.join();
+  }
+
+  std::uint64_t appended = 0;
+  bool done = ok.load();
+  if (done && src_size > common) {
+    done = ::lseek(in, static_cast<off_t>(common), SEEK_SET) >= 0 &&
+           ::lseek(out, static_cast<off_t>(common), SEEK_SET) >= 0 &&
+           CopyFdData(in, out, src_size - common, &appended);
+  } else if (done && static_cast<std::uint64_t>(dst_st.st_size) > common) {
+    done = ::ftruncate(out, static_cast<off_t>(common)) == 0;
+  }
+  const struct timespec times[2] = {src_st.st_atim, src_st.st_mtim};
+  done = done && ::fchmod(out, src_st.st_mode & 07777) == 0 && ::futimens(out, times) == 0;
+  ::close(in);
+  done = (::close(out) == 0) && done;
+  *written += total.load() + appended;
+  return done;
+}
+
+// True when dst is a regular file that DeltaUpdateFile should update rather
+// than replace.
+static bool WantsDeltaUpdate(const std::string& dst, const struct stat& src_st) {
+  struct stat st;
+  return static_cast<std::uint64_t>(src_st.st_size) >= kDeltaMinSize &&
+         ::stat(dst.c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+         static_cast<std::uint64_t>(st.st_size) >= kDeltaMinSize;
+}
+
+struct SyncEntry {
+  std::string rel;  // path relative to the tree root
+  struct stat st {};
+};
+
+// Orders paths component by component ('/' sorts before every other byte),
+// so a directory is followed directly by its whole subtree.
+static int ComparePathOrder(const std::string& a, const std::string& b) {
+  const size_t n = std::min(a.size(), b.size());
+  for (size_t k = 0; k < n; ++k) {
+    if (a[k] != b[k]) {
+      const unsigned char x = a[k] == '/' ? 0 : static_cast<unsigned char>(a[k]);
+      const unsigned char y = b[k] == '/' ? 0 : static_cast<unsigned char>(b[k]);
+      return x < y ? -1 : 1;
+    }
+  }
+  return a.size() < b.size() ? -1 : (a.size() > b.size() ? 1 : 0);
+}
+
+// Lists every entry below root (links are not followed) in
+// ComparePathOrder.
+static std::vector<SyncEntry> ListSyncTree(const std::string& root) {
+  std::vector<SyncEntry> out;
+  const size_t prefix = JoinPath(root, "").size();
+  WalkTree(root, WalkOptions{}, [&](WalkDir& dir) {
+    for (const auto& entry : dir.entries) {
+      if (entry.stat_ok) {
+        out.push_back(SyncEntry{entry.path.substr(prefix), entry.st});
+      }
+    }
+    return WalkAction::kContinue;
+  });
+  std::sort(out.begin(), out.end(),
+            [](const SyncEntry& a, const SyncEntry& b) { return ComparePathOrder(a.rel, b.rel) < 0; });
+  return out;
+}
+
+static bool SameFileType(const struct stat& a, const struct stat& b) {
+  return (a.st_mode & S_IFMT) == (b.st_mode & S_IFMT);
+}
+
+// Mirrors src into dst. Both trees are listed concurrently and merge-joined
+// on their sorted relative paths; a file is copied when it is missing or its
+// size or mtime differs (with --checksum: its size or XXH3 digest). Copies
+// run on a worker pool, largest first. --delete removes entries that exist
+// only in dst. An unchanged tree costs the two metadata walks and nothing
+// else.
+static void HandleSyncCommand(const std::vector<std::string>& tokens) {
+  bool remove_extra = false;
+  bool checksum = false;
+  std::vector<std::string> args;
+  for (size_t i = 1; i < tokens.size(); ++i) {
+    if (tokens[i] == "--delete") {
+      remove_extra = true;
+    } else if (tokens[i] == "--checksum" || tokens[i] == "-c") {
+      checksum = true;
+    } else if (tokens[i].size() > 1 && tokens[i][0] == '-') {
+      std::cout << "Invalid option: " << tokens[i] << "\n";
+      return;
+    } else {
+      args.push_back(tokens[i]);
+    }
+  }
+  if (args.size() != 2) {
+    std::cout << "Missing directory: Please enter 'sync [src] [dst]'\n";
+    return;
+  }
+  const std::string& src = args[0];
+  const std::string& dst = args[1];
+
+  struct stat st;
+  if (::stat(src.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+    std::cout << "Directory not found: " << src << "\n";
+    return;
+  }
+  // Neither tree may contain the other, after resolving symbolic links (dst
+  // may not exist yet): syncing into the source recurses, and a source
+  // inside the destination is an "extra" entry for --delete.
+  bool resolved = true;
+  auto resolve = [&resolved](const std::string& path) {
+    std::error_code ec;
+    std::string real = std::filesystem::weakly_canonical(AbsolutePath(path), ec).string();
+    resolved = resolved && !ec;
+    while (real.size() > 1 && real.back() == '/') {
+      real.pop_back();
+    }
+    return real;
+  };
+  const std::string src_abs = resolve(src);
+  const std::string dst_abs = resolve(dst);
+  if (!resolved || dst_abs == src_abs || dst_abs.rfind(JoinPath(src_abs, ""), 0) == 0 ||
+      src_abs.rfind(JoinPath(dst_abs, ""), 0) == 0) {
+    std::cout << "Invalid target path\n";
+    return;
+  }
+  std::unordered_set<std::string> ensured;
+  if (!EnsureDirectoryPath(dst, &ensured) || ::stat(dst.c_str(), &st) != 0 ||
+      !S_ISDIR(st.st_mode)) {
+    std::cout << "Invalid target path\n";
+    return;
+  }
+
+  std::vector<SyncEntry> dst_list;
+  std::thread dst_walker([&dst_list, &dst]() { dst_list = ListSyncTree(dst); });
+  const std::vector<SyncEntry> src_list = ListSyncTree(src);
+  dst_walker.join();
+
+  // Merge-join into a plan. Entries of the destination that are replaced
+  // (type changed) or deleted take their subtree with them.
+  std::vector<const SyncEntry*> replaced;  // removed before anything else
+  std::vector<const SyncEntry*> extra;     // --delete, removed children first
+  std::vector<const SyncEntry*> new_dirs;
+  std::vector<const SyncEntry*> links;
+  std::vector<const SyncEntry*> copies;
+  std::vector<std::pair<const SyncEntry*, const SyncEntry*>> compare;  // --checksum
+  size_t unchanged = 0;
+  std::string gone_prefix;  // dst subtree already scheduled for removal
+
+  auto add_new = [&](const SyncEntry& entry) {
+    if (S_ISDIR(entry.st.st_mode)) {
+      new_dirs.push_back(&entry);
+    } else if (S_ISLNK(entry.st.st_mode)) {
+      links.push_back(&entry);
+    } else if (S_ISREG(entry.st.st_mode)) {
+      copies.push_back(&entry);
+    }
+  };
+
+  size_t i = 0;
+  size_t j = 0;
+  while (i < src_list.size() || j < dst_list.size()) {
+    if (j < dst_list.size() && !gone_prefix.empty() &&
+        dst_list[j].rel.rfind(gone_prefix, 0) == 0) {
+      ++j;
+      continue;
+    }
+    const int order = i == src_list.size()   ? 1
+                      : j == dst_list.size() ? -1
+                                             : ComparePathOrder(src_list[i].rel, dst_list[j].rel);
+    if (order < 0) {
+      add_new(src_list[i++]);
+      continue;
+    }
+    if (order > 0) {
+      if (remove_extra) {
+        extra.push_back(&dst_list[j]);
+      }
+      ++j;
+      continue;
+    }
+    const SyncEntry& s = src_list[i++];
+    const SyncEntry& d = dst_list[j++];
+    if (!SameFileType(s.st, d.st)) {
+      replaced.push_back(&d);
+      if (S_ISDIR(d.st.st_mode)) {
+        gone_prefix = d.rel + "/";
+      }
+      add_new(s);
+    } else if (S_ISREG(s.st.st_mode)) {
+      if (s.st.st_size != d.st.st_size) {
+        copies.push_back(&s);
+      } else if (checksum) {
+        compare.emplace_back(&s, &d);
+      } else if (s.st.st_mtim.tv_sec != d.st.st_mtim.tv_sec ||
+                 s.st.st_mtim.tv_nsec != d.st.st_mtim.tv_nsec) {
+        copies.push_back(&s);
+      } else {
+        ++unchanged;
+      }
+    } else if (S_ISLNK(s.st.st_mode) &&
+               ReadLinkTarget(AT_FDCWD, JoinPath(src, s.rel)) !=
+                   ReadLinkTarget(AT_FDCWD, JoinPath(dst, d.rel))) {
+      replaced.push_back(&d);
+      links.push_back(&s);
+    } else if (!S_ISDIR(s.st.st_mode)) {
+      ++unchanged;
+    }
+  }
+
+  if (!compare.empty()) {
+    std::vector<HashJob> jobs;
+    for (const auto& pair : compare) {
+      jobs.push_back(HashJob{JoinPath(src, pair.first->rel),
+                             static_cast<std::uint64_t>(pair.first->st.st_size), {}});
+      jobs.push_back(HashJob{JoinPath(dst, pair.second->rel),
+                             static_cast<std::uint64_t>(pair.second->st.st_size), {}});
+    }
+    HashJobs(HashAlgo::kXxh3, &jobs);
+    for (size_t k = 0; k < compare.size(); ++k) {
+      if (jobs[2 * k].digest.empty() || jobs[2 * k].digest != jobs[2 * k + 1].digest) {
+        copies.push_back(compare[k].first);
+      } else {
+        ++unchanged;
+      }
+    }
+  }
+
+  std::ostringstream errors;
+  for (const SyncEntry* entry : replaced) {
+    std::error_code ec;
+    std::filesystem::remove_all(JoinPath(dst, entry->rel), ec);
+  }
+  size_t deleted = 0;
+  for (auto it = extra.rbegin(); it != extra.rend(); ++it) {
+    const std::string path = JoinPath(dst, (*it)->rel);
+    const int flags = S_ISDIR((*it)->st.st_mode) ? AT_REMOVEDIR : 0;
+    if (::unlinkat(AT_FDCWD, path.c_str(), flags) == 0) {
+      ++deleted;
+    } else {
+      errors << "Failed to delete: " << path << "\n";
+    }
+  }
+  for (const SyncEntry* entry : new_dirs) {
+    const std::string path = JoinPath(dst, entry->rel);
+    if (::mkdir(path.c_str(), entry->st.st_mode & 07777) != 0 && errno != EEXIST) {
+      errors << "Failed to create directory: " << path << "\n";
+    }
+  }
+  for (const SyncEntry* entry : links) {
+    const std::string path = JoinPath(dst, entry->rel);
+    const std::string target = ReadLinkTarget(AT_FDCWD, JoinPath(src, entry->rel));
+    if (target.empty() || ::symlink(target.c_str(), path.c_str()) != 0) {
+      errors << "Failed to copy: " << path << "\n";
+    }
+  }
+
+  // Largest first, so one big file does not start last and serialize the
+  // tail of the run.
+  std::sort(copies.begin(), copies.end(), [](const SyncEntry* a, const SyncEntry* b) {
+    return a->st.st_size > b->st.st_size;
+  });
+  std::atomic<size_t> next{0};
+  std::atomic<std::uint64_t> bytes{0};
+  std::vector<char> failed(copies.size(), 0);
+  const size_t worker_count = std::min<size_t>(DefaultWorkerCount(), copies.size());
+  std::vector<std::thread> workers;
+  for (size_t w = 0; w < worker_count; ++w) {
+    workers.emplace_back([&]() {
+      std::uint64_t local = 0;
+      for (size_t k = next.fetch_add(1); k < copies.size(); k = next.fetch_add(1)) {
+        const SyncEntry& entry = *copies[k];
+        const std::string from = JoinPath(src, entry.rel);
+        const std::string to = JoinPath(dst, entry.rel);
+        const bool done = WantsDeltaUpdate(to, entry.st)
+                              ? DeltaUpdateFile(from, to, entry.st, &local)
+                              : CopyFileAtomically(from, to, entry.st, &local);
+        if (!done) {
+          failed[k] = 1;
+        }
+      }
+      bytes += local;
+    });
+  }
+  for (auto& t : workers) {
+    t.join();
+  }
+  size_t copied = 0;
+  for (size_t k = 0; k < copies.size(); ++k) {
+    if (failed[k] != 0) {
+      errors << "Failed to copy: " << JoinPath(dst, copies[k]->rel) << "\n";
+    } else {
+      ++copied;
+    }
+  }
+
+  std::cout << errors.str();
+  std::cout << "Synced " << src << " -> " << dst << ": " << copied << " copied (" << bytes.load()
+            << " bytes written), " << deleted << " deleted, " << unchanged << " unchanged\n";
+}
+
+static void HandleCpCommand(const std::vector<std::string>& tokens) {
+  if (tokens.size() < 3) {
+    std::cout << "Invalid target path\n";
+    return;
+  }
+
+  namespace fs = std::filesystem;
+  const fs::path src = fs::path(tokens[1]);
+  const fs::path dst_arg = fs::path(tokens[2]);
+
+  std::error_code ec;
+  if (!fs::exists(src, ec) || ec || !fs::is_regular_file(src, ec) || ec) {
+    std::cout << "Source not found\n";
+    return;
+  }
+
+  fs::path dst_file = dst_arg;
+  if (fs::exists(dst_arg, ec) && !ec && fs::is_directory(dst_arg, ec) && !ec) {
+    dst_file = dst_arg / src.filename();
+  }
+
+  fs::path parent = dst_file.parent_path();
+  if (parent.empty()) {
+    parent = fs::path(".");
+  }
+  if (!fs::exists(parent, ec) || ec || !fs::is_directory(parent, ec) || ec) {
+    std::cout << "Invalid target path\n";
+    return;
+  }
+  if (fs::exists(dst_file, ec) && !ec && fs::is_directory(dst_file, ec) && !ec) {
+    std::cout << "Invalid target path\n";
+    return;
+  }
+
+  fs::copy_options options = fs::copy_options::none;
+  if (fs::exists(dst_file, ec) && !ec) {
+    std::cout << "File exists in target: Overwrite? (y/n)" << std::flush;
+    std::string confirm;
+    if (!std::getline(std::cin, confirm)) {
+      return;
+    }
+    if (confirm != "y") {
+      return;
+    }
+    options = fs::copy_options::overwrite_existing;
+  }
+
+  struct stat src_st;
+  if (options == fs::copy_options::overwrite_existing &&
+      ::stat(src.c_str(), &src_st) == 0 && WantsDeltaUpdate(dst_file.string(), src_st)) {
+    std::uint64_t written = 0;
+    const bool updated = DeltaUpdateFile(src.string(), dst_file.string(), src_st, &written);
+    JournalOperation(JournalOp::kCp, src.string(), dst_file.string(), updated ? 0 : errno);
+    if (!updated) {
+      std::cout << "Invalid target path\n";
+      return;
+    }
+    std::cout << "Updated in place: " << written << " of " << src_st.st_size
+              << " bytes written\n";
+    return;
+  }
+
+  bool copied = false;
+  int error = 0;
+  if (g_io_throttle.active()) {
+    // fs::copy_file cannot be paced; copy through the throttled loop.
+    copied = CopyFileThrottled(src.string(), dst_file.string());
+    error = copied ? 0 : errno;
+  } else {
+    copied = fs::copy_file(src, dst_file, options, ec) && !ec;
+    error = copied ? 0 : (ec ? ec.value() : EIO);
+  }
+  JournalOperation(JournalOp::kCp, src.string(), dst_file.string(), error);
+  if (!copied) {
+    std::cout << "Invalid target path\n";
+  }
+}
+
+static void HandleMvCommand(const std::vector<std::string>& tokens) {
+  if (tokens.size() < 3) {
+    std::cout << "Invalid target path\n";
+    return;
+  }
+
+  namespace fs = std::filesystem;
+  const fs::path src = fs::path(tokens[1]);
+  const fs::path dst_arg = fs::path(tokens[2]);
+
+  struct stat src_st;
+  struct stat st;
+  if (!g_vfs->StatAt(AT_FDCWD, src.string(), true, &src_st)) {
+    std::cout << "Source not found\n";
+    return;
+  }
+
+  fs::path dst_final = dst_arg;
+  if (g_vfs->StatAt(AT_FDCWD, dst_arg.string(), true, &st) && S_ISDIR(st.st_mode)) {
+    dst_final = dst_arg / src.filename();
+  }
+
+  fs::path parent = dst_final.parent_path();
+  if (parent.empty()) {
+    parent = fs::path(".");
+  }
+  if (!g_vfs->StatAt(AT_FDCWD, parent.string(), true, &st) || !S_ISDIR(st.st_mode)) {
+    std::cout << "Invalid target path\n";
+    return;
+  }
+  if (g_vfs->StatAt(AT_FDCWD, dst_final.string(), true, &st)) {
+    std::cout << "Invalid target path\n";
+    return;
+  }
+
+  if (g_vfs->RenameAt(AT_FDCWD, src.string(), AT_FDCWD, dst_final.string(), false)) {
+    JournalOperation(JournalOp::kMv, src.string(), dst_final.string(), 0);
+    RecordMove(src.string(), dst_final.string());
+    return;
+  }
+
+  // Across filesystems a regular file is copied, then removed.
+  if (errno == EXDEV && g_vfs->Posix() && S_ISREG(src_st.st_mode)) {
+    std::error_code copy_ec;
+    std::error_code remove_ec;
+    const bool moved = fs::copy_file(src, dst_final, fs::copy_options::none, copy_ec) &&
+                       !copy_ec && fs::remove(src, remove_ec) && !remove_ec;
+    const std::error_code& ec = copy_ec ? copy_ec : remove_ec;
+    JournalOperation(JournalOp::kMv, src.string(), dst_final.string(),
+                     moved ? 0 : (ec ? ec.value() : EIO));
+    if (!moved) {
+      std::cout << "Invalid target path\n";
+      return;
+    }
+    RecordMove(src.string(), dst_final.string());
+    return;
+  }
+
+  JournalOperation(JournalOp::kMv, src.string(), dst_final.string(), errno);
+  std::cout << "Invalid target path\n";
+}
+
+struct SedSubstitution {
+  std::regex pattern;
+  std::string format;
+  bool global = false;
+};
+
+// Parses "s/old/new/[gi]" (any delimiter). The replacement accepts the
+// ECMAScript $1..$9 and $& as well as sed-style \1..\9 and &.
+static bool ParseSedSubstitution(const std::string& expr, SedSubstitution* out,
+                                 std::string* error) {
+  if (expr.size() < 4 || expr[0] != 's') {
+    *error = "expected s/old/new/[flags]";
+    return false;
+  }
+  const char delim = expr[1];
+  std::vector<std::string> parts(1);
+  for (size_t i = 2; i < expr.size(); ++i) {
+    if (expr[i] == '\\' && i + 1 < expr.size() && expr[i + 1] == delim) {
+      parts.back().push_back(delim);
+      ++i;
+    } else if (expr[i] == delim) {
+      parts.emplace_back();
+    } else {
+      parts.back().push_back(expr[i]);
+    }
+  }
+  if (parts.size() != 3) {
+    *error = "expected s/old/new/[flags]";
+    return false;
+  }
+  auto syntax = std::regex::ECMAScript;
+  for (char flag : parts[2]) {
+    if (flag == 'g') {
+      out->global = true;
+    } else if (flag == 'i') {
+      syntax |= std::regex::icase;
+    } else {
+      *error = std::string("unknown flag '") + flag + "'";
+      return false;
+    }
+  }
+  try {
+    out->pattern = std::regex(parts[0], syntax);
+  } catch (const std::regex_error&) {
+    *error = "invalid pattern '" + parts[0] + "'";
+    return false;
+  }
+  const std::string& repl = parts[1];
+  for (size_t i = 0; i < repl.size(); ++i) {
+    if (repl[i] == '\\' && i + 1 < repl.size()) {
+      const char next = repl[++i];
+      if (next >= '1' && next <= '9') {
+        out->format += '$';
+      }
+      out->format += next;
+    } else if (repl[i] == '&') {
+      out->format += "$&";
+    } else {
+      out->format += repl[i];
+    }
+  }
+  return true;
+}
+
+struct RenameOp {
+  std::string dir;
+  std::string from;
+  std::string to;
+};
+
+// Applies the substitution to the last path component of every target. The
+// whole plan is validated before anything is renamed: duplicate targets and
+// targets that exist (and are not renamed away themselves) abort the batch.
+// Chains are ordered so that each name is freed before it is reused, and
+// cycles (a->b, b->a) are broken through a temporary name.
+static void HandleRenameCommand(const std::vector<std::string>& tokens) {
+  bool dry_run = false;
+  bool assume_yes = false;
+  std::vector<std::string> args;
+  for (size_t i = 1; i < tokens.size(); ++i) {
+    if (tokens[i] == "-n" || tokens[i] == "--dry-run") {
+      dry_run = true;
+    } else if (tokens[i] == "-y") {
+      assume_yes = true;
+    } else {
+      args.push_back(tokens[i]);
+    }
+  }
+  if (args.size() < 2) {
+    std::cout << "Missing arguments: Please enter 'rename s/old/new/ [name...]'\n";
+    return;
+  }
+  SedSubstitution sub;
+  std::string error;
+  if (!ParseSedSubstitution(args[0], &sub, &error)) {
+    std::cout << "Invalid expression: " << error << "\n";
+    return;
+  }
+
+  const auto flags = sub.global ? std::regex_constants::format_default
+                                : std::regex_constants::format_first_only;
+  std::vector<RenameOp> ops;
+  std::unordered_set<std::string> seen_sources;
+  const std::vector<std::string> targets =
+      ExpandTargets(std::vector<std::string>(args.begin() + 1, args.end()));
+  if (targets.empty()) {
+    return;
+  }
+  for (const auto& target : targets) {
+    auto [dir, leaf] = SplitParentLeaf(target);
+    dir = std::filesystem::path(dir.empty() ? "." : dir).lexically_normal().string();
+    struct stat st;
+    if (leaf.empty() || !g_vfs->StatAt(AT_FDCWD, target, false, &st)) {
+      std::cout << "Target not found: " << target << "\n";
+      continue;
+    }
+    std::string renamed = std::regex_replace(leaf, sub.pattern, sub.format, flags);
+    if (renamed == leaf || !seen_sources.insert(JoinPath(dir, leaf)).second) {
+      continue;
+    }
+    if (renamed.empty() || renamed == "." || renamed == ".." ||
+        renamed.find('/') != std::string::npos) {
+      std::cout << "Invalid new name for " << target << ": '" << renamed << "'\n";
+      return;
+    }
+    ops.push_back(RenameOp{dir, leaf, renamed});
+  }
+  if (ops.empty()) {
+    std::cout << "Nothing to rename\n";
+    return;
+  }
+
+  std::unordered_map<std::string, size_t> by_source;
+  std::unordered_map<std::string, size_t> by_target;
+  for (size_t i = 0; i < ops.size(); ++i) {
+    by_source.emplace(JoinPath(ops[i].dir, ops[i].from), i);
+  }
+  size_t conflicts = 0;
+  for (size_t i = 0; i < ops.size(); ++i) {
+    const std::string key = JoinPath(ops[i].dir, ops[i].to);
+    auto [it, inserted] = by_target.emplace(key, i);
+    if (!inserted) {
+      std::cout << "Rename conflict: " << JoinPath(ops[it->second].dir, ops[it->second].from)
+                << " and " << JoinPath(ops[i].dir, ops[i].from) << " -> " << key << "\n";
+      ++conflicts;
+      continue;
+    }
+    struct stat st;
+    if (by_source.count(key) == 0 && g_vfs->StatAt(AT_FDCWD, key, false, &st)) {
+      std::cout << "Target exists: " << JoinPath(ops[i].dir, ops[i].from) << " -> " << key << "\n";
+      ++conflicts;
+    }
+  }
+  if (conflicts > 0) {
+    std::cout << "Aborted: " << conflicts << " conflicts, nothing renamed\n";
+    return;
+  }
+
+  std::ostringstream plan;
+  for (const auto& op : ops) {
+    plan << JoinPath(op.dir, op.from) << " -> " << JoinPath(op.dir, op.to) << "\n";
+  }
+  std::cout << plan.str();
+  if (dry_run) {
+    std::cout << ops.size() << " renames planned (dry run)\n";
+    return;
+  }
+  if (!assume_yes) {
+    std::cout << "Apply " << ops.size() << " renames? (y/n)" << std::flush;
+    std::string confirm;
+    if (!std::getline(std::cin, confirm) || confirm != "y") {
+      return;
+    }
+  }
+
+  // Each op waits for at most one other (the op whose source is its target)
+  // and is waited for by at most one (the op that targets its source), so
+  // the ops form chains and cycles. An op is ready once no pending op still
+  // uses its target as a source; a failed op fails everything waiting for it.
+  DirFdCache cache;
+  enum class State { kPending, kDone, kFailed };
+  std::vector<State> state(ops.size(), State::kPending);
+  std::vector<std::string> parked_as(ops.size());  // temporary name while parked
+  std::vector<size_t> ready;
+  for (size_t i = 0; i < ops.size(); ++i) {
+    if (by_source.count(JoinPath(ops[i].dir, ops[i].to)) == 0) {
+      ready.push_back(i);
+    }
+  }
+  // The op targeting i's original name, or ops.size().
+  auto waiter = [&](size_t i) {
+    const auto it = by_target.find(JoinPath(ops[i].dir, ops[i].from));
+    return it == by_target.end() ? ops.size() : it->second;
+  };
+  size_t renamed = 0;
+  size_t failed = 0;
+  auto fail = [&](size_t i) {
+    for (size_t j = i; j < ops.size() && state[j] == State::kPending; j = waiter(j)) {
+      state[j] = State::kFailed;
+      ++failed;
+      const RenameOp& op = ops[j];
+      if (j != i) {
+        std::cout << "Skipped " << JoinPath(op.dir, op.from) << " -> " << JoinPath(op.dir, op.to)
+                  << ": waits for a failed rename\n";
+      }
+      if (!parked_as[j].empty() && !RenameNoReplace(cache.Get(op.dir), parked_as[j], op.from)) {
+        std::cout << "Left " << JoinPath(op.dir, op.from) << " as "
+                  << JoinPath(op.dir, parked_as[j]) << "\n";
+      }
+    }
+  };
+
+  size_t next_cycle_scan = 0;
+  size_t temp_counter = 0;
+  while (true) {
+    if (ready.empty()) {
+      while (next_cycle_scan < ops.size() &&
+             (state[next_cycle_scan] != State::kPending || !parked_as[next_cycle_scan].empty())) {
+        ++next_cycle_scan;
+      }
+      if (next_cycle_scan == ops.size()) {
+        break;
+      }
+      // Every op still pending is on a cycle: park one source under a
+      // temporary name, which frees its slot for the op that targets it.
+      // The cycle then unwinds back to the parked op.
+      const size_t i = next_cycle_scan;
+      const RenameOp& op = ops[i];
+      const std::string temp =
+          ".rename-" + std::to_string(::getpid()) + "-" + std::to_string(temp_counter++);
+      if (!RenameNoReplace(cache.Get(op.dir), op.from, temp)) {
+        std::cout << "Failed to rename " << JoinPath(op.dir, op.from) << "\n";
+        fail(i);
+        continue;
+      }
+      parked_as[i] = temp;
+      const size_t w = waiter(i);
+      if (w < ops.size() && state[w] == State::kPending) {
+        ready.push_back(w);
+      }
+      continue;
+    }
+    const size_t i = ready.back();
+    ready.pop_back();
+    if (state[i] != State::kPending) {
+      continue;
+    }
+    const RenameOp& op = ops[i];
+    const std::string& source = parked_as[i].empty() ? op.from : parked_as[i];
+    if (!RenameNoReplace(cache.Get(op.dir), source, op.to)) {
+      std::cout << "Failed to rename " << JoinPath(op.dir, op.from) << " -> "
+                << JoinPath(op.dir, op.to) << "\n";
+      fail(i);
+      continue;
+    }
+    state[i] = State::kDone;
+    ++renamed;
+    const size_t w = waiter(i);
+    if (w < ops.size() && state[w] == State::kPending) {
+      ready.push_back(w);
+    }
+  }
+  // Parked ops always unwind with their cycle; this only guards against
+  // leaving a temporary name behind if they somehow did not.
+  for (size_t i = 0; i < ops.size(); ++i) {
+    if (state[i] == State::kPending) {
+      fail(i);
+    }
+  }
+  std::cout << "Renamed " << renamed << " entries";
+  if (failed > 0) {
+    std::cout << " (" << failed << " failed)";
+  }
+  std::cout << "\n";
+}
+
+// Human-readable size with one decimal in binary units ("12.3 MB").
+static std::string FormatBytes(std::uint64_t bytes) {
+  static const char* const kUnits[] = {"B", "KB", "MB", "GB", "TB", "PB"};
+  double value = static_cast<double>(bytes);
+  size_t unit = 0;
+  while (value >= 1024.0 && unit + 1 < sizeof(kUnits) / sizeof(kUnits[0])) {
+    value /= 1024.0;
+    ++unit;
+  }
+  std::ostringstream out;
+  if (unit == 0) {
+    out << bytes << " B";
+  } else {
+    out << std::fixed << std::setprecision(1) << value << " " << kUnits[unit];
+  }
+  return out.str();
+}
+
+// Bytes counted by one walk worker, padded to a cache line.
+struct alignas(64) WorkerBytes {
+  std::uintmax_t bytes = 0;
+};
+
+// Adds the sizes of the files below dir_path to the per-worker totals,
+// listing with one worker per element. Returns false if the walk was
+// stopped (a checkpointed du interrupted by Ctrl-C).
+static bool SumDirectorySizeBytes(const std::string& dir_path, const WalkOptions& options,
+                                  std::vector<WorkerBytes>* per_worker) {
+  std::mutex counted_mu;
+  DevInoSet counted_files;
+  const auto workers = static_cast<unsigned>(per_worker->size());
+  return ParallelWalkTree(dir_path, options, workers, [&](WalkDir& dir, unsigned worker) {
+    std::uintmax_t& bytes = (*per_worker)[worker].bytes;
+    for (const auto& entry : dir.entries) {
+      if (!entry.IsFile()) {
+        continue;
+      }
+      if (options.links == LinkPolicy::kLogical) {
+        std::lock_guard<std::mutex> lock(counted_mu);
+        if (!counted_files.Insert(entry.st.st_dev, entry.st.st_ino)) {
+          continue;
+        }
+      }
+      bytes += static_cast<std::uintmax_t>(entry.st.st_size);
+    }
+    return WalkAction::kContinue;
+  });
+}
+
+static std::uintmax_t SumWorkerBytes(const std::vector<WorkerBytes>& per_worker) {
+  std::uintmax_t total = 0;
+  for (const auto& w : per_worker) {
+    total += w.bytes;
+  }
+  return total;
+}
+
+// Sums regular file sizes below dir_path. Under -L every file is counted once
+// per (dev, inode), however many links lead to it.
+// Used for every row of "ls -s", so it lists on the calling thread.
+static std::uintmax_t CalculateDirectorySizeBytes(const std::string& dir_path,
+                                                 LinkPolicy links) {
+  std::vector<WorkerBytes> per_worker(1);
+  WalkOptions options;
+  options.links = links;
+  SumDirectorySizeBytes(dir_path, options, &per_worker);
+  return per_worker[0].bytes;
+}
+
+// Approximate du ("du --approx"), after Knuth's estimator for search trees.
+// A probe walks one random path down from the root, choosing uniformly among
+// the subdirectories at every level. A directory reached through choices
+// among k1, k2, ... subdirectories stands in for k1*k2*... directories, so
+// the probe adds its file bytes and file count with that weight. Each probe
+// is an unbiased estimate of the totals. Probes run in doubling rounds until
+// the 95% confidence interval of their mean is within the requested
+// relative error. Listings are cached, so the top levels are read only once
+// however many probes pass through them. Skewed trees (one huge directory
+// deep down) need many probes, and their interval may be optimistic until
+// a probe has found the heavy subtree.
+class DirectorySizeEstimator {
+ public:
+  explicit DirectorySizeEstimator(std::string root) : root_(std::move(root)), rng_(std::random_device{}()) {}
+
+  // Runs probes until the interval for the byte total is within error
+  // (a fraction) or every directory has been listed. Progress lines go to
+  // std::cout after each round.
+  void Run(double error) {
+    for (std::uint64_t round = kFirstRound; probes_ < kMaxProbes; round *= 2) {
+      for (std::uint64_t i = 0; i < round && !Exact(); ++i) {
+        Probe();
+      }
+      if (Exact()) {
+        return;
+      }
+      const Estimate bytes = Summarize(bytes_);
+      if (!bytes.converged && !listed_remaining_) {
+        // Every probe agreed (often: all saw nothing), which says nothing
+        // about the spread. While the tree is small, list it instead.
+        ListRemaining();
+        if (Exact()) {
+          return;
+        }
+      }
+      std::cout << "  " << probes_ << " probes, " << cache_.size()
+                << " directories listed: " << FormatBytes(static_cast<std::uint64_t>(bytes.mean))
+                << " +/- " << FormatRelative(bytes) << "\n";
+      if (bytes.converged && bytes.relative <= error) {
+        return;
+      }
+    }
+  }
+
+  void Report(const std::string& name) const {
+    if (Exact()) {
+      std::uint64_t total = 0;
+      std::uint64_t files = 0;
+      for (const auto& item : cache_) {
+        total += item.second.file_bytes;
+        files += item.second.files;
+      }
+      std::cout << "Total size of " << name << ": " << FormatBytes(total) << " in " << files
+                << " files (exact: all " << cache_.size() << " directories were listed)\n";
+      return;
+    }
+    const Estimate bytes = Summarize(bytes_);
+    const Estimate files = Summarize(files_);
+    if (!bytes.converged) {
+      std::cout << "Estimated size of " << name << ": "
+                << FormatBytes(static_cast<std::uint64_t>(bytes.mean))
+                << " (no interval: all probes gave the same total), about "
+                << static_cast<std::uint64_t>(files.mean + 0.5) << " files\n";
+      std::cout << "Sampled " << cache_.size() << " directories (" << entries_
+                << " entries) in " << probes_ << " random descents\n";
+      return;
+    }
+    const double low = std::max(0.0, bytes.mean - bytes.half_width);
+    std::cout << "Estimated size of " << name << ": "
+              << FormatBytes(static_cast<std::uint64_t>(bytes.mean)) << " +/- "
+              << FormatPercent(bytes.relative) << " (95% interval "
+              << FormatBytes(static_cast<std::uint64_t>(low)) << " - "
+              << FormatBytes(static_cast<std::uint64_t>(bytes.mean + bytes.half_width))
+              << "), about " << static_cast<std::uint64_t>(files.mean + 0.5) << " files +/- "
+              << FormatRelative(files) << "\n";
+    std::cout << "Sampled " << cache_.size() << " directories (" << entries_
+              << " entries) in " << probes_ << " random descents\n";
+  }
+
+ private:
+  static constexpr std::uint64_t kFirstRound = 64;
+  static constexpr std::uint64_t kMaxProbes = 1ull << 22;
+  static constexpr double kZ95 = 1.96;
+  static constexpr size_t kListAllLimit = 1 << 16;  // directories
+
+  struct Listing {
+    std::uint64_t file_bytes = 0;
+    std::uint64_t files = 0;
+    std::vector<std::string> subdirs;  // not symbolic links
+  };
+
+  // Sum and sum of squares of the per-probe estimates.
+  struct Moments {
+    double sum = 0;
+    double sum_sq = 0;
+  };
+
+  struct Estimate {
+    double mean = 0;
+    double half_width = 0;  // of the 95% interval
+    double relative = 0;    // half_width / mean
+    // False while the probes show no spread (zero mean or zero variance):
+    // a 0-width interval from them would be meaningless.
+    bool converged = false;
+  };
+
+  // Every directory has been listed once no discovered subdirectory is left
+  // unlisted (a physical tree reaches each directory through one parent).
+  bool Exact() const { return !cache_.empty() && subdirs_seen_ + 1 == cache_.size(); }
+
+  const Listing& Lookup(const std::string& path) {
+    const auto it = cache_.find(path);
+    if (it != cache_.end()) {
+      return it->second;
+    }
+    Listing listing;
+    std::vector<WalkEntry> entries;
+    ReadDirectory(path, LinkPolicy::kPhysical, &entries);
+    entries_ += entries.size();
+    for (auto& entry : entries) {
+      if (entry.IsFile()) {
+        listing.file_bytes += static_cast<std::uint64_t>(entry.st.st_size);
+        ++listing.files;
+      } else if (entry.IsDir()) {
+        listing.subdirs.push_back(std::move(entry.path));
+      }
+    }
+    subdirs_seen_ += listing.subdirs.size();
+    return cache_.emplace(path, std::move(listing)).first->second;
+  }
+
+  void Probe() {
+    double weight = 1;
+    double bytes = 0;
+    double files = 0;
+    const Listing* dir = &Lookup(root_);
+    while (true) {
+      bytes += weight * static_cast<double>(dir->file_bytes);
+      files += weight * static_cast<double>(dir->files);
+      if (dir->subdirs.empty()) {
+        break;
+      }
+      const size_t k = dir->subdirs.size();
+      weight *= static_cast<double>(k);
+      dir = &Lookup(dir->subdirs[static_cast<size_t>(rng_() % k)]);
+    }
+    bytes_.sum += bytes;
+    bytes_.sum_sq += bytes * bytes;
+    files_.sum += files;
+    files_.sum_sq += files * files;
+    ++probes_;
+  }
+
+  Estimate Summarize(const Moments& m) const {
+    Estimate e;
+    const auto n = static_cast<double>(probes_);
+    if (probes_ < 2) {
+      return e;
+    }
+    e.mean = m.sum / n;
+    const double variance = std::max(0.0, (m.sum_sq - n * e.mean * e.mean) / (n - 1));
+    e.half_width = kZ95 * std::sqrt(variance / n);
+    e.converged = e.mean > 0 && variance > 0;
+    e.relative = e.converged ? e.half_width / e.mean : 0;
+    return e;
+  }
+
+  // Lists every directory the probes have not reached, depth first, until
+  // the cache holds kListAllLimit directories.
+  void ListRemaining() {
+    listed_remaining_ = true;
+    std::vector<std::string> stack{root_};
+    while (!stack.empty() && cache_.size() < kListAllLimit) {
+      const std::string path = std::move(stack.back());
+      stack.pop_back();
+      const Listing& dir = Lookup(path);
+      stack.insert(stack.end(), dir.subdirs.begin(), dir.subdirs.end());
+    }
+  }
+
+  static std::string FormatRelative(const Estimate& e) {
+    return e.converged ? FormatPercent(e.relative) : "?";
+  }
+
+  static std::string FormatPercent(double fraction) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1) << fraction * 100 << "%";
+    return out.str();
+  }
+
+  std::string root_;
+  std::mt19937_64 rng_;
+  std::unordered_map<std::string, Listing> cache_;
+  std::uint64_t subdirs_seen_ = 0;
+  std::uint64_t entries_ = 0;
+  std::uint64_t probes_ = 0;
+  bool listed_remaining_ = false;
+  Moments bytes_;
+  Moments files_;
+};
+
+static void HandleDuCommand(const std::vector<std::string>& tokens) {
+  LinkPolicy links = LinkPolicy::kPhysical;
+  bool resume = false;
+  bool approx = false;
+  bool show_stats = false;
+  double error = 0.05;
+  std::vector<std::string> args;
+  for (size_t i = 1; i < tokens.size(); ++i) {
+    if (tokens[i] == "--resume") {
+      resume = true;
+    } else if (tokens[i] == "--stats") {
+      show_stats = true;
+    } else if (tokens[i] == "--approx") {
+      approx = true;
+    } else if (tokens[i] == "--error") {
+      // "5%" or "5": percent of the estimate
+      char* end = nullptr;
+      const double percent = i + 1 < tokens.size() ? std::strtod(tokens[i + 1].c_str(), &end) : 0;
+      if (end == nullptr || end == tokens[i + 1].c_str() || (*end != '\0' && std::strcmp(end, "%") != 0) ||
+          !(percent > 0 && percent < 100)) {
+        std::cout << "Invalid option: --error\n";
+        return;
+      }
+      error = percent / 100;
+      approx = true;
+      ++i;
+    } else if (!ParseLinkPolicyFlag(tokens[i], &links)) {
+      args.push_back(tokens[i]);
+    }
+  }
+  if (args.empty()) {
+    std::cout << "Missing directory name: Please enter 'du [name]'\n";
+    return;
+  }
+  if (approx && (resume || links != LinkPolicy::kPhysical)) {
+    std::cout << "Invalid option: --approx samples a physical walk and cannot be resumed\n";
+    return;
+  }
+
+  const std::string& arg = args[0];
+  struct stat st;
+  if (!g_vfs->StatAt(AT_FDCWD, arg, true, &st) || !S_ISDIR(st.st_mode)) {
+    std::cout << "Invalid directory: " << arg << "\n";
+    return;
+  }
+
+  if (approx) {
+    DirectorySizeEstimator estimator(arg);
+    estimator.Run(error);
+    estimator.Report(arg);
+    return;
+  }
+
+  WalkOptions options;
+  options.links = links;
+  std::unique_ptr<WalkCheckpointer> checkpoint;
+  std::vector<std::string> saved;
+  // Walk the absolute path so a saved frontier does not depend on the
+  // working directory.
+  const std::string root = AbsolutePath(arg);
+  if (!PrepareWalkCheckpoint("du\n" + root, resume, "du " + arg, &options,
+                             &checkpoint, &saved)) {
+    return;
+  }
+  std::uintmax_t resumed_bytes = 0;
+  if (saved.size() == 1) {
+    resumed_bytes = std::strtoull(saved[0].c_str(), nullptr, 10);
+  }
+  std::vector<WorkerBytes> per_worker(WalkWorkerCount());
+  if (checkpoint) {
+    options.checkpoint = checkpoint->Hook([&]() {
+      return std::vector<std::string>{std::to_string(resumed_bytes + SumWorkerBytes(per_worker))};
+    });
+  }
+  WalkStats walk_stats;
+  if (show_stats) {
+    options.stats = &walk_stats;
+  }
+  if (!SumDirectorySizeBytes(root, options, &per_worker)) {
+    checkpoint->ReportInterrupted("du --resume " + arg);
+    return;
+  }
+  if (checkpoint) {
+    checkpoint->Finish();
+  }
+  const std::uintmax_t bytes = resumed_bytes + SumWorkerBytes(per_worker);
+  const std::uintmax_t kb = 1024;
+  const std::uintmax_t mb = 1024 * 1024;
+  if (bytes >= mb) {
+    std::cout << "Total size of " << arg << ": " << (bytes + (mb / 2)) / mb << " MB\n";
+  } else {
+    std::cout << "Total size of " << arg << ": " << (bytes + (kb / 2)) / kb << " KB\n";
+  }
+  if (show_stats) {
+    PrintWalkStats(walk_stats);
+  }
+}
+
+// Keeps the n items with the largest keys in a min-heap, so offering an item
+// that does not qualify costs one comparison. Workers keep one each and the
+// caller merges them.
+template <typename T>
+class TopN {
+ public:
+  explicit TopN(size_t n) : n_(n) {}
+
+  bool Wants(std::uint64_t key) const {
+    return n_ > 0 && (heap_.size() < n_ || key > heap_.front().first);
+  }
+
+  void Push(std::uint64_t key, T value) {
+    if (!Wants(key)) {
+      return;
+    }
+    heap_.emplace_back(key, std::move(value));
+    std::push_heap(heap_.begin(), heap_.end(), Greater);
+    if (heap_.size() > n_) {
+      std::pop_heap(heap_.begin(), heap_.end(), Greater);
+      heap_.pop_back();
+    }
+  }
+
+  void Merge(TopN&& other) {
+    for (auto& item : other.heap_) {
+      Push(item.first, std::move(item.second));
+    }
+    other.heap_.clear();
+  }
+
+  // Largest first.
+  std::vector<std::pair<std::uint64_t, T>> Sorted() const {
+    auto items = heap_;
+    std::sort(items.begin(), items.end(), Greater);
+    return items;
+  }
+
+ private:
+  static bool Greater(const std::pair<std::uint64_t, T>& a, const std::pair<std::uint64_t, T>& b) {
+    return a.first > b.first;
+  }
+
+  size_t n_;
+  std::vector<std::pair<std::uint64_t, T>> heap_;
+};
+
+struct CountBytes {
+  std::uint64_t count = 0;
+  std::uint64_t bytes = 0;
+
+  void Add(std::uint64_t size) {
+    ++count;
+    bytes += size;
+  }
+  void Merge(const CountBytes& other) {
+    count += other.count;
+    bytes += other.bytes;
+  }
+};
+
+static constexpr int kAgeBuckets = 7;
+static const char* const kAgeLabels[kAgeBuckets] = {"< 1 day",    "< 1 week", "< 1 month",
+                                                    "< 6 months", "< 1 year", "< 3 years",
+                                                    ">= 3 years"};
+
+static int AgeBucket(std::time_t now, std::time_t t) {
+  static const std::int64_t kLimits[kAgeBuckets - 1] = {
+      86400, 7 * 86400, 30 * 86400, 182 * 86400, 365 * 86400, 3 * 365 * 86400};
+  const std::int64_t age = static_cast<std::int64_t>(now) - static_cast<std::int64_t>(t);
+  int bucket = 0;
+  while (bucket < kAgeBuckets - 1 && age >= kLimits[bucket]) {
+    ++bucket;
+  }
+  return bucket;
+}
+
+// "512 B", "4 KB", "1 GB": exact label for the power of two 2^shift.
+static std::string Pow2Label(int shift) {
+  static const char* const kUnits[] = {"B", "KB", "MB", "GB", "TB", "PB", "EB"};
+  return std::to_string(std::uint64_t{1} << (shift % 10)) + " " + kUnits[shift / 10];
+}
+
+// Histogram bucket for a size: 0 for empty files, k for [2^(k-1), 2^k).
+static int Log2Bucket(std::uint64_t size) {
+  int bucket = 0;
+  while (size != 0) {
+    size >>= 1;
+    ++bucket;
+  }
+  return bucket;
+}
+
+// Everything analyze collects; each walk worker fills its own copy.
+struct TreeStats {
+  explicit TreeStats(size_t top) : largest(top), deepest(top), widest(top) {}
+
+  std::uint64_t files = 0;
+  std::uint64_t dirs = 0;
+  std::uint64_t others = 0;  // links, sockets, devices, ...
+  std::uint64_t bytes = 0;
+  std::unordered_map<std::string, CountBytes> by_ext;
+  CountBytes size_hist[65];
+  CountBytes mtime_hist[kAgeBuckets];
+  CountBytes atime_hist[kAgeBuckets];
+  TopN<std::string> largest;
+  TopN<std::string> deepest;
+  TopN<std::string> widest;  // directories by entry count
+
+  void Merge(TreeStats&& other) {
+    files += other.files;
+    dirs += other.dirs;
+    others += other.others;
+    bytes += other.bytes;
+    for (const auto& kv : other.by_ext) {
+      by_ext[kv.first].Merge(kv.second);
+    }
+    for (int i = 0; i < 65; ++i) {
+      size_hist[i].Merge(other.size_hist[i]);
+    }
+    for (int i = 0; i < kAgeBuckets; ++i) {
+      mtime_hist[i].Merge(other.mtime_hist[i]);
+      atime_hist[i].Merge(other.atime_hist[i]);
+    }
+    largest.Merge(std::move(other.largest));
+    deepest.Merge(std::move(other.deepest));
+    widest.Merge(std::move(other.widest));
+  }
+};
+
+static std::string ExtensionOf(const std::string& name) {
+  const size_t dot = name.rfind('.');
+  if (dot == std::string::npos || dot == 0 || dot + 1 == name.size()) {
+    return "(none)";
+  }
+  return ToLowerAscii(name.substr(dot));
+}
+
+// One parallel walk that answers "what is taking space here": totals by
+// extension, log2 size histogram, mtime/atime age histograms, the largest
+// files, the deepest paths and the directories with the most entries.
+static void HandleAnalyzeCommand(const std::vector<std::string>& tokens) {
+  LinkPolicy links = LinkPolicy::kPhysical;
+  size_t top = 10;
+  std::vector<std::string> args;
+  for (size_t i = 1; i < tokens.size(); ++i) {
+    if (ParseLinkPolicyFlag(tokens[i], &links)) {
+      continue;
+    }
+    if (tokens[i] == "-n") {
+      if (i + 1 >= tokens.size() || !ParseCountValue(tokens[i + 1], &top)) {
+        std::cout << "Invalid option: -n\n";
+        return;
+      }
+      ++i;
+    } else if (tokens[i].size() > 1 && tokens[i][0] == '-') {
+      std::cout << "Invalid option: " << tokens[i] << "\n";
+      return;
+    } else {
+      args.push_back(tokens[i]);
+    }
+  }
+  const std::string root = args.empty() ? std::string(".") : args[0];
+  struct stat st;
+  if (!g_vfs->StatAt(AT_FDCWD, root, true, &st) || !S_ISDIR(st.st_mode)) {
+    std::cout << "Invalid directory: " << root << "\n";
+    return;
+  }
+
+  const unsigned workers = WalkWorkerCount();
+  std::vector<TreeStats> stats(workers, TreeStats(top));
+  const std::time_t now = std::time(nullptr);
+  WalkOptions options;
+  options.links = links;
+  ParallelWalkTree(root, options, workers, [&](WalkDir& dir, unsigned worker) {
+    TreeStats& s = stats[worker];
+    if (s.widest.Wants(dir.entries.size())) {
+      s.widest.Push(dir.entries.size(), dir.path);
+    }
+    for (const auto& entry : dir.entries) {
+      if (entry.IsDir()) {
+        ++s.dirs;
+        continue;
+      }
+      if (!entry.IsFile()) {
+        ++s.others;
+        continue;
+      }
+      const auto size = static_cast<std::uint64_t>(entry.st.st_size);
+      ++s.files;
+      s.bytes += size;
+      s.by_ext[ExtensionOf(entry.name)].Add(size);
+      s.size_hist[Log2Bucket(size)].Add(size);
+      s.mtime_hist[AgeBucket(now, entry.st.st_mtime)].Add(size);
+      s.atime_hist[AgeBucket(now, entry.st.st_atime)].Add(size);
+      if (s.largest.Wants(size)) {
+        s.largest.Push(size, entry.path);
+      }
+      const auto depth = static_cast<std::uint64_t>(dir.depth + 1);
+      if (s.deepest.Wants(depth)) {
+        s.deepest.Push(depth, entry.path);
+      }
+    }
+    return WalkAction::kContinue;
+  });
+  for (unsigned w = 1; w < workers; ++w) {
+    stats[0].Merge(std::move(stats[w]));
+  }
+  const TreeStats& total = stats[0];
+
+  std::ostringstream out;
+  out << "Analysis of " << root << ": " << total.files << " files, " << total.dirs
+      << " directories, " << total.others << " other, " << FormatBytes(total.bytes) << "\n";
+
+  std::vector<std::pair<std::string, CountBytes>> exts(total.by_ext.begin(), total.by_ext.end());
+  std::sort(exts.begin(), exts.end(), [](const auto& a, const auto& b) {
+    return a.second.bytes != b.second.bytes ? a.second.bytes > b.second.bytes : a.first < b.first;
+  });
+  if (exts.size() > top) {
+    exts.resize(top);
+  }
+  out << "By extension:\n";
+  for (const auto& kv : exts) {
+    out << "  " << std::left << std::setw(12) << kv.first << std::right << std::setw(10)
+        << kv.second.count << " files " << std::setw(12) << FormatBytes(kv.second.bytes) << "\n";
+  }
+
+  out << "File sizes:\n";
+  for (int i = 0; i < 65; ++i) {
+    if (total.size_hist[i].count == 0) {
+      continue;
+    }
+    const std::string range =
+        i == 0 ? std::string("0 B")
+               : "[" + Pow2Label(i - 1) + ", " + (i == 64 ? std::string("inf") : Pow2Label(i)) + ")";
+    out << "  " << std::left << std::setw(24) << range << std::right << std::setw(10)
+        << total.size_hist[i].count << " files " << std::setw(12)
+        << FormatBytes(total.size_hist[i].bytes) << "\n";
+  }
+
+  const std::pair<const char*, const CountBytes*> ages[] = {
+      {"Modified:\n", total.mtime_hist}, {"Accessed:\n", total.atime_hist}};
+  for (const auto& age : ages) {
+    out << age.first;
+    for (int i = 0; i < kAgeBuckets; ++i) {
+      if (age.second[i].count != 0) {
+        out << "  " << std::left << std::setw(12) << kAgeLabels[i] << std::right << std::setw(10)
+            << age.second[i].count << " files " << std::setw(12)
+            << FormatBytes(age.second[i].bytes) << "\n";
+      }
+    }
+  }
+
+  out << "Largest files:\n";
+  for (const auto& item : total.largest.Sorted()) {
+    out << "  " << std::right << std::setw(12) << FormatBytes(item.first) << "  " << item.second
+        << "\n";
+  }
+  out << "Deepest paths:\n";
+  for (const auto& item : total.deepest.Sorted()) {
+    out << "  " << std::right << std::setw(4) << item.first << "  " << item.second << "\n";
+  }
+  out << "Most entries:\n";
+  for (const auto& item : total.widest.Sorted()) {
+    out << "  " << std::right << std::setw(8) << item.first << "  " << item.second << "\n";
+  }
+  std::cout << out.str();
+}
+
+// The N biggest files below dir. Each walk worker keeps its own bounded
+// min-heap, so memory stays O(N x workers) however large the tree is, and
+// nothing but the N winners is ever materialized.
+static void HandleLargestCommand(const std::vector<std::string>& tokens) {
+  LinkPolicy links = LinkPolicy::kPhysical;
+  size_t top = 10;
+  std::vector<std::string> args;
+  for (size_t i = 1; i < tokens.size(); ++i) {
+    if (ParseLinkPolicyFlag(tokens[i], &links)) {
+      continue;
+    }
+    if (tokens[i] == "-n") {
+      if (i + 1 >= tokens.size() || !ParseCountValue(tokens[i + 1], &top)) {
+        std::cout << "Invalid option: -n\n";
+        return;
+      }
+      ++i;
+    } else if (tokens[i].size() > 1 && tokens[i][0] == '-') {
+      std::cout << "Invalid option: " << tokens[i] << "\n";
+      return;
+    } else {
+      args.push_back(tokens[i]);
+    }
+  }
+  const std::string root = args.empty() ? std::string(".") : args[0];
+  struct stat st;
+  if (!g_vfs->StatAt(AT_FDCWD, root, true, &st) || !S_ISDIR(st.st_mode)) {
+    std::cout << "Invalid directory: " << root << "\n";
+    return;
+  }
+
+  const unsigned workers = WalkWorkerCount();
+  std::vector<TopN<std::string>> heaps(workers, TopN<std::string>(top));
+  WalkOptions options;
+  options.links = links;
+  ParallelWalkTree(root, options, workers, [&](WalkDir& dir, unsigned worker) {
+    TopN<std::string>& heap = heaps[worker];
+    for (const auto& entry : dir.entries) {
+      const auto size = static_cast<std::uint64_t>(entry.st.st_size);
+      if (entry.IsFile() && heap.Wants(size)) {
+        heap.Push(size, entry.path);
+      }
+    }
+    return WalkAction::kContinue;
+  });
+  for (unsigned w = 1; w < workers; ++w) {
+    heaps[0].Merge(std::move(heaps[w]));
+  }
+
+  const auto items = heaps[0].Sorted();
+  if (items.empty()) {
+    std::cout << "No files found in " << root << "\n";
+    return;
+  }
+  std::ostringstream out;
+  out << "Largest " << items.size() << " files in " << root << ":\n";
+  for (const auto& item : items) {
+    out << "  " << std::right << std::setw(12) << FormatBytes(item.first) << "  " << item.second
+        << "\n";
+  }
+  std::cout << out.str();
+}
+
+// Parses an age such as "90s", "30m", "12h", "14d" or "2w" into seconds
+// (a bare number means days).
+static bool ParseAge(const std::string& text, std::int64_t* seconds) {
+  if (text.empty() || !std::isdigit(static_cast<unsigned char>(text[0]))) {
+    return false;
+  }
+  char* end = nullptr;
+  const long long n = std::strtoll(text.c_str(), &end, 10);
+  const std::string unit = ToLowerAscii(end);
+  std::int64_t scale = 0;
+  if (unit == "s") {
+    scale = 1;
+  } else if (unit == "m") {
+    scale = 60;
+  } else if (unit == "h") {
+    scale = 3600;
+  } else if (unit.empty() || unit == "d") {
+    scale = 86400;
+  } else if (unit == "w") {
+    scale = 7 * 86400;
+  } else {
+    return false;
+  }
+  if (n < 0 || n > INT64_MAX / scale) {
+    return false;
+  }
+  *seconds = n * scale;
+  return true;
+}
+
+// Deletes files below dir whose mtime is older than the given age, except
+// the newest --keep N files of each directory; directories emptied by this
+// are then removed bottom-up (dir itself is kept). Rules are evaluated per
+// directory listing during one parallel walk and the deletions are issued
+// by the walk workers, so --dry-run costs exactly the walk.
+static void HandlePruneCommand(const std::vector<std::string>& tokens) {
+  std::int64_t age = -1;
+  size_t keep = 0;
+  bool dry_run = false;
+  std::vector<std::string> args;
+  for (size_t i = 1; i < tokens.size(); ++i) {
+    const std::string& t = tokens[i];
+    if (t == "--older-than") {
+      if (i + 1 >= tokens.size() || !ParseAge(tokens[i + 1], &age)) {
+        std::cout << "Invalid option: --older-than\n";
+        return;
+      }
+      ++i;
+    } else if (t == "--keep") {
+      if (i + 1 >= tokens.size() || !ParseNonNegativeCount(tokens[i + 1], &keep)) {
+        std::cout << "Invalid option: --keep\n";
+        return;
+      }
+      ++i;
+    } else if (t == "-n" || t == "--dry-run") {
+      dry_run = true;
+    } else if (t.size() > 1 && t[0] == '-') {
+      std::cout << "Invalid option: " << t << "\n";
+      return;
+    } else {
+      args.push_back(t);
+    }
+  }
+  if (age < 0 || args.size() != 1) {
+    std::cout << "Missing age or directory: Please enter 'prune --older-than [age] [dir]'\n";
+    return;
+  }
+  const std::string& root = args[0];
+  struct stat st;
+  if (!g_vfs->StatAt(AT_FDCWD, root, false, &st) || !S_ISDIR(st.st_mode)) {
+    std::cout << "Invalid directory: " << root << "\n";
+    return;
+  }
+  const std::int64_t cutoff = static_cast<std::int64_t>(std::time(nullptr)) - age;
+
+  struct DirResult {
+    std::string path;
+    int depth = 0;
+    size_t remaining = 0;  // entries left after this directory's deletions
+    bool pruned = false;   // something below it was deleted
+  };
+  struct WorkerResult {
+    std::vector<DirResult> dirs;
+    std::uint64_t files = 0;
+    std::uint64_t bytes = 0;
+    std::string log;
+  };
+  const unsigned workers = WalkWorkerCount();
+  std::vector<WorkerResult> results(workers);
+
+  ParallelWalkTree(root, WalkOptions{}, workers, [&](WalkDir& dir, unsigned worker) {
+    WorkerResult& r = results[worker];
+    std::vector<const WalkEntry*> candidates;
+    for (const auto& entry : dir.entries) {
+      if (entry.stat_ok && !S_ISDIR(entry.st.st_mode)) {
+        candidates.push_back(&entry);
+      }
+    }
+    // Newest first; the first `keep` survive regardless of age.
+    std::sort(candidates.begin(), candidates.end(), [](const WalkEntry* a, const WalkEntry* b) {
+      return a->st.st_mtime > b->st.st_mtime;
+    });
+    DirResult result;
+    result.path = dir.path;
+    result.depth = dir.depth;
+    result.remaining = dir.entries.size();
+    for (size_t k = keep; k < candidates.size(); ++k) {
+      const WalkEntry& entry = *candidates[k];
+      if (static_cast<std::int64_t>(entry.st.st_mtime) >= cutoff) {
+        continue;
+      }
+      if (dry_run) {
+        r.log += "Would delete: " + entry.path + "\n";
+      } else if (!g_vfs->RemoveAt(AT_FDCWD, entry.path, false)) {
+        r.log += "Failed to delete file: " + entry.path + "\n";
+        continue;
+      }
+      ++r.files;
+      r.bytes += static_cast<std::uint64_t>(entry.st.st_size);
+      --result.remaining;
+      result.pruned = true;
+    }
+    r.dirs.push_back(std::move(result));
+    return WalkAction::kContinue;
+  });
+
+  std::vector<DirResult> dirs;
+  std::uint64_t files = 0;
+  std::uint64_t bytes = 0;
+  std::string log;
+  for (auto& r : results) {
+    files += r.files;
+    bytes += r.bytes;
+    log += r.log;
+    for (auto& d : r.dirs) {
+      dirs.push_back(std::move(d));
+    }
+  }
+
+  // Deepest first, so a directory is settled before its parent looks at it.
+  std::sort(dirs.begin(), dirs.end(),
+            [](const DirResult& a, const DirResult& b) { return a.depth > b.depth; });
+  std::unordered_map<std::string, size_t> index;
+  for (size_t k = 0; k < dirs.size(); ++k) {
+    index.emplace(dirs[k].path, k);
+  }
+  std::uint64_t removed_dirs = 0;
+  for (const DirResult& d : dirs) {
+    if (d.depth == 0 || !d.pruned || d.remaining != 0) {
+      continue;
+    }
+    if (dry_run) {
+      log += "Would delete: " + d.path + "\n";
+    } else if (!g_vfs->RemoveAt(AT_FDCWD, d.path, true)) {
+      log += "Failed to delete directory: " + d.path + "\n";
+      continue;
+    }
+    ++removed_dirs;
+    const auto parent = index.find(SplitParentLeaf(d.path).first);
+    if (parent != index.end()) {
+      --dirs[parent->second].remaining;
+      dirs[parent->second].pruned = true;
+    }
+  }
+
+  std::cout << log;
+  if (dry_run) {
+    std::cout << "Would prune " << files << " files and " << removed_dirs << " directories, freeing "
+              << FormatBytes(bytes) << " (dry run)\n";
+  } else {
+    std::cout << "Pruned " << files << " files and " << removed_dirs << " directories, freed "
+              << FormatBytes(bytes) << "\n";
+  }
+}
+
+// Whole namespace in memory: fast, deterministic trees for tests, and
+// walker benchmarks at scales no test disk holds. Paths are resolved
+// lexically against the backend's own working directory (which starts as
+// the real one); there are no links and no file contents. Directory handles
+// are slots holding the directory's absolute path.
+class MemoryVfs : public Vfs {
+ public:
+  explicit MemoryVfs(const std::string& cwd) : cwd_(Normalize("/", cwd)) {
+    root_.mode = S_IFDIR | 0755;
+    root_.ino = next_ino_++;
+    root_.mtime = std::time(nullptr);
+    root_.children = std::make_unique<Children>();
+    Node* node = &root_;
+    for (const auto& part : Split(cwd_)) {
+      node = &node->children->emplace(part, MakeNode(S_IFDIR | 0755)).first->second;
+    }
+  }
+
+  std::string Describe() const override { return "memory"; }
+  bool Posix() const override { return false; }
+
+  bool ListDir(const std::string& path, LinkPolicy, std::vector<WalkEntry>* entries) override {
+    std::shared_lock<std::shared_mutex> lock(mu_);
+    const Node* node = FindDir(Normalize(cwd_, path));
+    if (node == nullptr) {
+      return false;
+    }
+    entries->reserve(entries->size() + node->children->size());
+    for (const auto& kv : *node->children) {
+      WalkEntry entry;
+      entry.name = kv.first;
+      entry.path = JoinPath(path, kv.first);
+      FillStat(kv.second, &entry.st);
+      entry.stat_ok = true;
+      entries->push_back(std::move(entry));
+    }
+    return true;
+  }
+
+  bool IsEmptyDir(const std::string& path) override {
+    std::shared_lock<std::shared_mutex> lock(mu_);
+    const Node* node = FindDir(Normalize(cwd_, path));
+    return node != nullptr && node->children->empty();
+  }
+
+  bool StatAt(int dir, const std::string& path, bool, struct stat* st) override {
+    std::shared_lock<std::shared_mutex> lock(mu_);
+    const Node* node = Find(Resolve(dir, path));
+    if (node == nullptr) {
+      return false;
+    }
+    FillStat(*node, st);
+    return true;
+  }
+
+  bool QueryInfo(const std::string& path, bool follow, FileInfo* info) override {
+    struct stat st;
+    if (!StatAt(AT_FDCWD, path, follow, &st)) {
+      return false;
+    }
+    info->mode = st.st_mode;
+    info->size = static_cast<std::uint64_t>(st.st_size);
+    info->blocks = static_cast<std::uint64_t>(st.st_blocks);
+    info->inode = static_cast<std::uint64_t>(st.st_ino);
+    info->links = static_cast<std::uint64_t>(st.st_nlink);
+    info->modify_time = st.st_mtime;
+    info->access_time = st.st_atime;
+    return true;
+  }
+
+  std::string ReadLinkAt(int, const std::string&) override {
+    errno = EINVAL;
+    return {};
+  }
+
+  int OpenDir(const std::string& path) override {
+    std::unique_lock<std::shared_mutex> lock(mu_);
+    std::string abs = Normalize(cwd_, path);
+    if (FindDir(abs) == nullptr) {
+      return -1;
+    }
+    if (free_handles_.empty()) {
+      handles_.push_back(std::move(abs));
+      return static_cast<int>(handles_.size() - 1);
+    }
+    const int handle = free_handles_.back();
+    free_handles_.pop_back();
+    handles_[static_cast<size_t>(handle)] = std::move(abs);
+    return handle;
+  }
+
+  void CloseDir(int dir) override {
+    std::unique_lock<std::shared_mutex> lock(mu_);
+    if (dir >= 0 && static_cast<size_t>(dir) < handles_.size()) {
+      handles_[static_cast<size_t>(dir)].clear();
+      free_handles_.push_back(dir);
+    }
+  }
+
+  bool CreateFileAt(int dir, const std::string& name, mode_t mode) override {
+    return Insert(dir, name, S_IFREG | (mode & 07777));
+  }
+
+  bool MakeDirAt(int dir, const std::string& name, mode_t mode) override {
+    return Insert(dir, name, S_IFDIR | (mode & 07777));
+  }
+
+  bool RemoveAt(int dir, const std::string& name, bool directory) override {
+    std::unique_lock<std::shared_mutex> lock(mu_);
+    const std::string abs = Resolve(dir, name);
+    Node* parent = FindDir(ParentOf(abs));
+    const auto it = parent == nullptr ? Children::iterator() : parent->children->find(LeafOf(abs));
+    if (parent == nullptr || it == parent->children->end()) {
+      errno = ENOENT;
+      return false;
+    }
+    const bool is_dir = S_ISDIR(it->second.mode);
+    if (directory != is_dir) {
+      errno = directory ? ENOTDIR : EISDIR;
+      return false;
+    }
+    if (is_dir && !it->second.children->empty()) {
+      errno = ENOTEMPTY;
+      return false;
+    }
+    parent->children->erase(it);
+    return true;
+  }
+
+  bool RenameAt(int from_dir, const std::string& from, int to_dir, const std::string& to,
+                bool no_replace) override {
+    std::unique_lock<std::shared_mutex> lock(mu_);
+    const std::string src = Resolve(from_dir, from);
+    const std::string dst = Resolve(to_dir, to);
+    Node* src_parent = FindDir(ParentOf(src));
+    Node* dst_parent = FindDir(ParentOf(dst));
+    if (src_parent == nullptr || dst_parent == nullptr ||
+        src_parent->children->count(LeafOf(src)) == 0) {
+      errno = ENOENT;
+      return false;
+    }
+    if (src == dst) {
+      return true;
+    }
+    if (dst.rfind(src + "/", 0) == 0) {
+      errno = EINVAL;  // a directory cannot move into itself
+      return false;
+    }
+    const auto existing = dst_parent->children->find(LeafOf(dst));
+    if (existing != dst_parent->children->end()) {
+      const Node& moving = src_parent->children->find(LeafOf(src))->second;
+      if (no_replace) {
+        errno = EEXIST;
+        return false;
+      }
+      if (S_ISDIR(existing->second.mode) != S_ISDIR(moving.mode)) {
+        errno = S_ISDIR(existing->second.mode) ? EISDIR : ENOTDIR;
+        return false;
+      }
+      if (S_ISDIR(existing->second.mode) && !existing->second.children->empty()) {
+        errno = ENOTEMPTY;
+        return false;
+      }
+      dst_parent->children->erase(existing);
+    }
+    auto handle = src_parent->children->extract(LeafOf(src));
+    handle.key() = LeafOf(dst);
+    dst_parent->children->insert(std::move(handle));
+    return true;
+  }
+
+  bool ChangeDir(const std::string& path) override {
+    std::unique_lock<std::shared_mutex> lock(mu_);
+    std::string abs = Normalize(cwd_, path);
+    if (FindDir(abs) == nullptr) {
+      return false;
+    }
+    cwd_ = std::move(abs);
+    return true;
+  }
 
-  fs::path dst_file = dst_arg;
-  if (fs::exists(dst_arg, ec) && !ec && fs::is_directory(dst_arg, ec) && !ec) {
-    dst_file = dst_arg / src.filename();
+  std::string CurrentDir() override {
+    std::shared_lock<std::shared_mutex> lock(mu_);
+    return cwd_;
   }
 
-  fs::path parent = dst_file.parent_path();
-  if (parent.empty()) {
-    parent = fs::path(".");
+  // Fills the working directory with count files, fanout per directory,
+  // in a balanced tree of "dNN" directories. Sizes (log-uniform up to
+  // 16 MiB), mtimes (up to three years back) and extensions are derived from
+  // the file number, so the same arguments always build the same tree.
+  // Returns the number of directories created.
+  std::uint64_t Generate(std::uint64_t count, std::uint64_t fanout) {
+    static const char* const kExts[] = {".txt", ".log", ".jpg", ".dat", ".cpp", ".json", ""};
+    std::unique_lock<std::shared_mutex> lock(mu_);
+    Node* base = FindDir(cwd_);
+    const std::uint64_t leaves = (count + fanout - 1) / fanout;
+    int levels = 0;
+    for (std::uint64_t span = 1; span < leaves; span *= fanout) {
+      ++levels;
+    }
+    const std::time_t now = std::time(nullptr);
+    std::uint64_t dirs = 0;
+    std::vector<Node*> path(static_cast<size_t>(levels) + 1, base);
+    std::uint64_t current_leaf = UINT64_MAX;
+    for (std::uint64_t i = 0; i < count; ++i) {
+      const std::uint64_t leaf = i / fanout;
+      if (leaf != current_leaf) {
+        current_leaf = leaf;
+        std::uint64_t rest = leaf;
+        std::vector<std::uint64_t> digits(static_cast<size_t>(levels));
+        for (int l = levels - 1; l >= 0; --l) {
+          digits[static_cast<size_t>(l)] = rest % fanout;
+          rest /= fanout;
+        }
+        for (int l = 0; l < levels; ++l) {
+          char name[32];
+          std::snprintf(name, sizeof(name), "d%02llu",
+                        static_cast<unsigned long long>(digits[static_cast<size_t>(l)]));
+          auto inserted = path[static_cast<size_t>(l)]->children->emplace(name, MakeNode(S_IFDIR | 0755));
+          dirs += inserted.second ? 1 : 0;
+          path[static_cast<size_t>(l) + 1] = &inserted.first->second;
+        }
+      }
+      std::uint64_t h = i + 0x9E3779B97F4A7C15ULL;
+      h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+      h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+      h ^= h >> 31;
+      Node file = MakeNode(S_IFREG | 0644);
+      file.size = (h >> 8) & ((std::uint64_t{1} << (h % 25)) - 1);
+      file.mtime = static_cast<std::int64_t>(now) - static_cast<std::int64_t>((h >> 32) % (3 * 365 * 86400));
+      path[static_cast<size_t>(levels)]->children->emplace(
+          "f" + std::to_string(i) + kExts[(h >> 40) % (sizeof(kExts) / sizeof(kExts[0]))],
+          std::move(file));
+    }
+    return dirs;
   }
-  if (!fs::exists(parent, ec) || ec || !fs::is_directory(parent, ec) || ec) {
-    std::cout << "Invalid target path\n";
-    return;
+
+ private:
+  struct Node;
+  using Children = std::map<std::string, Node>;
+  struct Node {
+    mode_t mode = 0;
+    std::uint64_t size = 0;
+    std::int64_t mtime = 0;
+    std::uint64_t ino = 0;
+    std::unique_ptr<Children> children;  // directories only
+  };
+
+  static constexpr dev_t kDevice = 0x6d656d;
+
+  Node MakeNode(mode_t mode) {
+    Node node;
+    node.mode = mode;
+    node.ino = next_ino_++;
+    node.mtime = std::time(nullptr);
+    if (S_ISDIR(mode)) {
+      node.children = std::make_unique<Children>();
+    }
+    return node;
   }
-  if (fs::exists(dst_file, ec) && !ec && fs::is_directory(dst_file, ec) && !ec) {
-    std::cout << "Invalid target path\n";
-    return;
+
+  static void FillStat(const Node& node, struct stat* st) {
+    *st = {};
+    st->st_mode = node.mode;
+    st->st_size = static_cast<off_t>(node.size);
+    st->st_blocks = static_cast<blkcnt_t>((node.size + 511) / 512);
+    st->st_blksize = 4096;
+    st->st_ino = static_cast<ino_t>(node.ino);
+    st->st_dev = kDevice;
+    st->st_nlink = S_ISDIR(node.mode) ? 2 : 1;
+    st->st_uid = ::getuid();
+    st->st_gid = ::getgid();
+    st->st_mtim.tv_sec = static_cast<time_t>(node.mtime);
+    st->st_atim = st->st_mtim;
+    st->st_ctim = st->st_mtim;
   }
 
-  fs::copy_options options = fs::copy_options::none;
-  if (fs::exists(dst_file, ec) && !ec) {
-    std::cout << "File exists in target: Overwrite? (y/n)" << std::flush;
-    std::string confirm;
-    if (!std::getline(std::cin, confirm)) {
-      return;
+  static std::vector<std::string> Split(const std::string& abs) {
+    std::vector<std::string> parts;
+    size_t pos = 1;
+    while (pos < abs.size()) {
+      const size_t slash = abs.find('/', pos);
+      const size_t end = slash == std::string::npos ? abs.size() : slash;
+      parts.push_back(abs.substr(pos, end - pos));
+      pos = end + 1;
     }
-    if (confirm != "y") {
-      return;
+    return parts;
+  }
+
+  // Absolute path without ".", ".." or empty components.
+  static std::string Normalize(const std::string& base, const std::string& path) {
+    std::vector<std::string> parts = path.empty() || path[0] != '/' ? Split(base)
+                                                                    : std::vector<std::string>();
+    size_t pos = 0;
+    while (pos <= path.size()) {
+      const size_t slash = path.find('/', pos);
+      const size_t end = slash == std::string::npos ? path.size() : slash;
+      const std::string part = path.substr(pos, end - pos);
+      if (part == "..") {
+        if (!parts.empty()) {
+          parts.pop_back();
+        }
+      } else if (!part.empty() && part != ".") {
+        parts.push_back(part);
+      }
+      pos = end + 1;
     }
-    options = fs::copy_options::overwrite_existing;
+    std::string out;
+    for (const auto& part : parts) {
+      out += "/" + part;
+    }
+    return out.empty() ? "/" : out;
   }
 
-  if (!fs::copy_file(src, dst_file, options, ec) || ec) {
-    std::cout << "Invalid target path\n";
+  static std::string ParentOf(const std::string& abs) {
+    const size_t slash = abs.rfind('/');
+    return slash == 0 ? "/" : abs.substr(0, slash);
   }
-}
 
-static void HandleMvCommand(const std::vector<std::string>& tokens) {
-  if (tokens.size() < 3) {
-    std::cout << "Invalid target path\n";
-    return;
+  static std::string LeafOf(const std::string& abs) { return abs.substr(abs.rfind('/') + 1); }
+
+  std::string Resolve(int dir, const std::string& path) const {
+    const std::string& base =
+        (dir >= 0 && static_cast<size_t>(dir) < handles_.size()) ? handles_[static_cast<size_t>(dir)] : cwd_;
+    return Normalize(base, path);
   }
 
-  namespace fs = std::filesystem;
-  const fs::path src = fs::path(tokens[1]);
-  const fs::path dst_arg = fs::path(tokens[2]);
+  Node* Find(const std::string& abs) const {
+    const Node* node = &root_;
+    for (const auto& part : Split(abs)) {
+      if (!node->children) {
+        errno = ENOTDIR;
+        return nullptr;
+      }
+      const auto it = node->children->find(part);
+      if (it == node->children->end()) {
+        errno = ENOENT;
+        return nullptr;
+      }
+      node = &it->second;
+    }
+    return const_cast<Node*>(node);
+  }
 
-  std::error_code ec;
-  if (!fs::exists(src, ec) || ec) {
-    std::cout << "Source not found\n";
-    return;
+  Node* FindDir(const std::string& abs) const {
+    Node* node = Find(abs);
+    if (node != nullptr && !node->children) {
+      errno = ENOTDIR;
+      return nullptr;
+    }
+    return node;
   }
 
-  fs::path dst_final = dst_arg;
-  if (fs::exists(dst_arg, ec) && !ec && fs::is_directory(dst_arg, ec) && !ec) {
-    dst_final = dst_arg / src.filename();
+  bool Insert(int dir, const std::string& name, mode_t mode) {
+    std::unique_lock<std::shared_mutex> lock(mu_);
+    const std::string abs = Resolve(dir, name);
+    Node* parent = FindDir(ParentOf(abs));
+    if (parent == nullptr || abs == "/") {
+      return false;
+    }
+    if (!parent->children->emplace(LeafOf(abs), MakeNode(mode)).second) {
+      errno = EEXIST;
+      return false;
+    }
+    return true;
   }
 
-  fs::path parent = dst_final.parent_path();
-  if (parent.empty()) {
-    parent = fs::path(".");
+  mutable std::shared_mutex mu_;
+  Node root_;
+  std::string cwd_;
+  std::uint64_t next_ino_ = 1;
+  std::vector<std::string> handles_;
+  std::vector<int> free_handles_;
+};
+
+// Decorator that sleeps before forwarding each call, to emulate NFS or FUSE
+// round trips on a local tree: latency plus uniform jitter in
+// [-jitter, +jitter] microseconds. A listing pays one round trip for the
+// directory read and one per entry for its stat, like a client without
+// READDIRPLUS; handle bookkeeping (CloseDir, CurrentDir) is free.
+class LatencyVfs : public Vfs {
+ public:
+  LatencyVfs(std::unique_ptr<Vfs> inner, unsigned latency_us, unsigned jitter_us)
+      : inner_(std::move(inner)), latency_us_(latency_us), jitter_us_(jitter_us) {}
+
+  std::unique_ptr<Vfs> Release() { return std::move(inner_); }
+
+  std::string Describe() const override {
+    return "latency " + std::to_string(latency_us_) + "us +/- " + std::to_string(jitter_us_) +
+           "us over " + inner_->Describe() + " (" + std::to_string(calls_.load()) +
+           " calls, " + std::to_string(delayed_us_.load() / 1000) + " ms injected)";
   }
-  if (!fs::exists(parent, ec) || ec || !fs::is_directory(parent, ec) || ec) {
-    std::cout << "Invalid target path\n";
+  bool Posix() const override { return inner_->Posix(); }
+
+  bool ListDir(const std::string& path, LinkPolicy links,
+               std::vector<WalkEntry>* entries) override {
+    const size_t before = entries->size();
+    Delay(1);
+    const bool ok = inner_->ListDir(path, links, entries);
+    Delay(entries->size() - before);
+    return ok;
+  }
+  bool IsEmptyDir(const std::string& path) override {
+    Delay(1);
+    return inner_->IsEmptyDir(path);
+  }
+  bool StatAt(int dir, const std::string& path, bool follow, struct stat* st) override {
+    Delay(1);
+    return inner_->StatAt(dir, path, follow, st);
+  }
+  bool QueryInfo(const std::string& path, bool follow, FileInfo* info) override {
+    Delay(1);
+    return inner_->QueryInfo(path, follow, info);
+  }
+  std::string ReadLinkAt(int dir, const std::string& path) override {
+    Delay(1);
+    return inner_->ReadLinkAt(dir, path);
+  }
+  int OpenDir(const std::string& path) override {
+    Delay(1);
+    return inner_->OpenDir(path);
+  }
+  void CloseDir(int dir) override { inner_->CloseDir(dir); }
+  bool CreateFileAt(int dir, const std::string& name, mode_t mode) override {
+    Delay(1);
+    return inner_->CreateFileAt(dir, name, mode);
+  }
+  bool MakeDirAt(int dir, const std::string& name, mode_t mode) override {
+    Delay(1);
+    return inner_->MakeDirAt(dir, name, mode);
+  }
+  bool RemoveAt(int dir, const std::string& name, bool directory) override {
+    Delay(1);
+    return inner_->RemoveAt(dir, name, directory);
+  }
+  bool RenameAt(int from_dir, const std::string& from, int to_dir, const std::string& to,
+                bool no_replace) override {
+    Delay(1);
+    return inner_->RenameAt(from_dir, from, to_dir, to, no_replace);
+  }
+  bool ChangeDir(const std::string& path) override {
+    Delay(1);
+    return inner_->ChangeDir(path);
+  }
+  std::string CurrentDir() override { return inner_->CurrentDir(); }
+
+ private:
+  void Delay(size_t calls) {
+    if (calls == 0) {
+      return;
+    }
+    thread_local std::minstd_rand rng(std::random_device{}());
+    std::int64_t total = 0;
+    for (size_t i = 0; i < calls; ++i) {
+      std::int64_t us = latency_us_;
+      if (jitter_us_ > 0) {
+        us += static_cast<std::int64_t>(rng() % (2 * jitter_us_ + 1)) - jitter_us_;
+      }
+      total += std::max<std::int64_t>(0, us);
+    }
+    calls_ += calls;
+    delayed_us_ += static_cast<std::uint64_t>(total);
+    std::this_thread::sleep_for(std::chrono::microseconds(total));
+  }
+
+  std::unique_ptr<Vfs> inner_;
+  std::int64_t latency_us_;
+  std::int64_t jitter_us_;
+  std::atomic<std::uint64_t> calls_{0};
+  std::atomic<std::uint64_t> delayed_us_{0};
+};
+
+static void HandleVfsCommand(const std::vector<std::string>& tokens) {
+  const std::string sub = tokens.size() >= 2 ? tokens[1] : "status";
+  if (sub == "status") {
+    std::cout << "VFS: " << g_vfs->Describe() << "\n";
     return;
   }
-  if (fs::exists(dst_final, ec) && !ec) {
-    std::cout << "Invalid target path\n";
+  if (sub == "posix") {
+    g_vfs = std::make_unique<PosixVfs>();
+    std::cout << "VFS: " << g_vfs->Describe() << "\n";
     return;
   }
-
-  fs::rename(src, dst_final, ec);
-  if (!ec) {
+  if (sub == "mem") {
+    std::uint64_t count = 0;
+    size_t fanout = 64;
+    for (size_t i = 2; i < tokens.size(); ++i) {
+      size_t value = 0;
+      if (tokens[i] == "--fanout" && i + 1 < tokens.size() &&
+          ParseCountValue(tokens[i + 1], &fanout)) {
+        ++i;
+      } else if (ParseCountValue(tokens[i], &value)) {
+        count = value;
+      } else {
+        std::cout << "Invalid option: " << tokens[i] << "\n";
+        return;
+      }
+    }
+    auto mem = std::make_unique<MemoryVfs>(g_vfs->CurrentDir());
+    const std::uint64_t dirs = count > 0 ? mem->Generate(count, std::max<size_t>(fanout, 2)) : 0;
+    g_vfs = std::move(mem);
+    std::cout << "VFS: " << g_vfs->Describe();
+    if (count > 0) {
+      std::cout << " (" << count << " files in " << dirs << " directories)";
+    }
+    std::cout << "\n";
     return;
   }
-
-  if (fs::is_regular_file(src, ec) && !ec) {
-    std::error_code copy_ec;
-    if (!fs::copy_file(src, dst_final, fs::copy_options::none, copy_ec) || copy_ec) {
-      std::cout << "Invalid target path\n";
+  if (sub == "latency") {
+    size_t latency = 0;
+    size_t jitter = 0;
+    if (tokens.size() < 3 || tokens.size() > 4 ||
+        !ParseNonNegativeCount(tokens[2], &latency) ||
+        (tokens.size() == 4 && !ParseNonNegativeCount(tokens[3], &jitter))) {
+      std::cout << "Missing latency: Please enter 'vfs latency [us] [jitter_us]'\n";
       return;
     }
-    std::error_code remove_ec;
-    if (!fs::remove(src, remove_ec) || remove_ec) {
-      std::cout << "Invalid target path\n";
-      return;
+    if (auto* wrapped = dynamic_cast<LatencyVfs*>(g_vfs.get())) {
+      g_vfs = wrapped->Release();
+    }
+    if (latency > 0 || jitter > 0) {
+      g_vfs = std::make_unique<LatencyVfs>(std::move(g_vfs), static_cast<unsigned>(latency),
+                                           static_cast<unsigned>(jitter));
     }
+    std::cout << "VFS: " << g_vfs->Describe() << "\n";
     return;
   }
-
-  std::cout << "Invalid target path\n";
+  std::cout << "Invalid option: " << sub << "\n";
 }
 
-static std::uintmax_t CalculateDirectorySizeBytes(
-    const std::filesystem::path& dir_path) {
-  namespace fs = std::filesystem;
-  std::uintmax_t total = 0;
+// Idle priority for "throttle --idle": the I/O scheduler serves the idle
+// class only while no one else wants the disk, and nice 19 does the same for
+// the CPU. On Linux both are per-thread attributes even when set with
+// "who = 0", so they are applied to every thread in /proc/self/task; worker
+// pools started later inherit them from the main thread.
+struct IdlePriority {
+  bool enabled = false;
+  long saved_ioprio = 0;
+  int saved_nice = 0;
+};
 
-  std::error_code ec;
-  for (fs::recursive_directory_iterator it(
-           dir_path, fs::directory_options::skip_permission_denied, ec);
-       !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
-    const fs::directory_entry& entry = *it;
-    std::error_code entry_ec;
-    if (!entry.is_regular_file(entry_ec) || entry_ec) {
+static IdlePriority g_idle;
+
+#if defined(__linux__)
+// Sets the I/O priority and nice value of every thread of this process.
+static bool SetThreadPriorities(long ioprio, int nice) {
+  constexpr int kIoprioWhoProcess = 1;  // with a tid: that thread only
+  DIR* tasks = ::opendir("/proc/self/task");
+  if (tasks == nullptr) {
+    return ::syscall(SYS_ioprio_set, kIoprioWhoProcess, 0, ioprio) == 0 &&
+           ::setpriority(PRIO_PROCESS, 0, nice) == 0;
+  }
+  bool ok = true;
+  while (const struct dirent* entry = ::readdir(tasks)) {
+    if (entry->d_name[0] == '.') {
       continue;
     }
-    std::error_code size_ec;
-    const auto size_value = fs::file_size(entry.path(), size_ec);
-    if (!size_ec) {
-      total += size_value;
+    const int tid = std::atoi(entry->d_name);
+    // A thread that exited in the meantime (ESRCH) needs nothing.
+    if ((::syscall(SYS_ioprio_set, kIoprioWhoProcess, tid, ioprio) != 0 && errno != ESRCH) ||
+        (::setpriority(PRIO_PROCESS, static_cast<id_t>(tid), nice) != 0 && errno != ESRCH)) {
+      ok = false;
+      break;
     }
   }
+  const int saved_errno = errno;
+  ::closedir(tasks);
+  errno = saved_errno;
+  return ok;
+}
+#endif
 
-  return total;
+static bool SetIdlePriority(bool enable) {
+  if (enable == g_idle.enabled) {
+    return true;
+  }
+#if defined(__linux__)
+  constexpr int kIoprioWhoProcess = 1;
+  constexpr long kIoprioIdle = 3L << 13;  // IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT
+  if (enable) {
+    const long ioprio = ::syscall(SYS_ioprio_get, kIoprioWhoProcess, 0);
+    errno = 0;
+    const int nice = ::getpriority(PRIO_PROCESS, 0);
+    if (ioprio < 0 || (nice == -1 && errno != 0) || !SetThreadPriorities(kIoprioIdle, 19)) {
+      return false;
+    }
+    g_idle.saved_ioprio = ioprio;
+    g_idle.saved_nice = nice;
+    g_idle.enabled = true;
+    return true;
+  }
+  // Lowering nice again needs CAP_SYS_NICE (or RLIMIT_NICE); without it the
+  // process stays idle.
+  if (!SetThreadPriorities(g_idle.saved_ioprio, g_idle.saved_nice)) {
+    return false;
+  }
+  g_idle.enabled = false;
+  return true;
+#else
+  errno = ENOTSUP;
+  return false;
+#endif
 }
 
-static void HandleDuCommand(const std::vector<std::string>& tokens) {
-  if (tokens.size() < 2) {
-    std::cout << "Missing directory name: Please enter 'du [name]'\n";
+// Applies throttle flags, from the "throttle" command or the command line.
+// Flags not given keep their current setting; "off" clears everything.
+// Prints the problem and returns false on a bad flag.
+static bool ApplyThrottleFlags(const std::vector<std::string>& args) {
+  double iops = g_io_throttle.iops();
+  double bandwidth = g_io_throttle.bandwidth();
+  bool idle = g_idle.enabled;
+  for (size_t i = 0; i < args.size(); ++i) {
+    const std::string& arg = args[i];
+    if (arg == "off") {
+      iops = 0;
+      bandwidth = 0;
+      idle = false;
+    } else if (arg == "--idle") {
+      idle = true;
+    } else if (arg == "--max-iops") {
+      size_t value = 0;
+      if (i + 1 >= args.size() || !ParseNonNegativeCount(args[i + 1], &value)) {
+        std::cout << "Invalid option: --max-iops\n";
+        return false;
+      }
+      iops = static_cast<double>(value);
+      ++i;
+    } else if (arg == "--max-bandwidth") {
+      std::uint64_t value = 0;
+      if (i + 1 >= args.size() || !ParseByteSize(args[i + 1], &value)) {
+        std::cout << "Invalid option: --max-bandwidth\n";
+        return false;
+      }
+      bandwidth = static_cast<double>(value);
+      ++i;
+    } else {
+      std::cout << "Invalid option: " << arg << "\n";
+      return false;
+    }
+  }
+  g_io_throttle.Configure(iops, bandwidth);
+  if (!SetIdlePriority(idle)) {
+    std::cout << "Failed to change priority: " << std::strerror(errno) << "\n";
+    return false;
+  }
+  return true;
+}
+
+static void PrintThrottleStatus() {
+  std::vector<std::string> parts;
+  if (g_io_throttle.iops() > 0) {
+    parts.push_back(std::to_string(static_cast<std::uint64_t>(g_io_throttle.iops())) + " IOPS");
+  }
+  if (g_io_throttle.bandwidth() > 0) {
+    parts.push_back(FormatBytes(static_cast<std::uint64_t>(g_io_throttle.bandwidth())) + "/s");
+  }
+  if (g_idle.enabled) {
+    parts.push_back("idle priority");
+  }
+  std::cout << "I/O throttle: ";
+  if (parts.empty()) {
+    std::cout << "off";
+  }
+  for (size_t i = 0; i < parts.size(); ++i) {
+    std::cout << (i > 0 ? ", " : "") << parts[i];
+  }
+  std::cout << "\n";
+}
+
+static void HandleThrottleCommand(const std::vector<std::string>& tokens) {
+  if (ApplyThrottleFlags(std::vector<std::string>(tokens.begin() + 1, tokens.end()))) {
+    PrintThrottleStatus();
+  }
+}
+
+static void PrintStatOrder() {
+  switch (g_stat_order.load()) {
+    case StatOrder::kAuto:
+      std::cout << "Stat order: auto (inode order on rotational devices)\n";
+      break;
+    case StatOrder::kReaddir:
+      std::cout << "Stat order: readdir\n";
+      break;
+    case StatOrder::kInode:
+      std::cout << "Stat order: inode\n";
+      break;
+  }
+}
+
+// "statorder [auto|inode|readdir]", also the --stat-order command line flag.
+static bool SetStatOrder(const std::string& value) {
+  if (value == "auto") {
+    g_stat_order = StatOrder::kAuto;
+  } else if (value == "inode") {
+    g_stat_order = StatOrder::kInode;
+  } else if (value == "readdir") {
+    g_stat_order = StatOrder::kReaddir;
+  } else {
+    std::cout << "Invalid option: " << value << "\n";
+    return false;
+  }
+  return true;
+}
+
+static void HandleStatOrderCommand(const std::vector<std::string>& tokens) {
+  if (tokens.size() > 2) {
+    std::cout << "Invalid option: " << tokens[2] << "\n";
     return;
   }
+  if (tokens.size() == 2 && !SetStatOrder(tokens[1])) {
+    return;
+  }
+  PrintStatOrder();
+}
 
-  const std::string& arg = tokens[1];
-  namespace fs = std::filesystem;
-  const fs::path dir_path(arg);
+static std::string JournalDefaultPath() { return StateDir() + "/audit.journal"; }
 
-  std::error_code ec;
-  if (!fs::exists(dir_path, ec) || ec || !fs::is_directory(dir_path, ec) || ec) {
-    std::cout << "Invalid directory: " << arg << "\n";
+// "journal on [FILE] [--fsync-every N] [--fsync-ms MS]", also used for the
+// --journal command line flag. Prints the problem and returns false on error.
+static bool StartJournal(const std::vector<std::string>& args) {
+  std::string path;
+  size_t fsync_every = 256;
+  size_t fsync_ms = 100;
+  for (size_t i = 0; i < args.size(); ++i) {
+    if (args[i] == "--fsync-every" || args[i] == "--fsync-ms") {
+      size_t* value = args[i] == "--fsync-every" ? &fsync_every : &fsync_ms;
+      if (i + 1 >= args.size() || !ParseCountValue(args[i + 1], value)) {
+        std::cout << "Invalid option: " << args[i] << "\n";
+        return false;
+      }
+      ++i;
+    } else if (path.empty() && args[i].rfind("--", 0) != 0) {
+      path = args[i];
+    } else {
+      std::cout << "Invalid option: " << args[i] << "\n";
+      return false;
+    }
+  }
+  if (path.empty()) {
+    path = JournalDefaultPath();
+    if (!MakeStateDir(StateDir())) {
+      std::cout << "Failed to open journal: " << path << "\n";
+      return false;
+    }
+  }
+  path = AbsolutePath(path);
+  if (!g_journal.Start(path, fsync_every, static_cast<unsigned>(fsync_ms))) {
+    std::cout << "Failed to open journal: " << path << "\n";
+    return false;
+  }
+  JournalOperation(JournalOp::kSession, GetCwd(), {}, 0);
+  return true;
+}
+
+static void PrintJournalStatus() {
+  if (!g_journal.enabled()) {
+    std::cout << "Journal: off\n";
     return;
   }
+  g_journal.Flush();
+  std::cout << "Journal: on, " << g_journal.path() << " (" << g_journal.records()
+            << " records, " << g_journal.syncs() << " fsyncs; fsync every "
+            << g_journal.fsync_every() << " records or " << g_journal.fsync_ms() << " ms";
+  if (g_journal.failed()) {
+    std::cout << "; write errors";
+  }
+  std::cout << ")\n";
+}
 
-  const std::uintmax_t bytes = CalculateDirectorySizeBytes(dir_path);
-  const std::uintmax_t kb = 1024;
-  const std::uintmax_t mb = 1024 * 1024;
-  if (bytes >= mb) {
-    const std::uintmax_t value = (bytes + (mb / 2)) / mb;
-    std::cout << "Total size of " << arg << ": " << value << " MB\n";
+// Decodes a journal, resolving relative paths against the working directory
+// recorded for the same process, and prints the records that pass the
+// filters. A damaged or partly written tail ends the listing.
+static void ShowJournal(const std::vector<std::string>& args) {
+  std::string path;
+  std::string op_filter;
+  std::string path_filter;
+  std::int64_t since = -1;
+  bool failed_only = false;
+  for (size_t i = 0; i < args.size(); ++i) {
+    const std::string& t = args[i];
+    if (t == "--op" && i + 1 < args.size()) {
+      op_filter = args[++i];
+    } else if (t == "--path" && i + 1 < args.size()) {
+      path_filter = args[++i];
+    } else if (t == "--since") {
+      if (i + 1 >= args.size() || !ParseAge(args[i + 1], &since)) {
+        std::cout << "Invalid option: --since\n";
+        return;
+      }
+      ++i;
+    } else if (t == "--failed") {
+      failed_only = true;
+    } else if (path.empty() && t.rfind("--", 0) != 0) {
+      path = t;
+    } else {
+      std::cout << "Invalid option: " << t << "\n";
+      return;
+    }
+  }
+  if (path.empty()) {
+    path = g_journal.enabled() ? g_journal.path() : JournalDefaultPath();
+  }
+  if (g_journal.enabled() && AbsolutePath(path) == g_journal.path()) {
+    g_journal.Flush();
+  }
+
+  std::ifstream in(path, std::ios::binary);
+  char magic[sizeof(kJournalMagic)];
+  if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, kJournalMagic, sizeof(magic)) != 0) {
+    std::cout << "Not a journal: " << path << "\n";
     return;
   }
-  const std::uintmax_t value = (bytes + (kb / 2)) / kb;
-  std::cout << "Total size of " << arg << ": " << value << " KB\n";
+  const std::uint64_t since_ns =
+      since < 0 ? 0
+                : static_cast<std::uint64_t>(std::max<std::int64_t>(std::time(nullptr) - since, 0)) *
+                      1000000000ull;
+  std::unordered_map<std::uint32_t, std::string> cwd_by_pid;
+  std::uint64_t offset = sizeof(kJournalMagic);
+  std::uint64_t total = 0;
+  std::uint64_t shown = 0;
+  std::string body;
+  std::ostringstream out;
+  while (true) {
+    char header[8];
+    if (!in.read(header, sizeof(header))) {
+      if (in.gcount() != 0) {
+        out << "Journal damaged at offset " << offset << "\n";
+      }
+      break;
+    }
+    std::uint32_t size = 0;
+    std::uint32_t checksum = 0;
+    std::memcpy(&size, header, 4);
+    std::memcpy(&checksum, header + 4, 4);
+    body.resize(size);
+    if (size < kJournalBodyHeader || !in.read(&body[0], size) ||
+        Xxh32(reinterpret_cast<const unsigned char*>(body.data()), size, 0) != checksum) {
+      out << "Journal damaged at offset " << offset << "\n";
+      break;
+    }
+    offset += sizeof(header) + size;
+
+    std::uint64_t time_ns = 0;
+    std::uint32_t pid = 0;
+    std::int32_t error = 0;
+    std::uint32_t path_size = 0;
+    std::uint32_t target_size = 0;
+    std::memcpy(&time_ns, body.data(), 8);
+    std::memcpy(&pid, body.data() + 8, 4);
+    std::memcpy(&error, body.data() + 12, 4);
+    const auto op = static_cast<JournalOp>(body[16]);
+    std::memcpy(&path_size, body.data() + 20, 4);
+    std::memcpy(&target_size, body.data() + 24, 4);
+    if (static_cast<std::uint64_t>(path_size) + target_size != size - kJournalBodyHeader) {
+      out << "Journal damaged at offset " << offset - sizeof(header) - size << "\n";
+      break;
+    }
+    std::string a = body.substr(kJournalBodyHeader, path_size);
+    std::string b = body.substr(kJournalBodyHeader + path_size, target_size);
+    if (op == JournalOp::kSession || op == JournalOp::kCd) {
+      cwd_by_pid[pid] = a;
+    } else {
+      const auto it = cwd_by_pid.find(pid);
+      if (it != cwd_by_pid.end()) {
+        if (!a.empty() && a[0] != '/') {
+          a = JoinPath(it->second, a);
+        }
+        if (!b.empty() && b[0] != '/' && b[0] != '(') {
+          b = JoinPath(it->second, b);
+        }
+      }
+    }
+    ++total;
+
+    if ((!op_filter.empty() && op_filter != JournalOpName(op)) || time_ns < since_ns ||
+        (failed_only && error == 0) ||
+        (!path_filter.empty() && a.find(path_filter) == std::string::npos &&
+         b.find(path_filter) == std::string::npos)) {
+      continue;
+    }
+    ++shown;
+    char millis[8];
+    std::snprintf(millis, sizeof(millis), ".%03u",
+                  static_cast<unsigned>(time_ns / 1000000 % 1000));
+    out << FormatLocalTime(static_cast<std::time_t>(time_ns / 1000000000)) << millis << " ["
+        << pid << "] " << JournalOpName(op) << " " << a;
+    if (!b.empty()) {
+      out << " -> " << b;
+    }
+    if (error != 0) {
+      out << "  failed: " << std::strerror(error);
+    }
+    out << "\n";
+  }
+  out << "Shown " << shown << " of " << total << " records\n";
+  std::cout << out.str();
+}
+
+static void HandleJournalCommand(const std::vector<std::string>& tokens) {
+  const std::string sub = tokens.size() >= 2 ? tokens[1] : "status";
+  const std::vector<std::string> args(tokens.begin() + std::min<size_t>(tokens.size(), 2),
+                                      tokens.end());
+  if (sub == "on") {
+    if (StartJournal(args)) {
+      PrintJournalStatus();
+    }
+  } else if (sub == "off") {
+    g_journal.Stop();
+    PrintJournalStatus();
+  } else if (sub == "status") {
+    PrintJournalStatus();
+  } else if (sub == "show") {
+    ShowJournal(args);
+  } else {
+    std::cout << "Invalid option: " << sub << "\n";
+  }
+}
+
+// Commands that read or write file contents, which only real files have.
+static bool NeedsFileContents(const std::string& cmd) {
+  static const char* const kCommands[] = {"cat",  "head", "tail",   "grep", "cp",
+                                          "hash", "pack", "unpack", "sync"};
+  for (const char* name : kCommands) {
+    if (cmd == name) {
+      return true;
+    }
+  }
+  return false;
 }
 
 static void HandleCdCommand(const std::vector<std::string>& tokens) {
@@ -655,7 +8520,7 @@ static void HandleCdCommand(const std::vector<std::string>& tokens) {
   }
 
   struct stat st;
-  if (target.empty() || ::stat(target.c_str(), &st) != 0) {
+  if (target.empty() || !g_vfs->StatAt(AT_FDCWD, target, true, &st)) {
     std::cout << "Invalid directory: " << arg << "\n";
     return;
   }
@@ -663,15 +8528,62 @@ static void HandleCdCommand(const std::vector<std::string>& tokens) {
     std::cout << "Not a directory: " << arg << "\n";
     return;
   }
-  if (::chdir(target.c_str()) != 0) {
+  if (!g_vfs->ChangeDir(target)) {
     std::cout << "Invalid directory: " << arg << "\n";
     return;
   }
+  if (g_journal.enabled()) {
+    JournalOperation(JournalOp::kCd, g_vfs->CurrentDir(), {}, 0);
+  }
 }
 
 int main(int argc, char** argv) {
-  if (argc >= 2) {
-    const std::string initial_dir = argv[1];
+  // MiniFileExplorer [--trace FILE] [--journal FILE] [--max-iops N]
+  //                  [--max-bandwidth SIZE] [--idle] [dir]
+  std::vector<std::string> throttle_flags;
+  std::string journal_path;
+  std::string initial_dir;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg.rfind("--", 0) != 0) {
+      initial_dir = arg;
+      continue;
+    }
+    if (arg == "--trace") {
+      if (i + 1 >= argc) {
+        std::cout << "Invalid option: --trace\n";
+        return 1;
+      }
+      StartTrace(argv[++i]);
+      continue;
+    }
+    if (arg == "--stat-order") {
+      if (i + 1 >= argc) {
+        std::cout << "Invalid option: --stat-order\n";
+        return 1;
+      }
+      if (!SetStatOrder(argv[++i])) {
+        return 1;
+      }
+      continue;
+    }
+    if (arg == "--journal") {
+      if (i + 1 >= argc) {
+        std::cout << "Invalid option: --journal\n";
+        return 1;
+      }
+      journal_path = argv[++i];
+      continue;
+    }
+    throttle_flags.push_back(arg);
+    if ((arg == "--max-iops" || arg == "--max-bandwidth") && i + 1 < argc) {
+      throttle_flags.push_back(argv[++i]);
+    }
+  }
+  if (!ApplyThrottleFlags(throttle_flags)) {
+    return 1;
+  }
+  if (!initial_dir.empty()) {
     struct stat st;
     if (::stat(initial_dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) ||
         ::chdir(initial_dir.c_str()) != 0) {
@@ -687,6 +8599,9 @@ int main(int argc, char** argv) {
   }
 
   std::cout << "Current Directory: " << cwd << "\n";
+  if (!journal_path.empty() && !StartJournal({journal_path})) {
+    return 1;
+  }
 
   std::string line;
   while (true) {
@@ -706,14 +8621,35 @@ int main(int argc, char** argv) {
     }
 
     const std::string& cmd = tokens[0];
+    const TraceSpan command_span("command", g_tracer.enabled ? TraceIntern(cmd) : "");
     if (cmd == "exit") {
       std::cout << "MiniFileExplorer closed successfully\n";
       break;
     }
+    if (NeedsFileContents(cmd) && !g_vfs->Posix()) {
+      std::cout << "Not supported on the memory VFS: " << cmd << "\n";
+      continue;
+    }
     if (cmd == "help") {
       PrintHelp();
       continue;
     }
+    if (cmd == "vfs") {
+      HandleVfsCommand(tokens);
+      continue;
+    }
+    if (cmd == "throttle") {
+      HandleThrottleCommand(tokens);
+      continue;
+    }
+    if (cmd == "statorder") {
+      HandleStatOrderCommand(tokens);
+      continue;
+    }
+    if (cmd == "journal") {
+      HandleJournalCommand(tokens);
+      continue;
+    }
     if (cmd == "cd") {
       HandleCdCommand(tokens);
       continue;
@@ -738,6 +8674,14 @@ int main(int argc, char** argv) {
       HandleRmdirCommand(tokens);
       continue;
     }
+    if (cmd == "trash") {
+      HandleTrashCommand(tokens);
+      continue;
+    }
+    if (cmd == "undo") {
+      HandleUndoCommand(tokens);
+      continue;
+    }
     if (cmd == "stat") {
       HandleStatCommand(tokens);
       continue;
@@ -746,6 +8690,14 @@ int main(int argc, char** argv) {
       HandleSearchCommand(tokens);
       continue;
     }
+    if (cmd == "grep") {
+      HandleGrepCommand(tokens);
+      continue;
+    }
+    if (cmd == "cat" || cmd == "head" || cmd == "tail") {
+      HandlePreviewCommand(tokens);
+      continue;
+    }
     if (cmd == "cp") {
       HandleCpCommand(tokens);
       continue;
@@ -754,13 +8706,48 @@ int main(int argc, char** argv) {
       HandleMvCommand(tokens);
       continue;
     }
+    if (cmd == "rename") {
+      HandleRenameCommand(tokens);
+      continue;
+    }
+    if (cmd == "sync") {
+      HandleSyncCommand(tokens);
+      continue;
+    }
     if (cmd == "du") {
       HandleDuCommand(tokens);
       continue;
     }
+    if (cmd == "analyze") {
+      HandleAnalyzeCommand(tokens);
+      continue;
+    }
+    if (cmd == "largest") {
+      HandleLargestCommand(tokens);
+      continue;
+    }
+    if (cmd == "prune") {
+      HandlePruneCommand(tokens);
+      continue;
+    }
+    if (cmd == "hash") {
+      HandleHashCommand(tokens);
+      continue;
+    }
+    if (cmd == "pack") {
+      HandlePackCommand(tokens);
+      continue;
+    }
+    if (cmd == "unpack") {
+      HandleUnpackCommand(tokens);
+      continue;
+    }
 
     std::cout << "Unknown command: " << cmd << "\n";
   }
 
+  FinishTrashPurge();
+  g_journal.Stop();
+  FinishTrace();
   return 0;
 }